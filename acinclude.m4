@@ -10,6 +10,20 @@ AC_DEFUN([AC_PROG_CC_PIE], [
 	])
 ])
 
+AC_DEFUN([AC_PROG_CC_LEAF_FP], [
+	leaf_fp="-mno-omit-leaf-frame-pointer"
+	AC_CACHE_CHECK([whether ${CC-cc} accepts $leaf_fp],
+					ac_cv_prog_cc_leaf_fp, [
+		echo 'void f(){}' > conftest.c
+		if test -z "`${CC-cc} $leaf_fp -c conftest.c 2>&1`"; then
+			ac_cv_prog_cc_leaf_fp=yes
+		else
+			ac_cv_prog_cc_leaf_fp=no
+		fi
+		rm -rf conftest*
+	])
+])
+
 AC_DEFUN([COMPILER_WARNING_CFLAGS], [
 	warn_cflags=""
 	if (test "$USE_MAINTAINER_MODE" = "yes"); then
@@ -42,6 +56,25 @@ AC_DEFUN([COMPILER_BUILD_CFLAGS], [
 			build_cflags="$build_cflags -g"
 		fi
 	])
+	AC_ARG_ENABLE(profiling, AC_HELP_STRING([--enable-profiling],
+			[optimized build for perf: symbols and frame pointers]), [
+		if (test "${enableval}" = "yes"); then
+			build_cflags="$build_cflags -O2 -g"
+			build_cflags="$build_cflags -fno-omit-frame-pointer"
+			# x86 only: leaf functions keep their frame too
+			AC_PROG_CC_LEAF_FP
+			if (test "${ac_cv_prog_cc_leaf_fp}" = "yes"); then
+				build_cflags="$build_cflags $leaf_fp"
+			fi
+		fi
+	])
+	AC_ARG_ENABLE(lto, AC_HELP_STRING([--enable-lto],
+			[enable link time optimization]), [
+		if (test "${enableval}" = "yes"); then
+			build_cflags="$build_cflags -flto"
+			build_ldflags="$build_ldflags -flto"
+		fi
+	])
 	AC_ARG_ENABLE(pie, AC_HELP_STRING([--enable-pie],
 			[enable position independent executables flag]), [
 		if (test "${enableval}" = "yes" &&
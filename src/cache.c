@@ -0,0 +1,288 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2017, CESAR. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the CESAR nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL CESAR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include <knot_protocol.h>
+
+#include "log.h"
+#include "cache.h"
+
+#define CACHE_MAGIC		"KNOTDEV1"
+#define CACHE_SLOTS		256
+#define CACHE_SLOT_SIZE		4096
+/* First slot holds the header */
+#define CACHE_SIZE		((CACHE_SLOTS + 1) * CACHE_SLOT_SIZE)
+
+/* SHA256 in hexadecimal: tokens are not stored in clear */
+#define TOKEN_DIGEST_LEN	64
+
+#define SLOT_EMPTY		0
+#define SLOT_USED		1
+#define SLOT_REMOVED		2	/* Keeps probe sequences intact */
+
+struct cache_header {
+	char magic[8];
+	uint32_t slots;
+	uint32_t slot_size;
+};
+
+struct cache_slot {
+	char uuid[KNOT_PROTOCOL_UUID_LEN + 1];
+	char digest[TOKEN_DIGEST_LEN + 1];
+	uint8_t state;
+	int64_t stamp;			/* Wall clock of the last store (s) */
+	uint32_t len;
+	char doc[];
+};
+
+#define CACHE_DOC_SIZE	(CACHE_SLOT_SIZE - sizeof(struct cache_slot))
+
+/* Shared by the session workers */
+G_LOCK_DEFINE_STATIC(cache);
+static uint8_t *cache;
+static unsigned int cache_ttl;
+
+static struct cache_slot *slot_at(unsigned int i)
+{
+	return (struct cache_slot *) (cache + (i + 1) * CACHE_SLOT_SIZE);
+}
+
+static void token_digest(const char *token, char *digest)
+{
+	char *sum;
+
+	sum = g_compute_checksum_for_string(G_CHECKSUM_SHA256, token, -1);
+	g_strlcpy(digest, sum, TOKEN_DIGEST_LEN + 1);
+	g_free(sum);
+}
+
+/* Open addressing on the uuid: linear probing from its home slot */
+static struct cache_slot *slot_find(const char *uuid)
+{
+	struct cache_slot *slot;
+	unsigned int i, home;
+
+	home = g_str_hash(uuid) % CACHE_SLOTS;
+
+	for (i = 0; i < CACHE_SLOTS; i++) {
+		slot = slot_at((home + i) % CACHE_SLOTS);
+		if (slot->state == SLOT_EMPTY)
+			break;
+
+		if (slot->state == SLOT_USED &&
+				!strncmp(slot->uuid, uuid, sizeof(slot->uuid)))
+			return slot;
+	}
+
+	return NULL;
+}
+
+/* First free slot of the probe sequence, the oldest entry if full */
+static struct cache_slot *slot_alloc(const char *uuid)
+{
+	struct cache_slot *slot, *oldest = NULL;
+	unsigned int i, home;
+
+	home = g_str_hash(uuid) % CACHE_SLOTS;
+
+	for (i = 0; i < CACHE_SLOTS; i++) {
+		slot = slot_at((home + i) % CACHE_SLOTS);
+		if (slot->state != SLOT_USED)
+			return slot;
+
+		if (oldest == NULL || slot->stamp < oldest->stamp)
+			oldest = slot;
+	}
+
+	return oldest;
+}
+
+int cache_open(const char *path, unsigned int ttl)
+{
+	struct cache_header *header;
+	struct stat st;
+	char *dir;
+	void *mem;
+	int fd, err;
+
+	dir = g_path_get_dirname(path);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		err = -errno;
+		log_error("cache open(%s): %s(%d)", path, strerror(-err), -err);
+		return err;
+	}
+
+	if (fstat(fd, &st) < 0 || (st.st_size != CACHE_SIZE &&
+					ftruncate(fd, CACHE_SIZE) < 0)) {
+		err = -errno;
+		log_error("cache size(%s): %s(%d)", path, strerror(-err), -err);
+		close(fd);
+		return err;
+	}
+
+	mem = mmap(NULL, CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (mem == MAP_FAILED) {
+		err = -errno;
+		log_error("cache mmap(%s): %s(%d)", path, strerror(-err), -err);
+		return err;
+	}
+
+	/* New file or different layout: start empty */
+	header = mem;
+	if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) ||
+				header->slots != CACHE_SLOTS ||
+				header->slot_size != CACHE_SLOT_SIZE) {
+		memset(mem, 0, CACHE_SIZE);
+		memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+		header->slots = CACHE_SLOTS;
+		header->slot_size = CACHE_SLOT_SIZE;
+	}
+
+	cache = mem;
+	cache_ttl = ttl;
+
+	log_info("Device cache: %s (TTL %us)", path, ttl);
+
+	return 0;
+}
+
+void cache_close(void)
+{
+	if (cache == NULL)
+		return;
+
+	msync(cache, CACHE_SIZE, MS_SYNC);
+	munmap(cache, CACHE_SIZE);
+	cache = NULL;
+}
+
+char *cache_lookup(const char *uuid, const char *token)
+{
+	struct cache_slot *slot;
+	char digest[TOKEN_DIGEST_LEN + 1];
+	char *doc = NULL;
+	gint64 now;
+
+	if (cache == NULL)
+		return NULL;
+
+	token_digest(token, digest);
+	now = g_get_real_time() / G_USEC_PER_SEC;
+
+	G_LOCK(cache);
+
+	slot = slot_find(uuid);
+	if (slot == NULL)
+		goto done;
+
+	/* Token changed: the device was registered again */
+	if (strncmp(slot->digest, digest, sizeof(slot->digest)))
+		goto done;
+
+	/* Expired, or clock moved backwards */
+	if (slot->stamp > now || now - slot->stamp > cache_ttl)
+		goto done;
+
+	if (slot->len > CACHE_DOC_SIZE)
+		goto done;
+
+	doc = g_strndup(slot->doc, slot->len);
+
+done:
+	G_UNLOCK(cache);
+
+	return doc;
+}
+
+int cache_store(const char *uuid, const char *token, const char *doc)
+{
+	struct cache_slot *slot;
+	size_t len;
+
+	if (cache == NULL)
+		return 0;
+
+	len = strlen(doc);
+	if (len > CACHE_DOC_SIZE)
+		return -ENOSPC;
+
+	G_LOCK(cache);
+
+	slot = slot_find(uuid);
+	if (slot == NULL)
+		slot = slot_alloc(uuid);
+
+	/* Partially written entries are never valid */
+	slot->state = SLOT_REMOVED;
+
+	g_strlcpy(slot->uuid, uuid, sizeof(slot->uuid));
+	token_digest(token, slot->digest);
+	slot->stamp = g_get_real_time() / G_USEC_PER_SEC;
+	slot->len = len;
+	memcpy(slot->doc, doc, len);
+
+	slot->state = SLOT_USED;
+
+	G_UNLOCK(cache);
+
+	/* Written back by the kernel: no fsync on the session path */
+	msync(cache, CACHE_SIZE, MS_ASYNC);
+
+	return 0;
+}
+
+void cache_remove(const char *uuid)
+{
+	struct cache_slot *slot;
+
+	if (cache == NULL)
+		return;
+
+	G_LOCK(cache);
+
+	slot = slot_find(uuid);
+	if (slot)
+		slot->state = SLOT_REMOVED;
+
+	G_UNLOCK(cache);
+}
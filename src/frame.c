@@ -0,0 +1,110 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2017, CESAR. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the CESAR nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL CESAR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <glib.h>
+
+#include "frame.h"
+
+static void ring_peek(const struct frame_ring *ring, size_t offset,
+						uint8_t *dst, size_t len)
+{
+	size_t start = (ring->head + offset) & (FRAME_RING_SIZE - 1);
+	size_t first = MIN(len, FRAME_RING_SIZE - start);
+
+	memcpy(dst, &ring->buffer[start], first);
+	memcpy(dst + first, ring->buffer, len - first);
+}
+
+void frame_header(uint8_t *hdr, uint64_t pipeid, size_t len)
+{
+	hdr[0] = pipeid >> 32;
+	hdr[1] = pipeid >> 24;
+	hdr[2] = pipeid >> 16;
+	hdr[3] = pipeid >> 8;
+	hdr[4] = pipeid;
+	hdr[5] = len;
+}
+
+ssize_t frame_ring_fill(struct frame_ring *ring, int fd)
+{
+	struct iovec iov[2];
+	size_t tail = (ring->head + ring->len) & (FRAME_RING_SIZE - 1);
+	size_t room = FRAME_RING_SIZE - ring->len;
+	size_t first = MIN(room, FRAME_RING_SIZE - tail);
+	ssize_t rbytes;
+
+	iov[0].iov_base = &ring->buffer[tail];
+	iov[0].iov_len = first;
+	iov[1].iov_base = ring->buffer;
+	iov[1].iov_len = room - first;
+
+	rbytes = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+	if (rbytes > 0)
+		ring->len += rbytes;
+
+	return rbytes;
+}
+
+int frame_ring_next(const struct frame_ring *ring, uint64_t *pipeid)
+{
+	uint8_t hdr[FRAME_HDR_SIZE];
+	size_t size;
+
+	if (ring->len < FRAME_HDR_SIZE)
+		return -EAGAIN;
+
+	ring_peek(ring, 0, hdr, FRAME_HDR_SIZE);
+
+	size = hdr[5];
+	if (ring->len < FRAME_HDR_SIZE + size)
+		return -EAGAIN;
+
+	*pipeid = hdr[4];
+	*pipeid |= hdr[3] << 8;
+	*pipeid |= hdr[2] << 16;
+	*pipeid |= (uint64_t) hdr[1] << 24;
+	*pipeid |= (uint64_t) hdr[0] << 32;
+
+	return size;
+}
+
+void frame_ring_consume(struct frame_ring *ring, uint8_t *dst, size_t len)
+{
+	if (dst)
+		ring_peek(ring, FRAME_HDR_SIZE, dst, len);
+
+	ring->head = (ring->head + FRAME_HDR_SIZE + len) &
+						(FRAME_RING_SIZE - 1);
+	ring->len -= FRAME_HDR_SIZE + len;
+}
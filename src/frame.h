@@ -0,0 +1,58 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2017, CESAR. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the CESAR nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL CESAR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Serial link framing, same on both directions:
+ * byte 0-4: pipe identification (big endian)
+ * byte   5: datagram length
+ * byte 6-x: payload
+ * TTY bytes are not aligned to datagrams: a read may return part of a
+ * frame or many frames. Bytes are buffered in a ring until a whole frame
+ * arrives.
+ */
+
+#define FRAME_HDR_SIZE		6	/* Pipe id + datagram length */
+#define FRAME_MAX_SIZE		(FRAME_HDR_SIZE + 255)
+#define FRAME_RING_SIZE		1024	/* Power of 2 */
+
+struct frame_ring {
+	uint8_t buffer[FRAME_RING_SIZE];
+	size_t head;		/* First byte of the next frame */
+	size_t len;		/* Buffered bytes */
+};
+
+void frame_header(uint8_t *hdr, uint64_t pipeid, size_t len);
+
+/* Reads from 'fd' into the free room of the ring: readv() result */
+ssize_t frame_ring_fill(struct frame_ring *ring, int fd);
+
+/* Payload length of the next complete frame, -EAGAIN if incomplete */
+int frame_ring_next(const struct frame_ring *ring, uint64_t *pipeid);
+
+/* Copies the payload of the next frame to 'dst', if any, and drops it */
+void frame_ring_consume(struct frame_ring *ring, uint8_t *dst, size_t len);
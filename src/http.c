@@ -26,6 +26,10 @@
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <stdio.h>
 #include <stdint.h>
 #include <ctype.h>
@@ -34,6 +38,8 @@
 #include <netdb.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -44,6 +50,10 @@
 #include <json-c/json.h>
 
 #include "log.h"
+#include "settings.h"
+#include "worker.h"
+#include "stats.h"
+#include "trace.h"
 #include "proto.h"
 
 #define CURL_OP_TIMEOUT					30	/* 30 seconds */
@@ -65,30 +75,163 @@
 #define MESHBLU_AUTH_TOKEN			"meshblu_auth_token: "
 #define MESHBLU_AUTH_TOKEN_SIZE			sizeof(MESHBLU_AUTH_TOKEN)
 
+#define HTTP_KEEPIDLE					60	/* seconds */
+#define HTTP_KEEPINTVL					30	/* seconds */
+#define HTTP_CONNECT_TIMEOUT				5000	/* ms */
+
+/*
+ * Device polls: an active device (its document changed recently) is polled
+ * every POLL_INTERVAL_MIN, the interval doubles on each unchanged poll up
+ * to POLL_INTERVAL_MAX. Slots of the wheel are one second long.
+ */
+#define POLL_INTERVAL_MIN				2	/* seconds */
+#define POLL_INTERVAL					10	/* seconds */
+#define POLL_INTERVAL_MAX				60	/* seconds */
+/*
+ * Unchanged documents are delivered anyway after POLL_REDELIVER: msg.c
+ * re-pushes unconfirmed config and pending set/get data on delivery.
+ */
+#define POLL_REDELIVER					30	/* seconds */
+#define POLL_SLOTS					64
+#define POLL_BURST					32	/* per slot */
+
+#define HTTP_ETAG					"ETag:"
+#define HTTP_IF_NONE_MATCH				"If-None-Match: "
+
 static struct in_addr host_addr;
 static unsigned int host_port;
 static char *host_uri;
 static char *device_uri;
 static char *data_uri;
 
+/*
+ * Per cloud session (proto_sock) context. The curl handle is kept
+ * alive across requests, allowing libcurl to reuse the connection
+ * and its internal state. Authentication headers are cached and only
+ * rebuilt when the device credentials change.
+ */
+struct http_session {
+	int sock;
+	CURL *ch;
+	char uuid[MESHBLU_UUID_SIZE + 1];	/* UUID + '\0' */
+	char token[MESHBLU_TOKEN_SIZE + 1];	/* TOKEN + '\0' */
+	struct curl_slist *auth_hdr;		/* Credentials only */
+	struct curl_slist *auth_json_hdr;	/* Credentials + JSON */
+};
+
+/* Maps proto_sock to http_session, shared by the session workers */
+G_LOCK_DEFINE_STATIC(session_table);
+static GHashTable *session_table;
+
+/* JSON headers for requests without credentials (eg: mknode) */
+static struct curl_slist *json_hdr;
+
+/*
+ * Asynchronous requests are driven by a curl multi handle integrated
+ * to the GLib main loop: curl sockets are watched by GIOChannels and
+ * curl timeouts are mapped to GLib timeouts. These requests don't use
+ * the session socket, the multi handle keeps its own connection cache.
+ */
+static CURLM *multi;
+static guint multi_timeout_id;
+static unsigned int request_id;
+
+/* Maps request id to http_request */
+static GHashTable *request_table;
+
+/*
+ * Every device poll is driven by a single timer: each second the devices in
+ * the next slot of the wheel are polled. Watches are spread over the slots,
+ * avoiding bursts of requests to the cloud. Polls run on the main loop,
+ * watches are added and removed by the session workers: the wheel and the
+ * watch tables are protected by the 'poll' lock.
+ */
+G_LOCK_DEFINE_STATIC(poll);
+static GQueue poll_wheel[POLL_SLOTS];
+static unsigned int poll_slot;
+static guint poll_tick_id;
+static unsigned int watch_id;
+
+/* Maps watch id to to_fetch */
+static GHashTable *watch_table;
+
+/* Maps uuid to the latest to_fetch of the device, keys owned by to_fetch */
+static GHashTable *uuid_table;
+
+struct http_request {
+	unsigned int id;
+	CURL *ch;
+	struct curl_slist *headers;
+	char *body;			/* Owned copy of the request body */
+	gboolean device;		/* Response is a 'devices' array */
+	json_tokener *tok;		/* Decodes 'devices' while receiving */
+	json_object *root;		/* Decoded 'devices' response */
+	struct to_fetch *poll;		/* Device poll, NULL otherwise */
+	struct http_async *async;	/* Worker request, NULL otherwise */
+	GChecksum *checksum;		/* Poll: digest of the response */
+	char *etag;			/* Poll: ETag of the response */
+	gboolean redeliver;		/* Poll: deliver even if unchanged */
+	gint64 start;			/* Submission time */
+	json_raw_t json;
+};
+
+/* curl socket watched by the main loop */
+struct multi_sock {
+	GIOChannel *io;
+	guint watch_id;
+};
+
 /* Struct used to fetch data from cloud and send to THING */
 struct to_fetch {
 	int proto_sock;
 	char uuid[MESHBLU_UUID_SIZE+1];		/* UUID + '\0' */
 	char token[MESHBLU_TOKEN_SIZE+1];	/* TOKEN + '\0' */
+	unsigned int id;			/* Watch id */
+	gint refs;				/* Watch table and polls */
+	gboolean removed;			/* Unwatched by msg.c */
+	GMainContext *context;			/* Worker, NULL: main loop */
+	unsigned int interval;			/* Seconds between polls */
+	unsigned int slot;			/* Poll wheel slot */
+	GList link;				/* Poll wheel slot entry */
+	gboolean scheduled;			/* 'link' is in the wheel */
+	unsigned int request_id;		/* Pending fetch, 0 if idle */
+	char *etag;				/* Last device document */
+	char digest[41];			/* SHA1 of the last document */
+	gint64 delivered;			/* Last delivery, main loop */
 	void (*proto_watch_cb)(json_raw_t, void *);
 	void *user_data;
 };
 
-static gboolean http_hup_cb(GIOChannel *io, GIOCondition cond,
-							gpointer user_data)
-{
-	struct to_fetch *fetch_watch = user_data;
+/*
+ * Request of a session worker. The request table and the multi handle
+ * belong to the main loop: it is submitted there, the response is moved
+ * back to the worker of the caller.
+ */
+struct http_async {
+	char *uri;
+	const char *method;
+	char *body;
+	char uuid[MESHBLU_UUID_SIZE+1];
+	char token[MESHBLU_TOKEN_SIZE+1];
+	gboolean device;		/* Response is a 'devices' array */
+	GMainContext *context;		/* Worker, NULL: main loop */
+	proto_async_cb_t cb;
+	void *user_data;
+	int err;
+	json_raw_t json;		/* Response, moved from the request */
+	json_object *root;		/* Owns 'json.jobj' */
+};
 
-	g_free(fetch_watch);
+/* Poll response handed over to the worker of the device */
+struct poll_result {
+	struct to_fetch *data;
+	json_object *root;		/* Response tree, owns 'jobj' */
+	json_object *jobj;		/* Device object */
+};
 
-	return FALSE;
-}
+static void proto_poll_done(struct http_request *req, int err);
+static void async_done(struct http_async *async, struct http_request *req,
+								int err);
 
 static int http2errno(long ehttp)
 {
@@ -146,26 +289,98 @@ static size_t write_cb(void *contents, size_t size, size_t nmemb,
 	return realsize;
 }
 
-static int check_json(const char *json_str, json_raw_t *json)
+/*
+ * Device requests are decoded chunk by chunk: the response body is not
+ * accumulated, the tokener keeps the parser state between chunks.
+ */
+static size_t stream_cb(void *contents, size_t size, size_t nmemb,
+							void *user_data)
 {
-	size_t realsize;
-	const char *jobjstr;
-	json_object *jobj, *jres, *jobjarray;
+	struct http_request *req = user_data;
+	size_t realsize = size * nmemb;
+	enum json_tokener_error jerr;
 
-	jobj = json_tokener_parse(json_str);
+	/* Trailing bytes after the document are ignored */
+	if (req->root)
+		return realsize;
+
+	if (req->checksum)
+		g_checksum_update(req->checksum, (const guchar *) contents,
+								realsize);
+
+	req->root = json_tokener_parse_ex(req->tok, contents, realsize);
+	jerr = json_tokener_get_error(req->tok);
+	if (req->root == NULL && jerr != json_tokener_continue) {
+		log_error("JSON RX: %s", json_tokener_error_desc(jerr));
+		return 0;
+	}
+
+	req->json.size += realsize;
+
+	return realsize;
+}
+
+/* Keeps the ETag of polled device documents for conditional requests */
+static size_t header_cb(char *buffer, size_t size, size_t nitems,
+							void *user_data)
+{
+	struct http_request *req = user_data;
+	size_t realsize = size * nitems;
+	size_t len = strlen(HTTP_ETAG);
+	const char *end = buffer + realsize;
+	const char *value;
+
+	if (realsize <= len ||
+			g_ascii_strncasecmp(buffer, HTTP_ETAG, len) != 0)
+		return realsize;
+
+	value = buffer + len;
+	while (value < end && g_ascii_isspace(*value))
+		value++;
+
+	while (end > value && g_ascii_isspace(end[-1]))
+		end--;
+
+	g_free(req->etag);
+	req->etag = end > value ? g_strndup(value, end - value) : NULL;
+
+	return realsize;
+}
+
+/* Returns the device object from the {"devices": [{...}]} response */
+static json_object *device_object(json_object *jobj)
+{
+	json_object *jobjarray;
 
 	if (jobj == NULL)
-		return -1;
+		return NULL;
 
 	if (!json_object_object_get_ex(jobj, "devices", &jobjarray))
-		return -1;
+		return NULL;
 
 	if (json_object_get_type(jobjarray) != json_type_array ||
 			json_object_array_length(jobjarray) !=
 					EXPECTED_RESPONSE_ARRAY_LENGTH)
+		return NULL;
+
+	return json_object_array_get_idx(jobjarray, 0);
+}
+
+static int check_json(const char *json_str, json_raw_t *json)
+{
+	size_t realsize;
+	const char *jobjstr;
+	json_object *jobj, *jres;
+
+	jobj = json_tokener_parse(json_str);
+
+	jres = device_object(jobj);
+	if (jres == NULL) {
+		if (jobj)
+			json_object_put(jobj);
 		return -1;
+	}
 
-	jres = json_object_array_get_idx(jobjarray, 0);
 	jobjstr = json_object_to_json_string(jres);
 
 	realsize = strlen(jobjstr) + 1;
@@ -173,6 +388,7 @@ static int check_json(const char *json_str, json_raw_t *json)
 	json->data = (char *) realloc(json->data, realsize);
 	if (json->data == NULL) {
 		log_error("Not enough memory");
+		json_object_put(jobj);
 		return -ENOMEM;
 	}
 
@@ -184,15 +400,106 @@ static int check_json(const char *json_str, json_raw_t *json)
 	return 0;
 }
 
+static struct curl_slist *json_headers(struct curl_slist *headers)
+{
+	headers = curl_slist_append(headers, "Accept: application/json");
+	headers = curl_slist_append(headers, "Content-Type: application/json");
+	headers = curl_slist_append(headers, "charsets: utf-8");
+
+	return headers;
+}
+
+static struct curl_slist *auth_headers(struct curl_slist *headers,
+					const char *uuid, const char *token)
+{
+	char token_hdr[MESHBLU_AUTH_TOKEN_SIZE + MESHBLU_TOKEN_SIZE];
+	char uuid_hdr[MESHBLU_AUTH_UUID_SIZE + MESHBLU_UUID_SIZE];
+
+	snprintf(uuid_hdr, sizeof(uuid_hdr), "%s%s", MESHBLU_AUTH_UUID, uuid);
+	headers = curl_slist_append(headers, uuid_hdr);
+	snprintf(token_hdr, sizeof(token_hdr), "%s%s",
+						MESHBLU_AUTH_TOKEN, token);
+	headers = curl_slist_append(headers, token_hdr);
+
+	return headers;
+}
+
+/* Returns cached headers, rebuilding them if credentials changed */
+static struct curl_slist *session_headers(struct http_session *session,
+					const char *uuid, const char *token,
+					gboolean has_json)
+{
+	if (!uuid || !token)
+		return has_json ? json_hdr : NULL;
+
+	if (strcmp(session->uuid, uuid) != 0 ||
+				strcmp(session->token, token) != 0) {
+		curl_slist_free_all(session->auth_hdr);
+		curl_slist_free_all(session->auth_json_hdr);
+
+		session->auth_hdr = auth_headers(NULL, uuid, token);
+		session->auth_json_hdr = json_headers(auth_headers(NULL,
+								uuid, token));
+
+		strncpy(session->uuid, uuid, MESHBLU_UUID_SIZE);
+		strncpy(session->token, token, MESHBLU_TOKEN_SIZE);
+	}
+
+	return has_json ? session->auth_json_hdr : session->auth_hdr;
+}
+
+static CURL *session_handle_new(int *psock)
+{
+	CURL *ch;
+
+	ch = curl_easy_init();
+	if (ch == NULL)
+		return NULL;
+
+	/* Options shared by all requests of this session */
+	curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, write_cb);
+	curl_easy_setopt(ch, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+
+	/* TODO: make sure that it is smaller than KNOT timeout */
+	curl_easy_setopt(ch, CURLOPT_TIMEOUT, CURL_OP_TIMEOUT);
+	curl_easy_setopt(ch, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(ch, CURLOPT_MAXREDIRS, 1L);
+	curl_easy_setopt(ch, CURLOPT_NOPROGRESS, 1L);
+
+	/* Keep the TCP connection open between requests */
+	curl_easy_setopt(ch, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(ch, CURLOPT_TCP_KEEPIDLE, (long) HTTP_KEEPIDLE);
+	curl_easy_setopt(ch, CURLOPT_TCP_KEEPINTVL, (long) HTTP_KEEPINTVL);
+
+	if (psock && *psock > 0) {
+		curl_easy_setopt(ch, CURLOPT_OPENSOCKETFUNCTION, opensocket);
+		curl_easy_setopt(ch, CURLOPT_OPENSOCKETDATA, psock);
+		curl_easy_setopt(ch, CURLOPT_SOCKOPTFUNCTION, sockopt_callback);
+		curl_easy_setopt(ch, CURLOPT_CLOSESOCKETFUNCTION, closesock_cb);
+		curl_easy_setopt(ch, CURLOPT_CLOSESOCKETDATA, psock);
+	}
+
+	return ch;
+}
+
+static void session_free(gpointer user_data)
+{
+	struct http_session *session = user_data;
+
+	curl_easy_cleanup(session->ch);
+	curl_slist_free_all(session->auth_hdr);
+	curl_slist_free_all(session->auth_json_hdr);
+	g_slice_free(struct http_session, session);
+}
+
 /* Fetch and return url body via curl */
 static int fetch_url(int sockfd, const char *action, const char *json,
 			const char *uuid, const char *token,
 			json_raw_t *fetch, const char *request)
 {
-	char token_hdr[MESHBLU_AUTH_TOKEN_SIZE + MESHBLU_TOKEN_SIZE];
-	char uuid_hdr[MESHBLU_AUTH_UUID_SIZE + MESHBLU_UUID_SIZE];
 	char upcase_request[REQUEST_SIZE + 1];
-	struct curl_slist *headers = NULL;
+	struct http_session *session;
+	struct curl_slist *headers;
 	CURL *ch;
 	CURLcode rcode;
 	long ehttp;
@@ -203,14 +510,18 @@ static int fetch_url(int sockfd, const char *action, const char *json,
 		return -EINVAL;
 	}
 
-	log_info("action: %s", action);
+	log_dbg("action: %s", action);
 
-	ch = curl_easy_init();
-	if (ch == NULL) {
-		log_error("curl_easy_init(): init failed");
-		return -ENOMEM;
+	G_LOCK(session_table);
+	session = g_hash_table_lookup(session_table, GINT_TO_POINTER(sockfd));
+	G_UNLOCK(session_table);
+	if (session == NULL) {
+		log_error("No HTTP session for sock %d", sockfd);
+		return -EBADF;
 	}
 
+	ch = session->ch;
+
 	if (fetch->data)
 		free(fetch->data);
 
@@ -221,69 +532,39 @@ static int fetch_url(int sockfd, const char *action, const char *json,
 	for (i = 0; i < strlen(upcase_request); i++)
 		upcase_request[i] = toupper(upcase_request[i]);
 
+	/*
+	 * The handle is reused: HTTPGET resets any previous POSTFIELDS,
+	 * and the method is always overwritten by CUSTOMREQUEST.
+	 */
+	if (json) {
+		curl_easy_setopt(ch, CURLOPT_POSTFIELDS, json);
+		log_dbg(" JSON TX: %s", json);
+	} else
+		curl_easy_setopt(ch, CURLOPT_HTTPGET, 1L);
+
 	curl_easy_setopt(ch, CURLOPT_CUSTOMREQUEST, upcase_request);
 
 	curl_easy_setopt(ch, CURLOPT_URL, action);
 
-	log_info("HTTP(%s): %s", upcase_request, action);
+	log_dbg("HTTP(%s): %s", upcase_request, action);
 
-	if (uuid && token) {
+	if (uuid && token)
+		log_dbg(" AUTH: %s\n       %s", uuid, token);
 
-		snprintf(uuid_hdr, sizeof(uuid_hdr), "%s%s",
-						MESHBLU_AUTH_UUID, uuid);
-		headers = curl_slist_append(headers, uuid_hdr);
-		snprintf(token_hdr, sizeof(token_hdr), "%s%s",
-					MESHBLU_AUTH_TOKEN, token);
-		headers = curl_slist_append(headers, token_hdr);
-		log_info(" AUTH: %s\n       %s", uuid, token);
-	}
+	headers = session_headers(session, uuid, token, json != NULL);
+	curl_easy_setopt(ch, CURLOPT_HTTPHEADER, headers);
 
-	if (json) {
-		headers = curl_slist_append(headers,
-						"Accept: application/json");
-		headers = curl_slist_append(headers,
-					    "Content-Type: application/json");
-		headers = curl_slist_append(headers, "charsets: utf-8");
-		curl_easy_setopt(ch, CURLOPT_POSTFIELDS, json);
-		log_info(" JSON TX: %s", json);
-	}
-
-	if (headers)
-		curl_easy_setopt(ch, CURLOPT_HTTPHEADER, headers);
-
-	curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, write_cb);
 	curl_easy_setopt(ch, CURLOPT_WRITEDATA, fetch);
-	curl_easy_setopt(ch, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-
-	/* TODO: make sure that it is smaller than KNOT timeout */
-	curl_easy_setopt(ch, CURLOPT_TIMEOUT, CURL_OP_TIMEOUT);
-	curl_easy_setopt(ch, CURLOPT_FOLLOWLOCATION, 1L);
-	curl_easy_setopt(ch, CURLOPT_MAXREDIRS, 1L);
-	curl_easy_setopt(ch, CURLOPT_NOPROGRESS, 1L);
-
-	if (sockfd > 0) {
-		curl_easy_setopt(ch, CURLOPT_OPENSOCKETFUNCTION, opensocket);
-		curl_easy_setopt(ch, CURLOPT_OPENSOCKETDATA, &sockfd);
-		curl_easy_setopt(ch, CURLOPT_SOCKOPTFUNCTION, sockopt_callback);
-		curl_easy_setopt(ch, CURLOPT_CLOSESOCKETFUNCTION, closesock_cb);
-		curl_easy_setopt(ch, CURLOPT_CLOSESOCKETDATA, &sockfd);
-	}
 
 	rcode = curl_easy_perform(ch);
 
-	curl_slist_free_all(headers);
-
 	if (rcode != CURLE_OK) {
-		curl_easy_cleanup(ch);
 		log_error("curl_easy_perform(): %s(%d)",
 					curl_easy_strerror(rcode), rcode);
 		return -EIO;
 	}
 
 	rcode = curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &ehttp);
-
-	curl_easy_cleanup(ch);
-
 	if (rcode != CURLE_OK) {
 		log_error("curl_easy_getinfo(): %s(%d)",
 					curl_easy_strerror(rcode), rcode);
@@ -291,23 +572,422 @@ static int fetch_url(int sockfd, const char *action, const char *json,
 	}
 
 	if (fetch->data)
-		log_info(" JSON RX: %s", fetch->data);
+		log_dbg(" JSON RX: %s", fetch->data);
 	else
-		log_info(" JSON RX: Empty");
+		log_dbg(" JSON RX: Empty");
 
-	log_info("HTTP: %ld", ehttp);
+	log_dbg("HTTP: %ld", ehttp);
 
 	return http2errno(ehttp);
 }
 
+static void to_fetch_unref(struct to_fetch *data)
+{
+	if (!g_atomic_int_dec_and_test(&data->refs))
+		return;
+
+	if (data->context)
+		g_main_context_unref(data->context);
+
+	g_free(data->etag);
+	g_slice_free(struct to_fetch, data);
+}
+
+static void request_free(gpointer user_data)
+{
+	struct http_request *req = user_data;
+
+	/* Canceled or not completed poll */
+	if (req->poll)
+		to_fetch_unref(req->poll);
+
+	/* Canceled or not submitted worker request */
+	if (req->async)
+		async_done(req->async, NULL, -ECANCELED);
+
+	curl_multi_remove_handle(multi, req->ch);
+	curl_easy_cleanup(req->ch);
+	curl_slist_free_all(req->headers);
+	if (req->tok)
+		json_tokener_free(req->tok);
+	if (req->root)
+		json_object_put(req->root);
+	if (req->checksum)
+		g_checksum_free(req->checksum);
+	g_free(req->etag);
+	free(req->json.data);
+	g_free(req->body);
+	g_slice_free(struct http_request, req);
+}
+
+/*
+ * Compares the polled document to the previous one of the device. The
+ * digest covers clouds that don't support conditional requests.
+ */
+static gboolean poll_changed(struct http_request *req)
+{
+	struct to_fetch *data = req->poll;
+	const char *digest;
+
+	if (req->etag) {
+		g_free(data->etag);
+		data->etag = req->etag;
+		req->etag = NULL;
+	}
+
+	digest = g_checksum_get_string(req->checksum);
+	if (strcmp(data->digest, digest) == 0)
+		return FALSE;
+
+	g_strlcpy(data->digest, digest, sizeof(data->digest));
+
+	return TRUE;
+}
+
+static void multi_check_info(void)
+{
+	struct http_request *req;
+	CURLMsg *msg;
+	CURLcode rcode;
+	long ehttp;
+	int pending, err;
+
+	while ((msg = curl_multi_info_read(multi, &pending))) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &req);
+		rcode = msg->data.result;
+
+		if (rcode != CURLE_OK) {
+			log_error_rl("async request: %s(%d)",
+					curl_easy_strerror(rcode), rcode);
+			err = -EIO;
+		} else if (curl_easy_getinfo(req->ch, CURLINFO_RESPONSE_CODE,
+						&ehttp) != CURLE_OK) {
+			err = -EIO;
+		} else if (req->poll && ehttp == 304) {
+			/* Not Modified: If-None-Match matched */
+			err = -EALREADY;
+		} else
+			err = http2errno(ehttp);
+
+		/* The device object is released along with the request */
+		if (err == 0 && req->device) {
+			req->json.jobj = device_object(req->root);
+			if (req->json.jobj == NULL)
+				err = -EINVAL;
+		}
+
+		if (err == 0 && req->poll && !poll_changed(req))
+			err = -EALREADY;
+
+		/*
+		 * Remove from the table before completing the request: it
+		 * is allowed to start new requests.
+		 */
+		g_hash_table_steal(request_table, GUINT_TO_POINTER(req->id));
+		if (req->poll)
+			proto_poll_done(req, err);
+		else
+			async_done(req->async, req, err);
+		request_free(req);
+	}
+}
+
+static gboolean multi_sock_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	int fd = g_io_channel_unix_get_fd(io);
+	int running, action = 0;
+
+	if (cond & G_IO_IN)
+		action |= CURL_CSELECT_IN;
+	if (cond & G_IO_OUT)
+		action |= CURL_CSELECT_OUT;
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+		action |= CURL_CSELECT_ERR;
+
+	curl_multi_socket_action(multi, fd, action, &running);
+	multi_check_info();
+
+	return TRUE;
+}
+
+static int multi_socket_func(CURL *easy, curl_socket_t s, int what,
+					void *user_data, void *socket_data)
+{
+	struct multi_sock *msock = socket_data;
+	GIOCondition cond = G_IO_ERR | G_IO_HUP | G_IO_NVAL;
+
+	if (what == CURL_POLL_REMOVE) {
+		if (msock) {
+			g_source_remove(msock->watch_id);
+			g_io_channel_unref(msock->io);
+			g_free(msock);
+		}
+		return 0;
+	}
+
+	if (what & CURL_POLL_IN)
+		cond |= G_IO_IN;
+	if (what & CURL_POLL_OUT)
+		cond |= G_IO_OUT;
+
+	if (msock)
+		g_source_remove(msock->watch_id);
+	else {
+		msock = g_new0(struct multi_sock, 1);
+		msock->io = g_io_channel_unix_new(s);
+		curl_multi_assign(multi, s, msock);
+	}
+
+	msock->watch_id = g_io_add_watch(msock->io, cond, multi_sock_cb, NULL);
+
+	return 0;
+}
+
+static gboolean multi_timeout_cb(gpointer user_data)
+{
+	int running;
+
+	/* One shot: curl reschedules through multi_timer_func() */
+	multi_timeout_id = 0;
+
+	curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+	multi_check_info();
+
+	return FALSE;
+}
+
+static int multi_timer_func(CURLM *cm, long timeout_ms, void *user_data)
+{
+	if (multi_timeout_id) {
+		g_source_remove(multi_timeout_id);
+		multi_timeout_id = 0;
+	}
+
+	/* -1: delete the timer */
+	if (timeout_ms >= 0)
+		multi_timeout_id = g_timeout_add(timeout_ms, multi_timeout_cb,
+									NULL);
+
+	return 0;
+}
+
+static struct http_request *request_new(const char *action,
+				const char *method, const char *json,
+				const char *uuid, const char *token,
+				gboolean device)
+{
+	struct http_request *req;
+
+	req = g_slice_new0(struct http_request);
+	req->ch = curl_easy_init();
+	if (req->ch == NULL) {
+		g_slice_free(struct http_request, req);
+		log_error("curl_easy_init(): init failed");
+		return NULL;
+	}
+
+	/* Zero is reserved to 'no request' */
+	if (++request_id == 0)
+		request_id = 1;
+
+	req->id = request_id;
+	req->device = device;
+
+	if (uuid && token)
+		req->headers = auth_headers(NULL, uuid, token);
+
+	if (json) {
+		req->headers = json_headers(req->headers);
+		req->body = g_strdup(json);
+		curl_easy_setopt(req->ch, CURLOPT_POSTFIELDS, req->body);
+	}
+
+	curl_easy_setopt(req->ch, CURLOPT_CUSTOMREQUEST, method);
+	curl_easy_setopt(req->ch, CURLOPT_URL, action);
+	if (device) {
+		req->tok = json_tokener_new();
+		curl_easy_setopt(req->ch, CURLOPT_WRITEFUNCTION, stream_cb);
+		curl_easy_setopt(req->ch, CURLOPT_WRITEDATA, req);
+	} else {
+		curl_easy_setopt(req->ch, CURLOPT_WRITEFUNCTION, write_cb);
+		curl_easy_setopt(req->ch, CURLOPT_WRITEDATA, &req->json);
+	}
+	curl_easy_setopt(req->ch, CURLOPT_PRIVATE, req);
+	curl_easy_setopt(req->ch, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+	curl_easy_setopt(req->ch, CURLOPT_TIMEOUT, CURL_OP_TIMEOUT);
+	curl_easy_setopt(req->ch, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(req->ch, CURLOPT_MAXREDIRS, 1L);
+	curl_easy_setopt(req->ch, CURLOPT_NOPROGRESS, 1L);
+	curl_easy_setopt(req->ch, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(req->ch, CURLOPT_TCP_KEEPALIVE, 1L);
+
+	return req;
+}
+
+/* Starts the transfer: returns the request id or 0 on failure */
+static unsigned int request_submit(struct http_request *req)
+{
+	CURLMcode mcode;
+
+	curl_easy_setopt(req->ch, CURLOPT_HTTPHEADER, req->headers);
+
+	mcode = curl_multi_add_handle(multi, req->ch);
+	if (mcode != CURLM_OK) {
+		log_error("curl_multi_add_handle(): %s(%d)",
+					curl_multi_strerror(mcode), mcode);
+		request_free(req);
+		return 0;
+	}
+
+	g_hash_table_insert(request_table, GUINT_TO_POINTER(req->id), req);
+	req->start = g_get_monotonic_time();
+
+	return req->id;
+}
+
+static void async_free(struct http_async *async)
+{
+	if (async->context)
+		g_main_context_unref(async->context);
+	if (async->root)
+		json_object_put(async->root);
+	free(async->json.data);
+	g_free(async->body);
+	g_free(async->uri);
+	g_free(async);
+}
+
+/* Worker of the caller */
+static gboolean async_deliver(gpointer user_data)
+{
+	struct http_async *async = user_data;
+
+	async->cb(async->err, &async->json, async->user_data);
+	async_free(async);
+
+	return FALSE;
+}
+
+/* Main loop: hands the response, if any, over to the caller */
+static void async_done(struct http_async *async, struct http_request *req,
+								int err)
+{
+	async->err = err;
+
+	/* Moved along: json-c objects are not shared between threads */
+	if (req) {
+		async->json = req->json;
+		memset(&req->json, 0, sizeof(req->json));
+		async->root = req->root;
+		req->root = NULL;
+		req->async = NULL;
+	}
+
+	worker_invoke(async->context, async_deliver, async, NULL);
+}
+
+/* Main loop: failures are completed by request_free() */
+static gboolean async_submit(gpointer user_data)
+{
+	struct http_async *async = user_data;
+	struct http_request *req;
+
+	req = request_new(async->uri, async->method, async->body,
+				async->uuid, async->token, async->device);
+	if (req == NULL) {
+		async_done(async, NULL, -ENOMEM);
+		return FALSE;
+	}
+
+	req->async = async;
+	request_submit(req);
+
+	return FALSE;
+}
+
+static int request_async(const char *uri, const char *method,
+				const char *json, const char *uuid,
+				const char *token, gboolean device,
+				proto_async_cb_t cb, void *user_data)
+{
+	struct http_async *async;
+
+	async = g_new0(struct http_async, 1);
+	async->uri = g_strdup(uri);
+	async->method = method;
+	async->body = g_strdup(json);
+	g_strlcpy(async->uuid, uuid, sizeof(async->uuid));
+	g_strlcpy(async->token, token, sizeof(async->token));
+	async->device = device;
+	async->cb = cb;
+	async->user_data = user_data;
+
+	async->context = worker_current();
+	if (async->context)
+		g_main_context_ref(async->context);
+
+	log_dbg("HTTP(%s) async: %s", method, uri);
+
+	worker_invoke(NULL, async_submit, async, NULL);
+
+	return 0;
+}
+
+static int connect_timeout(int sock, const struct sockaddr *addr,
+						socklen_t addrlen, int timeout)
+{
+	struct pollfd pfd;
+	socklen_t optlen;
+	int flags, err, ret;
+
+	flags = fcntl(sock, F_GETFL, 0);
+	if (fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -errno;
+
+	if (connect(sock, addr, addrlen) == 0)
+		goto done;
+
+	if (errno != EINPROGRESS)
+		return -errno;
+
+	pfd.fd = sock;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+
+	ret = poll(&pfd, 1, timeout);
+	if (ret == 0)
+		return -ETIMEDOUT;
+	if (ret < 0)
+		return -errno;
+
+	err = 0;
+	optlen = sizeof(err);
+	if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &optlen) < 0)
+		return -errno;
+	if (err)
+		return -err;
+
+done:
+	/* Synchronous operations expect a blocking socket */
+	if (fcntl(sock, F_SETFL, flags) < 0)
+		return -errno;
+
+	return 0;
+}
+
 static int http_connect(void)
 {
 	struct sockaddr_in server;
+	struct http_session *session;
 	int sock, err;
 
 	/*
-	 * TODO: At the moment connect is blocking. Does it make
-	 * sense to use asynchronous communication or use fork/pthread?
+	 * Connect is bounded by HTTP_CONNECT_TIMEOUT: an unreachable
+	 * host doesn't stall the main loop for the kernel SYN timeout.
 	 */
 	sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
 	if (sock == -1) {
@@ -321,14 +1001,29 @@ static int http_connect(void)
 	server.sin_addr.s_addr = host_addr.s_addr;
 	server.sin_port = htons(host_port);
 
-	if (connect(sock, (struct sockaddr *) &server, sizeof(server)) < 0) {
-		err = errno;
-		log_error("Meshblu connect(): %s(%d)", strerror(err), err);
+	err = connect_timeout(sock, (struct sockaddr *) &server,
+					sizeof(server), HTTP_CONNECT_TIMEOUT);
+	if (err < 0) {
+		log_error("Meshblu connect(): %s(%d)", strerror(-err), -err);
 
 		close(sock);
-		return -err;
+		return err;
+	}
+
+	session = g_slice_new0(struct http_session);
+	session->sock = sock;
+	session->ch = session_handle_new(&session->sock);
+	if (session->ch == NULL) {
+		log_error("curl_easy_init(): init failed");
+		g_slice_free(struct http_session, session);
+		close(sock);
+		return -ENOMEM;
 	}
 
+	G_LOCK(session_table);
+	g_hash_table_replace(session_table, GINT_TO_POINTER(sock), session);
+	G_UNLOCK(session_table);
+
 	return sock;
 }
 
@@ -421,58 +1116,122 @@ static int http_data(int sock, const char *uuid, const char *token,
 
 static void http_close(int sock)
 {
-
+	/* Release the curl handle and cached headers */
+	G_LOCK(session_table);
+	g_hash_table_remove(session_table, GINT_TO_POINTER(sock));
+	G_UNLOCK(session_table);
 }
 
-static int http_probe(const char *host, unsigned int port)
+static int http_probe(const struct settings *settings)
 {
-	struct hostent *hostent;
+	const char *host = settings->host;
+	unsigned int port = settings->port;
+	struct addrinfo hints, *res;
 	int err;
 
-	/* TODO: connect and track TCP socket */
+	if (host == NULL)
+		host = DEFAULT_MESHBLU_SERVER_URI;
 
-	/* TODO: Add timer if it fails? */
+	/*
+	 * Runs on the manager probe thread: getaddrinfo() is reentrant,
+	 * knotd already listens for nodes while the name is resolved.
+	 */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	err = getaddrinfo(host, NULL, &hints, &res);
+	if (err) {
+		log_error("getaddrinfo(%s): %s (%d)", host,
+						gai_strerror(err), err);
+		return -EHOSTUNREACH;
+	}
 
-	if (host)
-		host_uri = g_strdup_printf("%s:%u", host, port);
-	else
-		host_uri = g_strdup_printf("%s:%u", DEFAULT_MESHBLU_SERVER_URI,
-									port);
+	host_addr = ((struct sockaddr_in *) res->ai_addr)->sin_addr;
+	freeaddrinfo(res);
 
+	log_info("Meshblu IP: %s", inet_ntoa(host_addr));
+
+	host_uri = g_strdup_printf("%s:%u", host, port);
 	host_port = port;
 	device_uri = g_strdup_printf("%s/devices", host_uri);
 	data_uri = g_strdup_printf("%s/data", host_uri);
 
-	/*
-	 * TODO: gethostbyname() is obslote. Need to change it.
-	 * From man gethostbyname :
-	 * DESCRIPTION
-	 * The gethostbyname*(), gethostbyaddr*(), herror(), and hstrerror()
-	 * functions are obsolete.  Applications should  use  getaddrinfo(3),
-	 * getnameinfo(3), and gai_strerror(3) instead.
-	 */
-	hostent = gethostbyname(host);
-	if  (hostent == NULL) {
-		err = h_errno;
-		log_error("gethostbyname(%s): %s (%d)", host_uri,
-						       strerror(err), err);
-		return -err;
-	}
+	session_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+							NULL, session_free);
+	json_hdr = json_headers(NULL);
 
-	host_addr.s_addr = *((unsigned long *) hostent->h_addr_list[0]);
-
-	log_info("Meshblu IP: %s", inet_ntoa(host_addr));
+	request_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+							NULL, request_free);
+	multi = curl_multi_init();
+	curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, multi_socket_func);
+	curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, multi_timer_func);
 
 	return 0;
 }
 
 static void http_remove(void)
 {
+	G_LOCK(poll);
+
+	/* Watches cancel their pending polls */
+	if (watch_table) {
+		g_hash_table_destroy(watch_table);
+		g_hash_table_destroy(uuid_table);
+	}
+	watch_table = NULL;
+	uuid_table = NULL;
+	if (poll_tick_id)
+		g_source_remove(poll_tick_id);
+	poll_tick_id = 0;
+
+	G_UNLOCK(poll);
+
+	g_hash_table_destroy(request_table);
+	if (multi_timeout_id)
+		g_source_remove(multi_timeout_id);
+	multi_timeout_id = 0;
+	curl_multi_cleanup(multi);
+
+	g_hash_table_destroy(session_table);
+	curl_slist_free_all(json_hdr);
 	g_free(host_uri);
 	g_free(device_uri);
 	g_free(data_uri);
 }
 
+/* Moves the device to the slot polled 'delay' seconds from now */
+static void poll_schedule(struct to_fetch *data, unsigned int delay)
+{
+	if (data->scheduled)
+		g_queue_unlink(&poll_wheel[data->slot], &data->link);
+
+	data->slot = (poll_slot + delay) % POLL_SLOTS;
+	data->scheduled = TRUE;
+	g_queue_push_tail_link(&poll_wheel[data->slot], &data->link);
+}
+
+/* Device is being updated: its document is likely to change soon */
+static void poll_activity(const char *uuid)
+{
+	struct to_fetch *data;
+
+	G_LOCK(poll);
+
+	data = uuid_table ? g_hash_table_lookup(uuid_table, uuid) : NULL;
+	if (data == NULL)
+		goto done;
+
+	data->interval = POLL_INTERVAL_MIN;
+
+	/* Pending poll reschedules itself when done */
+	if (data->scheduled)
+		poll_schedule(data, POLL_INTERVAL_MIN);
+
+done:
+	G_UNLOCK(poll);
+}
+
 static int http_setdata(int sock, const char *uuid, const char *token,
 					const char *jreq, json_raw_t *json)
 {
@@ -481,6 +1240,9 @@ static int http_setdata(int sock, const char *uuid, const char *token,
 
 	snprintf(uri, sizeof(uri), "%s/%s", device_uri, uuid);
 
+	/* set_data/get_data acknowledged: poll the device more often */
+	poll_activity(uuid);
+
 	/*
 	 * HTTP 200: OK
 	 * Return '0' if schema not fails or a negative value
@@ -515,61 +1277,320 @@ static int http_fetch(int sock, const char *uuid, const char *token,
 	return err;
 }
 
-/*
- * Gets the data from the device with the passed uuid and token and sends it to
- * msg.c to parse and then send to the THING if necessary
- */
-static gboolean proto_poll(gpointer user_data)
+/* Not bound to the session connection: sent through the multi handle */
+static int http_data_async(int sock, const char *uuid, const char *token,
+				const char *jreq, proto_async_cb_t cb,
+				void *user_data)
 {
-	struct to_fetch *data = user_data;
-	int result;
+	/* Length: data_uri + '/' + UUID + '\0' */
+	char uri[strlen(data_uri) + 2 + MESHBLU_UUID_SIZE];
+
+	snprintf(uri, sizeof(uri), "%s/%s", data_uri, uuid);
+
+	return request_async(uri, "POST", jreq, uuid, token, FALSE,
+							cb, user_data);
+}
+
+static int http_fetch_async(int sock, const char *uuid, const char *token,
+				proto_async_cb_t cb, void *user_data)
+{
+	/* Length: device_uri + '/' + UUID + '\0' */
+	char uri[strlen(device_uri) + 2 + MESHBLU_UUID_SIZE];
+
+	snprintf(uri, sizeof(uri), "%s/%s", device_uri, uuid);
+
+	return request_async(uri, "GET", NULL, uuid, token, TRUE,
+							cb, user_data);
+}
+
+static int http_setdata_async(int sock, const char *uuid, const char *token,
+				const char *jreq, proto_async_cb_t cb,
+				void *user_data)
+{
+	/* Length: device_uri + '/' + UUID + '\0' */
+	char uri[strlen(device_uri) + 2 + MESHBLU_UUID_SIZE];
+
+	snprintf(uri, sizeof(uri), "%s/%s", device_uri, uuid);
+
+	/* set_data/get_data acknowledged: poll the device more often */
+	poll_activity(uuid);
+
+	return request_async(uri, "PUT", jreq, uuid, token, FALSE,
+							cb, user_data);
+}
+
+static gboolean poll_deliver(gpointer user_data)
+{
+	struct poll_result *result = user_data;
+	struct to_fetch *data = result->data;
 	json_raw_t json;
+	gboolean removed;
+
+	/* Unwatched meanwhile: msg.c released its watch data */
+	G_LOCK(poll);
+	removed = data->removed;
+	G_UNLOCK(poll);
+
+	if (!removed) {
+		memset(&json, 0, sizeof(json));
+		json.jobj = result->jobj;
+		data->proto_watch_cb(json, data->user_data);
+	}
+
+	json_object_put(result->root);
+	to_fetch_unref(data);
+	g_free(result);
+
+	return FALSE;
+}
+
+static void proto_poll_done(struct http_request *req, int err)
+{
+	struct to_fetch *data = req->poll;
+	struct poll_result *result;
+	gboolean removed;
+
+	/* The request reference is moved to the result */
+	req->poll = NULL;
+
+	stats_observe("knotd_poll_duration_seconds", NULL, req->start);
+	stats_add("knotd_poll_results_total", err == 0 ? "result=\"changed\"" :
+			err == -EALREADY ? "result=\"unchanged\"" :
+			"result=\"error\"", 1);
+
+	G_LOCK(poll);
+
+	data->request_id = 0;
+
+	removed = data->removed;
+	if (removed)
+		;
+	else if (err == 0)
+		data->interval = POLL_INTERVAL_MIN;
+	else if (err == -EALREADY)
+		data->interval = MIN(data->interval * 2, POLL_INTERVAL_MAX);
+	else
+		data->interval = POLL_INTERVAL;
+
+	if (!removed)
+		poll_schedule(data, data->interval);
+
+	G_UNLOCK(poll);
+
+	if (removed)
+		goto done;
+
+	/* Device document didn't change since the last poll */
+	if (err == -EALREADY) {
+		if (!req->redeliver || req->json.jobj == NULL)
+			goto done;
+		err = 0;
+	}
 
-	memset(&json, 0, sizeof(json_raw_t));
-	result = http_fetch(data->proto_sock, data->uuid,
-						data->token, &json);
 	/*
 	 * TODO: Remove all HTTP specific headers from JSON before sending to
 	 * msg.c.
 	 */
-	if (result) {
-		log_error("signin(): %s(%d)", strerror(-result), -result);
-		return TRUE;
+	if (err) {
+		log_error_rl("signin(): %s(%d)", strerror(-err), -err);
+		goto done;
+	}
+
+	/*
+	 * The device object is handled by the worker of the session. The
+	 * whole response tree is moved: json-c objects are not shared
+	 * between threads.
+	 */
+	data->delivered = g_get_monotonic_time();
+
+	result = g_new0(struct poll_result, 1);
+	result->data = data;
+	result->root = req->root;
+	result->jobj = req->json.jobj;
+	req->root = NULL;
+
+	worker_invoke(data->context, poll_deliver, result, NULL);
+
+	return;
+
+done:
+	to_fetch_unref(data);
+}
+
+/*
+ * Gets the data from the device with the passed uuid and token and sends it to
+ * msg.c to parse and then send to the THING if necessary. The request is
+ * asynchronous: the main loop keeps serving other sessions meanwhile.
+ */
+static int proto_poll(struct to_fetch *data)
+{
+	/* Length: device_uri + '/' + UUID + '\0' */
+	char uri[strlen(device_uri) + 2 + MESHBLU_UUID_SIZE];
+	char *hdr;
+	struct http_request *req;
+
+	snprintf(uri, sizeof(uri), "%s/%s", device_uri, data->uuid);
+
+	/* Completion is handled by proto_poll_done() */
+	req = request_new(uri, "GET", NULL, data->uuid, data->token, TRUE);
+	if (req == NULL)
+		return -ENOMEM;
+
+	g_atomic_int_inc(&data->refs);
+	req->poll = data;
+	req->checksum = g_checksum_new(G_CHECKSUM_SHA1);
+	req->redeliver = g_get_monotonic_time() - data->delivered >=
+					POLL_REDELIVER * G_USEC_PER_SEC;
+	curl_easy_setopt(req->ch, CURLOPT_HEADERFUNCTION, header_cb);
+	curl_easy_setopt(req->ch, CURLOPT_HEADERDATA, req);
+
+	/* Cloud answers 304 if the document didn't change */
+	if (data->etag && !req->redeliver) {
+		hdr = g_strconcat(HTTP_IF_NONE_MATCH, data->etag, NULL);
+		req->headers = curl_slist_append(req->headers, hdr);
+		g_free(hdr);
 	}
 
-	data->proto_watch_cb(json, data->user_data);
+	data->request_id = request_submit(req);
 
-	free(json.data);
+	return data->request_id ? 0 : -EIO;
+}
+
+static gboolean poll_tick(gpointer user_data)
+{
+	struct to_fetch *data;
+	GQueue *slot;
+	GList *link;
+	unsigned int started = 0;
+
+	G_LOCK(poll);
+
+	poll_slot = (poll_slot + 1) % POLL_SLOTS;
+	slot = &poll_wheel[poll_slot];
+
+	while ((link = g_queue_pop_head_link(slot))) {
+		data = link->data;
+		data->scheduled = FALSE;
+
+		/* Too many devices in this slot: spill to the next one */
+		if (started == POLL_BURST) {
+			poll_schedule(data, 1);
+			continue;
+		}
+
+		/* Rescheduled by proto_poll_done() */
+		if (proto_poll(data) == 0) {
+			started++;
+			continue;
+		}
+
+		poll_schedule(data, POLL_INTERVAL);
+	}
+
+	TRACE2(poll_fire, poll_slot, started);
+
+	G_UNLOCK(poll);
+
+	stats_add("knotd_poll_ticks_total", NULL, 1);
+	stats_add("knotd_poll_requests_total", NULL, started);
 
 	return TRUE;
 }
 
 /*
- * Watch or poll the cloud to changes in the device.
+ * Called with the 'poll' lock held. A pending poll is not canceled: the
+ * request table belongs to the main loop, the poll completes discarding
+ * the response.
+ */
+static void watch_remove(gpointer user_data)
+{
+	struct to_fetch *data = user_data;
+
+	data->removed = TRUE;
+
+	/* A newer watch of the same device may have replaced it */
+	if (g_hash_table_lookup(uuid_table, data->uuid) == data)
+		g_hash_table_remove(uuid_table, data->uuid);
+
+	if (data->scheduled) {
+		g_queue_unlink(&poll_wheel[data->slot], &data->link);
+		data->scheduled = FALSE;
+	}
+
+	to_fetch_unref(data);
+}
+
+/*
+ * Watch or poll the cloud to changes in the device. The watch data is
+ * released when msg.c unwatches the returned id.
  */
 static unsigned int proto_register_watch(int proto_sock, const char *uuid,
 				const char *token, void (*proto_watch_cb)
 				(json_raw_t, void *), void *user_data)
 {
-	unsigned int gsource;
 	struct to_fetch *fetch_data;
-	GIOChannel *proto_io;
 
-	fetch_data = g_new0(struct to_fetch, 1);
+	fetch_data = g_slice_new0(struct to_fetch);
 	memcpy(fetch_data->uuid, uuid, MESHBLU_UUID_SIZE+1);
 	memcpy(fetch_data->token, token, MESHBLU_TOKEN_SIZE+1);
 	fetch_data->proto_sock = proto_sock;
 	fetch_data->proto_watch_cb = proto_watch_cb;
 	fetch_data->user_data = user_data;
+	fetch_data->interval = POLL_INTERVAL;
+	fetch_data->link.data = fetch_data;
+	fetch_data->refs = 1;
+
+	/* Responses are handled by the worker which is watching */
+	fetch_data->context = worker_current();
+	if (fetch_data->context)
+		g_main_context_ref(fetch_data->context);
+
+	G_LOCK(poll);
+
+	if (watch_table == NULL) {
+		watch_table = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL, watch_remove);
+		uuid_table = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+
+	/* Zero is reserved to 'no watch' */
+	if (++watch_id == 0)
+		watch_id = 1;
+
+	fetch_data->id = watch_id;
+	g_hash_table_insert(watch_table, GUINT_TO_POINTER(fetch_data->id),
+								fetch_data);
+	g_hash_table_replace(uuid_table, fetch_data->uuid, fetch_data);
+
+	/* Random first slot: staggers devices signed in at once */
+	poll_schedule(fetch_data, g_random_int_range(1, POLL_INTERVAL + 1));
 
-	gsource = g_timeout_add_seconds(10, proto_poll, fetch_data);
+	if (poll_tick_id == 0)
+		poll_tick_id = g_timeout_add_seconds(1, poll_tick, NULL);
 
-	proto_io = g_io_channel_unix_new(fetch_data->proto_sock);
-	g_io_add_watch(proto_io, G_IO_HUP | G_IO_NVAL | G_IO_ERR, http_hup_cb,
-			fetch_data);
-	g_io_channel_unref(proto_io);
+	G_UNLOCK(poll);
 
-	return gsource;
+	return fetch_data->id;
+}
+
+static void http_unwatch(unsigned int id)
+{
+	G_LOCK(poll);
+
+	/* Driver removed or not probed yet: nothing is polled */
+	if (watch_table == NULL)
+		goto done;
+
+	g_hash_table_remove(watch_table, GUINT_TO_POINTER(id));
+
+	/* No devices to poll */
+	if (g_hash_table_size(watch_table) == 0 && poll_tick_id) {
+		g_source_remove(poll_tick_id);
+		poll_tick_id = 0;
+	}
+
+done:
+	G_UNLOCK(poll);
 }
 
 struct proto_ops proto_http = {
@@ -586,5 +1607,10 @@ struct proto_ops proto_http = {
 	.data = http_data,
 	.fetch = http_fetch,
 	.setdata = http_setdata,
-	.async = proto_register_watch
+	.async = proto_register_watch,
+	.unwatch = http_unwatch,
+
+	.data_async = http_data_async,
+	.fetch_async = http_fetch_async,
+	.setdata_async = http_setdata_async
 };
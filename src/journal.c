@@ -0,0 +1,419 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2017, CESAR. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the CESAR nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL CESAR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <glib.h>
+
+#include <knot_protocol.h>
+
+#include "log.h"
+#include "stats.h"
+#include "journal.h"
+
+#define JOURNAL_MAGIC		"KNOTJRN1"
+#define RECORD_MAGIC		0x524a4e4b	/* "KNJR" */
+#define JOURNAL_SYNC		1		/* fdatasync() interval (s) */
+
+/* Readings are refused above 7/8 of the journal: nodes retry later */
+#define JOURNAL_HIGH(max)	((max) / 8 * 7)
+#define JOURNAL_CHUNK		4096		/* Compaction copy unit */
+
+struct journal_header {
+	char magic[8];
+	uint64_t head;			/* Oldest record not uploaded */
+};
+
+/*
+ * The token is stored in clear, unlike the credentials cache: the drain
+ * uploads readings of devices that are not connected anymore. The file is
+ * only accessible by the knotd user (mode 0600, directory 0700).
+ */
+struct journal_record {
+	uint32_t magic;
+	uint32_t len;			/* JSON length, without nul */
+	char uuid[KNOT_PROTOCOL_UUID_LEN + 1];
+	char token[KNOT_PROTOCOL_TOKEN_LEN + 1];
+};
+
+/*
+ * Appended by the session workers, drained by a single caller. Records
+ * are written sequentially at 'tail', the journal is truncated once the
+ * drain reaches it or compacted when the file reaches its maximum size.
+ * 'head' is persisted by the periodic sync: records drained right before
+ * a power loss are uploaded again.
+ */
+G_LOCK_DEFINE_STATIC(journal);
+static int journal_fd = -1;
+static size_t journal_max;
+static off_t head;
+static off_t tail;
+static gboolean dirty;
+static unsigned int sync_id;
+
+static gboolean journal_sync_cb(gpointer user_data)
+{
+	gboolean sync;
+	int fd;
+
+	G_LOCK(journal);
+	sync = dirty;
+	dirty = FALSE;
+	fd = journal_fd;
+	G_UNLOCK(journal);
+
+	/* Out of the lock: appends don't wait for the disk */
+	if (sync && fdatasync(fd) < 0)
+		log_error("journal fdatasync(): %s(%d)", strerror(errno),
+									errno);
+
+	return TRUE;
+}
+
+static int header_write(void)
+{
+	struct journal_header hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+	hdr.head = head;
+
+	if (pwrite(journal_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		return -EIO;
+
+	dirty = TRUE;
+
+	return 0;
+}
+
+/* Drained completely: start over from the beginning of the file */
+static void journal_reset(void)
+{
+	head = sizeof(struct journal_header);
+	tail = head;
+
+	if (ftruncate(journal_fd, tail) < 0)
+		log_error("journal ftruncate(): %s(%d)", strerror(errno),
+									errno);
+	header_write();
+}
+
+/*
+ * File is full but the drain freed its beginning: moves the pending
+ * records there. Only done if they fit before 'head', so the records
+ * referenced by the header on disk are never overwritten.
+ */
+static int journal_compact(void)
+{
+	char buf[JOURNAL_CHUNK];
+	off_t start = sizeof(struct journal_header);
+	off_t src, dst;
+	ssize_t len;
+
+	if (tail - head > head - start)
+		return -ENOBUFS;
+
+	for (src = head, dst = start; src < tail; src += len, dst += len) {
+		len = pread(journal_fd, buf, MIN(sizeof(buf),
+						(size_t) (tail - src)), src);
+		if (len <= 0)
+			return -EIO;
+
+		if (pwrite(journal_fd, buf, len, dst) != len)
+			return -EIO;
+	}
+
+	/* Copy is durable before the header refers to it */
+	if (fdatasync(journal_fd) < 0)
+		return -errno;
+
+	tail -= head - start;
+	head = start;
+
+	if (header_write() < 0 || fdatasync(journal_fd) < 0)
+		return -EIO;
+
+	if (ftruncate(journal_fd, tail) < 0)
+		log_error("journal ftruncate(): %s(%d)", strerror(errno),
+									errno);
+
+	return 0;
+}
+
+/* Complete records only: a torn tail is left by a power loss */
+static off_t journal_scan(int fd, off_t off, off_t size)
+{
+	struct journal_record rec;
+
+	while (off + (off_t) sizeof(rec) <= size) {
+		if (pread(fd, &rec, sizeof(rec), off) != sizeof(rec))
+			break;
+
+		if (rec.magic != RECORD_MAGIC ||
+				off + (off_t) (sizeof(rec) + rec.len) > size)
+			break;
+
+		off += sizeof(rec) + rec.len;
+	}
+
+	return off;
+}
+
+int journal_open(const char *path, size_t max)
+{
+	struct journal_header hdr;
+	struct stat st;
+	char *dir;
+	int fd, err;
+
+	dir = g_path_get_dirname(path);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		err = -errno;
+		log_error("journal open(%s): %s(%d)", path,
+						strerror(-err), -err);
+		return err;
+	}
+
+	/* Existing file may have been created with a wider mode */
+	if (fstat(fd, &st) < 0 || fchmod(fd, 0600) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	journal_fd = fd;
+	journal_max = max;
+
+	/* New file or different layout: start empty */
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+			memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic)) ||
+			hdr.head < sizeof(hdr) ||
+			hdr.head > (uint64_t) st.st_size) {
+		journal_reset();
+	} else {
+		head = hdr.head;
+		tail = journal_scan(fd, head, st.st_size);
+		if (tail != st.st_size && ftruncate(fd, tail) < 0)
+			log_error("journal ftruncate(): %s(%d)",
+						strerror(errno), errno);
+		if (head == tail)
+			journal_reset();
+	}
+
+	sync_id = g_timeout_add_seconds(JOURNAL_SYNC, journal_sync_cb, NULL);
+
+	log_info("Data journal: %s (%lld octets pending)", path,
+						(long long) (tail - head));
+
+	return 0;
+}
+
+void journal_close(void)
+{
+	if (journal_fd < 0)
+		return;
+
+	g_source_remove(sync_id);
+	sync_id = 0;
+
+	header_write();
+	fdatasync(journal_fd);
+	close(journal_fd);
+	journal_fd = -1;
+}
+
+int journal_append(const char *uuid, const char *token, const char *json)
+{
+	struct journal_record rec;
+	struct iovec iov[2];
+	size_t len;
+	ssize_t ret;
+	int err = 0;
+
+	if (journal_fd < 0)
+		return -ENOSYS;
+
+	len = strlen(json);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.magic = RECORD_MAGIC;
+	rec.len = len;
+	g_strlcpy(rec.uuid, uuid, sizeof(rec.uuid));
+	g_strlcpy(rec.token, token, sizeof(rec.token));
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = (void *) json;
+	iov[1].iov_len = len;
+
+	G_LOCK(journal);
+
+	/* Bounds the readings not uploaded yet */
+	if ((size_t) (tail - head) + sizeof(rec) + len >
+						JOURNAL_HIGH(journal_max)) {
+		err = -ENOBUFS;
+		goto done;
+	}
+
+	if ((size_t) tail + sizeof(rec) + len > journal_max) {
+		err = journal_compact();
+		if (err < 0)
+			goto done;
+	}
+
+	/* A short write is overwritten by the next append */
+	ret = pwritev(journal_fd, iov, 2, tail);
+	if (ret < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	if ((size_t) ret != sizeof(rec) + len) {
+		err = -EIO;
+		goto done;
+	}
+
+	tail += ret;
+	dirty = TRUE;
+
+done:
+	G_UNLOCK(journal);
+
+	return err;
+}
+
+static char *record_read(off_t off, struct journal_record *rec)
+{
+	char *json;
+
+	if (pread(journal_fd, rec, sizeof(*rec), off) != sizeof(*rec))
+		return NULL;
+
+	if (rec->magic != RECORD_MAGIC)
+		return NULL;
+
+	json = g_malloc(rec->len + 1);
+	if (pread(journal_fd, json, rec->len, off + sizeof(*rec)) !=
+							(ssize_t) rec->len) {
+		g_free(json);
+		return NULL;
+	}
+
+	json[rec->len] = '\0';
+	rec->uuid[sizeof(rec->uuid) - 1] = '\0';
+	rec->token[sizeof(rec->token) - 1] = '\0';
+
+	return json;
+}
+
+int journal_drain(journal_func_t func, unsigned int count, void *user_data)
+{
+	struct journal_record rec;
+	unsigned int i;
+	char *json;
+	off_t off;
+	int err = 0;
+
+	for (i = 0; i < count; i++) {
+		G_LOCK(journal);
+
+		off = head;
+		if (journal_fd < 0 || off >= tail) {
+			G_UNLOCK(journal);
+			break;
+		}
+
+		json = record_read(off, &rec);
+		if (json == NULL) {
+			log_error("journal: corrupted, %lld octets dropped",
+						(long long) (tail - head));
+			journal_reset();
+			G_UNLOCK(journal);
+			return -EIO;
+		}
+
+		G_UNLOCK(journal);
+
+		/* The cloud may block: appends go on meanwhile */
+		err = func(rec.uuid, rec.token, json, user_data);
+		g_free(json);
+		if (err == -ECANCELED) {
+			/* Never accepted: replaying it would block the drain */
+			log_error_rl("journal: reading of %s dropped",
+								rec.uuid);
+			stats_add("knotd_journal_dropped_total", NULL, 1);
+			err = 0;
+		} else if (err < 0)
+			break;
+
+		G_LOCK(journal);
+
+		/* Relative: the journal may be compacted meanwhile */
+		head += sizeof(rec) + rec.len;
+		if (head >= tail)
+			journal_reset();
+		else
+			header_write();
+
+		G_UNLOCK(journal);
+	}
+
+	return err;
+}
+
+gboolean journal_empty(void)
+{
+	gboolean empty;
+
+	G_LOCK(journal);
+	empty = (journal_fd < 0 || head >= tail);
+	G_UNLOCK(journal);
+
+	return empty;
+}
+
+gboolean journal_enabled(void)
+{
+	gboolean enabled;
+
+	G_LOCK(journal);
+	enabled = (journal_fd >= 0);
+	G_UNLOCK(journal);
+
+	return enabled;
+}
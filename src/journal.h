@@ -0,0 +1,53 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2017, CESAR. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the CESAR nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL CESAR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Store and forward of sensor data: readings that can't be uploaded are
+ * appended to a bounded on-disk journal, synced periodically, and drained
+ * in arrival order once the cloud is reachable again.
+ */
+
+/*
+ * Returns 0 if the reading was uploaded or -ECANCELED if the cloud
+ * rejected it: either way the record is consumed from the journal. Other
+ * errors are transient, the record is replayed by the next drain.
+ */
+typedef int (*journal_func_t) (const char *uuid, const char *token,
+					const char *json, void *user_data);
+
+int journal_open(const char *path, size_t max);
+void journal_close(void);
+
+/* -ENOBUFS: above the high watermark, nodes should back off */
+int journal_append(const char *uuid, const char *token, const char *json);
+
+/* Replays up to 'count' records, stops at the first transient failure */
+int journal_drain(journal_func_t func, unsigned int count, void *user_data);
+
+gboolean journal_empty(void);
+gboolean journal_enabled(void);
@@ -32,43 +32,76 @@
 
 #include <syslog.h>
 #include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
 
 #include "log.h"
 
-void log_error(const char *format, ...)
-{
-	va_list ap;
+int log_level = LOG_LEVEL_INFO;
 
-	va_start(ap, format);
-	vsyslog(LOG_ERR, format, ap);
-	va_end(ap);
-}
+static const struct {
+	const char *name;
+	int level;
+} levels[] = {
+	{ "error", LOG_LEVEL_ERROR },
+	{ "warn", LOG_LEVEL_WARN },
+	{ "info", LOG_LEVEL_INFO },
+	{ "debug", LOG_LEVEL_DEBUG },
+	{ NULL, 0 }
+};
 
-void log_warn(const char *format, ...)
+void log_print(int priority, const char *format, ...)
 {
 	va_list ap;
 
 	va_start(ap, format);
-	vsyslog(LOG_WARNING, format, ap);
+	vsyslog(priority, format, ap);
 	va_end(ap);
 }
 
-void log_info(const char *format, ...)
+/*
+ * Returns 1 if the message may be printed. Call sites are not locked:
+ * under concurrency the limit is approximate.
+ */
+int log_ratelimit(struct log_ratelimit *rl)
 {
-	va_list ap;
+	struct timespec now;
 
-	va_start(ap, format);
-	vsyslog(LOG_INFO, format, ap);
-	va_end(ap);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (now.tv_sec - rl->begin >= LOG_RATELIMIT_INTERVAL) {
+		if (rl->missed)
+			syslog(LOG_WARNING, "%u messages suppressed",
+								rl->missed);
+		rl->begin = now.tv_sec;
+		rl->printed = 0;
+		rl->missed = 0;
+	}
+
+	if (rl->printed >= LOG_RATELIMIT_BURST) {
+		rl->missed++;
+		return 0;
+	}
+
+	rl->printed++;
+
+	return 1;
 }
 
-void log_dbg(const char *format, ...)
+int log_set_level(const char *name)
 {
-	va_list ap;
+	int i;
 
-	va_start(ap, format);
-	vsyslog(LOG_DEBUG, format, ap);
-	va_end(ap);
+	for (i = 0; levels[i].name; i++) {
+		if (strcasecmp(levels[i].name, name) == 0) {
+			log_level = levels[i].level;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
 }
 
 void log_init(const char *ident, int detach)
@@ -26,10 +26,57 @@
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* syslog(3) priorities */
+#define LOG_LEVEL_ERROR		3
+#define LOG_LEVEL_WARN		4
+#define LOG_LEVEL_INFO		6
+#define LOG_LEVEL_DEBUG		7
+
+/* Build time: messages above it are compiled out, see --with-log-level */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX		LOG_LEVEL_DEBUG
+#endif
+
+/* Run time: messages above it are discarded before being formatted */
+extern int log_level;
+
+/* Per call site: at most LOG_RATELIMIT_BURST messages per interval */
+#define LOG_RATELIMIT_INTERVAL	5	/* seconds */
+#define LOG_RATELIMIT_BURST	10
+
+struct log_ratelimit {
+	long begin;
+	unsigned int printed;
+	unsigned int missed;
+};
+
 void log_init(const char *ident, int detach);
 void log_close(void);
+int log_set_level(const char *name);
+
+void log_print(int priority, const char *format, ...)
+				__attribute__((format(printf, 2, 3)));
+int log_ratelimit(struct log_ratelimit *rl);
+
+#define log_enabled(priority) \
+	((priority) <= LOG_LEVEL_MAX && (priority) <= log_level)
+
+#define log_at(priority, ...) do {					\
+	if (log_enabled(priority))					\
+		log_print(priority, __VA_ARGS__);			\
+} while (0)
+
+/* Hot paths: floods are summarized by the next message printed */
+#define log_at_ratelimited(priority, ...) do {				\
+	static struct log_ratelimit _rl;				\
+	if (log_enabled(priority) && log_ratelimit(&_rl))		\
+		log_print(priority, __VA_ARGS__);			\
+} while (0)
+
+#define log_error(...)		log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...)		log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...)		log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_dbg(...)		log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
 
-void log_info(const char *format, ...) __attribute__((format(printf, 1, 2)));
-void log_error(const char *format, ...) __attribute__((format(printf, 1, 2)));
-void log_warn(const char *format, ...) __attribute__((format(printf, 1, 2)));
-void log_dbg(const char *format, ...) __attribute__((format(printf, 1, 2)));
+#define log_error_rl(...)	log_at_ratelimited(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_info_rl(...)	log_at_ratelimited(LOG_LEVEL_INFO, __VA_ARGS__)
@@ -41,10 +41,12 @@
 #include "manager.h"
 
 #define BUF_LEN (sizeof(struct inotify_event))
+#define RELOAD_RETRY	5	/* seconds */
 
 static GMainLoop *main_loop;
 
 static struct settings settings;
+static guint reload_id;
 
 static const char *opt_cfg = "/etc/knot/gatewayConfig.json";
 /*
@@ -56,7 +58,19 @@ static const char *opt_host = NULL;
 /* Default is websockets */
 static const char *opt_proto = "ws";
 static const char *opt_tty = NULL;
+static unsigned int opt_cloud_conns = 0;
+static unsigned int opt_workers = 0;
+static const char *opt_cache = "/var/lib/knot/devices.cache";
+static unsigned int opt_cache_ttl = 3600;
+static const char *opt_journal = "/var/lib/knot/data.journal";
+static unsigned int opt_journal_size = 4096;
+static unsigned int opt_mock_latency = 0;
+static unsigned int opt_mock_errors = 0;
+static unsigned int opt_rate_limit = 0;
+static unsigned int opt_rate_burst = 40;
+static unsigned int opt_cloud_inflight = 0;
 static gboolean opt_detach = TRUE;
+static const char *opt_log_level = "info";
 
 static void sig_term(int sig)
 {
@@ -71,9 +85,33 @@ static GOptionEntry options[] = {
 	{ "port", 'p', 0, G_OPTION_ARG_INT, &opt_port,
 					"port", "Cloud server port" },
 	{ "proto", 'P', 0, G_OPTION_ARG_STRING, &opt_proto,
-					"protocol", "eg: http or ws" },
+					"protocol", "http, ws, mqtt or mock" },
 	{ "tty", 't', 0, G_OPTION_ARG_STRING, &opt_tty,
 					"TTY", "eg: /dev/ttyUSB0" },
+	{ "cloud-conns", 'C', 0, G_OPTION_ARG_INT, &opt_cloud_conns,
+					"conns", "Shared cloud connections" },
+	{ "workers", 'w', 0, G_OPTION_ARG_INT, &opt_workers,
+					"threads", "Session worker threads" },
+	{ "cache", 'k', 0, G_OPTION_ARG_STRING, &opt_cache,
+					"path", "Trusted devices cache" },
+	{ "cache-ttl", 'T', 0, G_OPTION_ARG_INT, &opt_cache_ttl,
+					"seconds", "Cache lifetime, 0: off" },
+	{ "journal", 'j', 0, G_OPTION_ARG_STRING, &opt_journal,
+					"path", "Offline readings journal" },
+	{ "journal-size", 'J', 0, G_OPTION_ARG_INT, &opt_journal_size,
+					"KiB", "Journal size, 0: off" },
+	{ "mock-latency", 'L', 0, G_OPTION_ARG_INT, &opt_mock_latency,
+					"ms", "Mock cloud latency" },
+	{ "mock-errors", 'E', 0, G_OPTION_ARG_INT, &opt_mock_errors,
+					"percent", "Mock cloud error rate" },
+	{ "rate-limit", 'r', 0, G_OPTION_ARG_INT, &opt_rate_limit,
+					"PDUs/s", "Per node rate, 0: off" },
+	{ "rate-burst", 'B', 0, G_OPTION_ARG_INT, &opt_rate_burst,
+					"PDUs", "Per node burst" },
+	{ "cloud-inflight", 'I', 0, G_OPTION_ARG_INT, &opt_cloud_inflight,
+					"calls", "Concurrent cloud calls" },
+	{ "log-level", 'l', 0, G_OPTION_ARG_STRING, &opt_log_level,
+				"level", "error, warn, info or debug" },
 	{ "nodetach", 'n', G_OPTION_FLAG_REVERSE,
 					G_OPTION_ARG_NONE, &opt_detach,
 					"Logging in foreground" },
@@ -113,6 +151,18 @@ static int parse_config(json_object *jobj, struct settings *settings)
 		settings->port = json_object_get_int(obj_tmp);
 	}
 
+	/*
+	 * Optional: data upload batching, off by default. Readings buffered
+	 * together are stored by the cloud as a single data record holding
+	 * a "data" array, not one record per reading: consumers of the
+	 * device data must be updated before enabling it.
+	 */
+	if (json_object_object_get_ex(obj_cloud, "dataFlushWindow", &obj_tmp))
+		settings->data_window = json_object_get_int(obj_tmp);
+
+	if (json_object_object_get_ex(obj_cloud, "dataFlushSize", &obj_tmp))
+		settings->data_batch = json_object_get_int(obj_tmp);
+
 	settings->uuid = g_strdup(uuid);
 
 	err = 0; /* Success */
@@ -120,6 +170,79 @@ done:
 	return err;
 }
 
+static gboolean reload_retry_cb(gpointer user_data);
+
+/*
+ * Reads the config file again, sessions are kept: the manager applies
+ * only what changed. Command line options keep their priority.
+ */
+static void settings_reload(void)
+{
+	struct settings reload;
+	json_object *jobj;
+	int err;
+
+	reload = settings;
+	reload.host = NULL;
+	reload.uuid = NULL;
+	reload.port = opt_port;
+	reload.data_window = 0;
+	reload.data_batch = 0;
+
+	jobj = json_object_from_file(opt_cfg);
+	if (!jobj) {
+		log_error("reload: can't read %s", opt_cfg);
+		return;
+	}
+
+	err = parse_config(jobj, &reload);
+	json_object_put(jobj);
+	if (err < 0) {
+		log_error("reload: invalid %s, keeping settings", opt_cfg);
+		goto failure;
+	}
+
+	if (opt_host) {
+		g_free(reload.host);
+		reload.host = g_strdup(opt_host);
+	}
+
+	err = manager_reload(&reload);
+	if (err == -EBUSY) {
+		/* Cloud probe in progress: nothing applied, try again later */
+		log_info("reload: cloud busy, retrying");
+		if (reload_id == 0)
+			reload_id = g_timeout_add_seconds(RELOAD_RETRY,
+						reload_retry_cb, NULL);
+		goto failure;
+	}
+
+	if (err < 0) {
+		log_error("reload: %s(%d)", strerror(-err), -err);
+		goto failure;
+	}
+
+	g_free(settings.host);
+	g_free(settings.uuid);
+	settings = reload;
+
+	log_info("Settings reloaded");
+
+	return;
+
+failure:
+	g_free(reload.host);
+	g_free(reload.uuid);
+}
+
+static gboolean reload_retry_cb(gpointer user_data)
+{
+	reload_id = 0;
+	settings_reload();
+
+	return FALSE;
+}
+
 static gboolean inotify_cb(GIOChannel *gio, GIOCondition condition,
 								gpointer data)
 {
@@ -139,8 +262,13 @@ static gboolean inotify_cb(GIOChannel *gio, GIOCondition condition,
 	/* Process the events in buffer returned by read() */
 
 	event = (struct inotify_event *) buf;
-	if (event->mask & IN_MODIFY)
-		g_main_loop_quit(main_loop);
+	if (event->mask & IN_MODIFY) {
+		if (reload_id) {
+			g_source_remove(reload_id);
+			reload_id = 0;
+		}
+		settings_reload();
+	}
 
 	return TRUE;
 }
@@ -177,6 +305,17 @@ int main(int argc, char *argv[])
 	memset(&settings, 0, sizeof(settings));
 	settings.proto = opt_proto;
 	settings.tty = opt_tty;
+	settings.cloud_conns = opt_cloud_conns;
+	settings.workers = opt_workers;
+	settings.cache = opt_cache;
+	settings.cache_ttl = opt_cache_ttl;
+	settings.journal = opt_journal;
+	settings.journal_size = (size_t) opt_journal_size * 1024;
+	settings.mock_latency = opt_mock_latency;
+	settings.mock_errors = opt_mock_errors;
+	settings.rate_limit = opt_rate_limit;
+	settings.rate_burst = opt_rate_burst;
+	settings.cloud_inflight = opt_cloud_inflight;
 	/*
 	 * Command line options (host and port) have higher priority
 	 * than values read from config file. UUID should
@@ -202,6 +341,8 @@ int main(int argc, char *argv[])
 	}
 
 	log_init("knotd", opt_detach);
+	if (log_set_level(opt_log_level) < 0)
+		log_error("Invalid log level: %s", opt_log_level);
 	log_info("KNOT Gateway");
 
 	err = manager_start(&settings);
@@ -218,12 +359,7 @@ int main(int argc, char *argv[])
 							strerror(errno), errno);
 		goto failure;
 	}
-	/*
-	 * TODO: implement a robust & clean way to reload settings
-	 * instead of force quitting when configuration file changes.
-	 */
-
-	/* Starting inotify */
+	/* Starting inotify: changes are applied by settings_reload() */
 	inotifyFD = inotify_init();
 
 	wd = inotify_add_watch(inotifyFD, opt_cfg, IN_MODIFY);
@@ -260,6 +396,8 @@ int main(int argc, char *argv[])
 	/* inotify cleanup */
 	g_source_remove(watch_id);
 	inotify_rm_watch(inotifyFD, wd);
+	if (reload_id)
+		g_source_remove(reload_id);
 
 	manager_stop();
 	g_free(settings.host);
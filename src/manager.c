@@ -37,6 +37,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include <glib.h>
@@ -44,13 +45,21 @@
 #include <knot_protocol.h>
 
 #include "log.h"
+#include "pdu.h"
 #include "node.h"
 #include "proto.h"
 #include "serial.h"
 #include "msg.h"
 #include "settings.h"
+#include "worker.h"
+#include "stats.h"
+#include "trace.h"
 #include "manager.h"
 
+#define NODE_BATCH		8	/* PDUs per node wake-up */
+#define PDU_SIZE		512
+#define PROTO_RETRY		5	/* Cloud reconnection interval (s) */
+
 /*
  * Device session storing the connected
  * device context: 'drivers' and file descriptors
@@ -60,21 +69,45 @@ struct session {
 	unsigned int proto_id;	/* TCP/backend event source */
 	GIOChannel *proto_io;	/* Protocol GIOChannel reference */
 	struct node_ops *ops;
+	int node_sock;		/* Identifies the trust in msg.c */
+	GMainContext *context;	/* Worker, NULL: main loop */
+	uint8_t *ipdu;		/* NODE_BATCH input PDUs */
+	struct pdu *pdus[NODE_BATCH];	/* Lent by recv_pdus() drivers */
+	int npdus;
+	uint8_t *opdu;		/* NODE_BATCH output PDUs */
+	gint64 proto_retry;	/* Next cloud connection attempt */
+	gint64 rate_tat;	/* Token bucket: theoretical arrival time */
 };
 
 static GSList *server_watch = NULL;
+/* Sessions are released by the workers */
+G_LOCK_DEFINE_STATIC(session_list);
 static GSList *session_list = NULL;
 
+/* Backpressure: one node can't starve the others or flood the cloud */
+static gint64 rate_interval;	/* usec per PDU, 0: unlimited */
+static gint64 rate_burst;	/* usec of credit above the rate */
+static unsigned int cloud_inflight_max;
+static gint cloud_inflight;
+
 extern struct proto_ops proto_http;
 #ifdef HAVE_WEBSOCKETS
 extern struct proto_ops proto_ws;
 #endif
+#ifdef HAVE_MOSQUITTO
+extern struct proto_ops proto_mqtt;
+#endif
+extern struct proto_ops proto_mock;
 
 static struct proto_ops *proto_ops[] = {
 	&proto_http,
 #ifdef HAVE_WEBSOCKETS
 	&proto_ws,
 #endif
+#ifdef HAVE_MOSQUITTO
+	&proto_mqtt,
+#endif
+	&proto_mock,
 	NULL
 };
 
@@ -85,6 +118,21 @@ static struct proto_ops *proto_ops[] = {
  */
 static int proto_index = 0;
 
+/*
+ * Cloud server of the proto driver. The driver is probed by a thread,
+ * nodes are served meanwhile: sessions are offline until probe() returns.
+ * Moving the server re-probes the driver once every session released
+ * its cloud connection, node connections and trusts are not affected.
+ */
+static char *cloud_host;
+static unsigned int cloud_port;
+static struct settings proto_settings;
+static gint proto_offline;
+static gint proto_resets;
+static GThread *probe_thread;
+static unsigned int probe_retry_id;
+static gboolean proto_probed;	/* Main loop only */
+
 /* TODO: After adding buildroot, investigate if it is possible
  * to add macros for conditional builds, or a dynamic builtin
  * plugin mechanism.
@@ -98,13 +146,31 @@ static struct node_ops *node_ops[] = {
 	NULL
 };
 
+static void session_proto_close(struct session *session)
+{
+	GIOChannel *proto_io = session->proto_io;
+	int proto_sock;
+
+	if (session->proto_id == 0)
+		return;
+
+	worker_source_remove(session->context, session->proto_id);
+
+	proto_sock = g_io_channel_unix_get_fd(proto_io);
+	msg_proto_close(session->node_sock, proto_sock);
+	proto_ops[proto_index]->close(proto_sock);
+
+	g_io_channel_shutdown(proto_io, FALSE, NULL);
+	g_io_channel_unref(proto_io);
+
+	session->proto_io = NULL;
+	session->proto_id = 0;
+}
+
 static void node_io_destroy(gpointer user_data)
 {
 
 	struct session *session = user_data;
-	GIOChannel *proto_io;
-
-	proto_io = session->proto_io;
 
 	/*
 	 * Destroy callback may be called after a remote (Radio or Unix peer)
@@ -112,15 +178,15 @@ static void node_io_destroy(gpointer user_data)
 	 * release allocated resources.
 	 */
 
-	if (session->proto_id) {
-		g_source_remove(session->proto_id);
-
-		g_io_channel_shutdown(proto_io, FALSE, NULL);
-		g_io_channel_unref(proto_io);
-	}
+	session_proto_close(session);
 
+	G_LOCK(session_list);
 	session_list = g_slist_remove(session_list, session);
-	g_free(session);
+	G_UNLOCK(session_list);
+
+	g_slice_free1(NODE_BATCH * PDU_SIZE, session->ipdu);
+	g_slice_free1(NODE_BATCH * PDU_SIZE, session->opdu);
+	g_slice_free(struct session, session);
 }
 
 static gboolean proto_io_watch(GIOChannel *io, GIOCondition cond,
@@ -138,6 +204,8 @@ static gboolean proto_io_watch(GIOChannel *io, GIOCondition cond,
 	session->proto_id = 0;
 
 	if (session->proto_io) {
+		msg_proto_close(session->node_sock,
+				g_io_channel_unix_get_fd(session->proto_io));
 		g_io_channel_unref(session->proto_io);
 		session->proto_io = NULL;
 	}
@@ -159,82 +227,264 @@ static void proto_io_destroy(gpointer user_data)
 	session->proto_id = 0;
 }
 
-static gboolean node_io_watch(GIOChannel *io, GIOCondition cond,
-			      gpointer user_data)
+/* PDUs and octets per node driver and direction */
+static void node_stats(const struct session *session, const char *dir,
+					const struct iovec *iov, int count)
+{
+	char labels[64];
+	guint64 bytes = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		bytes += iov[i].iov_len;
+
+	snprintf(labels, sizeof(labels), "driver=\"%s\",dir=\"%s\"",
+						session->ops->name, dir);
+	stats_add("knotd_node_pdus_total", labels, count);
+	stats_add("knotd_node_bytes_total", labels, bytes);
+}
+
+static int node_recv(struct session *session, int sock, struct iovec *iov)
 {
-	struct session *session = user_data;
 	struct node_ops *ops = session->ops;
-	uint8_t ipdu[512], opdu[512]; /* FIXME: */
-	ssize_t recvbytes, sentbytes, olen;
-	int sock, proto_sock, err;
+	ssize_t recvbytes;
+	unsigned int i;
+	int count;
+
+	/* Zero copy: msg_process() reads the driver buffers */
+	if (ops->recv_pdus) {
+		count = ops->recv_pdus(sock, session->pdus, NODE_BATCH);
+		if (count < 0)
+			return count;
+
+		for (i = 0; i < (unsigned int) count; i++) {
+			iov[i].iov_base = session->pdus[i]->data;
+			iov[i].iov_len = session->pdus[i]->len;
+		}
+
+		session->npdus = count;
+
+		return count;
+	}
+
+	for (i = 0; i < NODE_BATCH; i++) {
+		iov[i].iov_base = session->ipdu + i * PDU_SIZE;
+		iov[i].iov_len = PDU_SIZE;
+	}
+
+	if (ops->recv_batch)
+		return ops->recv_batch(sock, iov, NODE_BATCH);
+
+	recvbytes = ops->recv(sock, iov[0].iov_base, iov[0].iov_len);
+	if (recvbytes < 0)
+		return -errno;
+
+	iov[0].iov_len = recvbytes;
+
+	return 1;
+}
+
+static void node_release(struct session *session)
+{
+	int i;
+
+	for (i = 0; i < session->npdus; i++)
+		pdu_unref(session->pdus[i]);
+
+	session->npdus = 0;
+}
+
+static void node_send(struct session *session, int sock,
+					const struct iovec *iov, int count)
+{
+	struct node_ops *ops = session->ops;
+	ssize_t sentbytes;
+	int i, ret;
+
+	if (count > 0)
+		node_stats(session, "tx", iov, count);
+
+	if (count > 1 && ops->send_batch) {
+		ret = ops->send_batch(sock, iov, count);
+		if (ret < 0)
+			log_error_rl("node_ops: %s(%d)", strerror(-ret), -ret);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		sentbytes = ops->send(sock, iov[i].iov_base, iov[i].iov_len);
+		if (sentbytes < 0)
+			log_error_rl("node_ops: %s(%zd)",
+					strerror(-sentbytes), -sentbytes);
+	}
+}
+
+/*
+ * Returns the cloud socket or -1. The node stays connected if the cloud is
+ * unreachable: cached trusts and journaled readings keep things working
+ * while offline.
+ */
+static int proto_connect(struct session *session)
+{
 	GIOCondition watch_cond;
+	int proto_sock;
+
+	/* Cloud driver being probed */
+	if (g_atomic_int_get(&proto_offline))
+		proto_sock = -EAGAIN;
+	else
+		proto_sock = proto_ops[proto_index]->connect();
+
+	if (proto_sock < 0) {
+		log_info("Can't connect to cloud service!");
+		session->proto_retry = g_get_monotonic_time() +
+					PROTO_RETRY * G_USEC_PER_SEC;
+		return -1;
+	}
+
+	log_info("Connected to cloud service!");
 
+	session->proto_io = g_io_channel_unix_new(proto_sock);
+
+	watch_cond = G_IO_HUP | G_IO_NVAL | G_IO_ERR;
+	session->proto_id = worker_io_add_watch(session->context,
+						session->proto_io, watch_cond,
+						proto_io_watch, session,
+						proto_io_destroy);
+
+	return proto_sock;
+}
+
+/*
+ * Token bucket kept as the time the next PDU is due (GCRA): a node
+ * sends up to 'rate_burst' PDUs at once, then 'rate_limit' per second.
+ */
+static gboolean session_admit(struct session *session, gint64 now)
+{
+	gint64 tat;
+
+	if (rate_interval == 0)
+		return TRUE;
+
+	tat = MAX(session->rate_tat, now) + rate_interval;
+	if (tat - now > rate_burst + rate_interval)
+		return FALSE;
+
+	session->rate_tat = tat;
+
+	return TRUE;
+}
+
+/* Returns FALSE if too many cloud calls are pending */
+static gboolean cloud_acquire(int proto_sock)
+{
+	if (proto_sock < 0 || cloud_inflight_max == 0)
+		return TRUE;
+
+	if ((unsigned int) g_atomic_int_add(&cloud_inflight, 1) <
+							cloud_inflight_max)
+		return TRUE;
+
+	g_atomic_int_add(&cloud_inflight, -1);
+	stats_add("knotd_cloud_shed_total", NULL, 1);
+
+	return FALSE;
+}
+
+static void cloud_release(int proto_sock)
+{
+	if (proto_sock >= 0 && cloud_inflight_max)
+		g_atomic_int_add(&cloud_inflight, -1);
+}
+
+static gboolean node_io_watch(GIOChannel *io, GIOCondition cond,
+			      gpointer user_data)
+{
+	struct session *session = user_data;
+	struct iovec iiov[NODE_BATCH], oiov[NODE_BATCH];
+	ssize_t olen;
+	gint64 now;
+	int sock, proto_sock, count, i, n;
 
 	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
 		/*
 		 * Mark as removed. node_io has only one
 		 * reference. Returning FALSE removes the
 		 * last reference and the destroy callback
-		 * is called.
+		 * is called: cloud session is closed there.
 		 */
-		if (cond & G_IO_HUP && session->proto_io) {
-			proto_sock =
-				g_io_channel_unix_get_fd(session->proto_io);
-			proto_ops[proto_index]->close(proto_sock);
-		}
 		session->node_id = 0;
 		return FALSE;
 	}
 
 	sock = g_io_channel_unix_get_fd(io);
 
-	recvbytes = ops->recv(sock, ipdu, sizeof(ipdu));
-	if (recvbytes < 0) {
-		err = errno;
-		log_error("readv(): %s(%d)", strerror(err), err);
+	/* Drains up to NODE_BATCH PDUs per wake-up */
+	count = node_recv(session, sock, iiov);
+	if (count == -EAGAIN)
 		return TRUE;
-	}
 
-	if (!session->proto_io) {
-		proto_sock = proto_ops[proto_index]->connect();
-		if (proto_sock < 0) {
-			/* TODO:  missing reply an error */
-			log_info("Can't connect to cloud service!");
-			session->node_id = 0;
-			return FALSE;
-		}
+	if (count < 0) {
+		log_error_rl("readv(): %s(%d)", strerror(-count), -count);
+		return TRUE;
+	}
 
-		log_info("Connected to cloud service!");
+	TRACE2(pdu_rx, sock, count);
+	node_stats(session, "rx", iiov, count);
 
-		session->proto_io = g_io_channel_unix_new(proto_sock);
+	now = g_get_monotonic_time();
 
-		watch_cond = G_IO_HUP | G_IO_NVAL | G_IO_ERR;
-		session->proto_id = g_io_add_watch_full(session->proto_io,
-							G_PRIORITY_DEFAULT,
-							watch_cond,
-							proto_io_watch, session,
-							proto_io_destroy);
-	} else
+	if (session->proto_io)
 		proto_sock = g_io_channel_unix_get_fd(session->proto_io);
+	else if (now < session->proto_retry)
+		proto_sock = -1;	/* Offline: served locally */
+	else
+		proto_sock = proto_connect(session);
+
+	for (i = 0, n = 0; i < count; i++) {
+		if (iiov[i].iov_len > PDU_SIZE) {
+			log_error_rl("PDU too long: %zu octets",
+							iiov[i].iov_len);
+			continue;
+		}
+
+		oiov[n].iov_base = session->opdu + n * PDU_SIZE;
+
+		/*
+		 * Over the rate or the cloud calls cap: shed with an error
+		 * reply, the node retries later.
+		 */
+		if (!session_admit(session, now) ||
+					!cloud_acquire(proto_sock)) {
+			olen = msg_reject(iiov[i].iov_base, iiov[i].iov_len,
+						oiov[n].iov_base, PDU_SIZE);
+		} else {
+			olen = msg_process(sock, proto_sock,
+				proto_ops[proto_index],
+				iiov[i].iov_base, iiov[i].iov_len,
+				oiov[n].iov_base, PDU_SIZE);
+			cloud_release(proto_sock);
+		}
 
-	olen = msg_process(sock, proto_sock, proto_ops[proto_index], ipdu,
-					recvbytes, opdu, sizeof(opdu));
-	/* olen: output length or -errno */
-	if (olen < 0) {
-		/* Server didn't reply any error */
-		log_error("KNOT IoT proto error: %s(%zd)",
+		/* olen: output length or -errno */
+		if (olen < 0) {
+			/* Server didn't reply any error */
+			log_error_rl("KNOT IoT proto error: %s(%zd)",
 						strerror(-olen), -olen);
-		return TRUE;
+			continue;
+		}
+
+		/* If there are no octets to be sent */
+		if (!olen)
+			continue;
+
+		oiov[n++].iov_len = olen;
 	}
-	/* If there are no octets to be sent */
-	if (!olen)
-		return TRUE;
 
-	/* Response from the gateway: error or response for the given command */
-	sentbytes = ops->send(sock, opdu, olen);
-	if (sentbytes < 0)
-		log_error("node_ops: %s(%zd)",
-					strerror(-sentbytes), -sentbytes);
+	node_release(session);
+
+	/* Responses from the gateway: error or response for each command */
+	node_send(session, sock, oiov, n);
 
 	return TRUE;
 }
@@ -243,26 +493,18 @@ static gboolean accept_cb(GIOChannel *io, GIOCondition cond,
 							gpointer user_data)
 {
 	struct node_ops *ops = user_data;
-	GIOChannel *node_io, *proto_io;
-	int sockfd, srv_sock, proto_sock;
+	GIOChannel *node_io;
+	int sockfd, srv_sock;
 	GIOCondition watch_cond;
 	struct session *session;
 
 	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR))
 		return FALSE;
 
-	/* FIXME: Stop knotd if cloud if not available */
-	proto_sock = proto_ops[proto_index]->connect();
-	if (proto_sock < 0) {
-		log_info("Can't connect to cloud service!");
-		return TRUE;
-	}
-
 	srv_sock = g_io_channel_unix_get_fd(io);
 
 	sockfd = ops->accept(srv_sock);
 	if (sockfd < 0) {
-		proto_ops[proto_index]->close(proto_sock);
 		log_error("%p accept(): %s(%d)", ops,
 					strerror(-sockfd), -sockfd);
 		return TRUE;
@@ -271,35 +513,105 @@ static gboolean accept_cb(GIOChannel *io, GIOCondition cond,
 	node_io = g_io_channel_unix_new(sockfd);
 	g_io_channel_set_close_on_unref(node_io, TRUE);
 
-	proto_io = g_io_channel_unix_new(proto_sock);
+	/*
+	 * Fixed size: sessions come and go, GSlice avoids fragmentation.
+	 * The cloud session is opened by the worker on the first PDU:
+	 * nodes are accepted even if the cloud is unreachable.
+	 */
+	session = g_slice_new0(struct session);
+	session->ipdu = g_slice_alloc(NODE_BATCH * PDU_SIZE);
+	session->opdu = g_slice_alloc(NODE_BATCH * PDU_SIZE);
+
+	/* TODO: Create refcount */
+	session->ops = ops;
+	session->node_sock = sockfd;
+
+	/* Session is served by a single worker from now on */
+	session->context = worker_context(sockfd);
+
+	G_LOCK(session_list);
+	session_list = g_slist_prepend(session_list, session);
+	G_UNLOCK(session_list);
+
+	log_info("node:%p", node_io);
 
-	session = g_new0(struct session, 1);
 	/* Watch for unix socket disconnection */
 	watch_cond = G_IO_HUP | G_IO_NVAL | G_IO_ERR | G_IO_IN;
-	session->node_id = g_io_add_watch_full(node_io,
-				G_PRIORITY_DEFAULT, watch_cond,
-				node_io_watch, session,
+	session->node_id = worker_io_add_watch(session->context, node_io,
+				watch_cond, node_io_watch, session,
 				node_io_destroy);
 	g_io_channel_unref(node_io);
 
-	/* Watch for TCP socket disconnection */
-	watch_cond = G_IO_HUP | G_IO_NVAL | G_IO_ERR;
-	session->proto_id = g_io_add_watch_full(proto_io,
-				G_PRIORITY_DEFAULT, watch_cond,
-				proto_io_watch, session,
-				proto_io_destroy);
+	return TRUE;
+}
 
-	/* Keep one reference to call sign-off */
-	session->proto_io = proto_io;
+static gboolean proto_probe_retry(gpointer user_data);
 
-	/* TODO: Create refcount */
-	session->ops = ops;
+/* Main loop: the probe thread is done */
+static gboolean proto_probe_done(gpointer user_data)
+{
+	struct proto_ops *ops = proto_ops[proto_index];
+	int err;
 
-	log_info("node:%p proto:%p", node_io, proto_io);
+	/* Already joined by manager_stop() */
+	if (probe_thread == NULL)
+		return FALSE;
 
-	session_list = g_slist_prepend(session_list, session);
+	err = GPOINTER_TO_INT(g_thread_join(probe_thread));
+	probe_thread = NULL;
 
-	return TRUE;
+	if (err < 0) {
+		log_error("%s probe(): %s(%d)", ops->name, strerror(-err),
+								-err);
+		probe_retry_id = g_timeout_add_seconds(PROTO_RETRY,
+						proto_probe_retry, NULL);
+		return FALSE;
+	}
+
+	log_info("proto_ops(%p): %s %s:%u", ops, ops->name,
+				cloud_host ? cloud_host : "", cloud_port);
+
+	proto_probed = TRUE;
+	msg_proto_offline(FALSE);
+	g_atomic_int_set(&proto_offline, 0);
+
+	return FALSE;
+}
+
+static gpointer proto_probe_thread(gpointer user_data)
+{
+	int err;
+
+	/* Sessions don't use the driver while 'proto_offline' is set */
+	err = proto_ops[proto_index]->probe(&proto_settings);
+
+	worker_invoke(NULL, proto_probe_done, NULL, NULL);
+
+	return GINT_TO_POINTER(err);
+}
+
+static void proto_probe_start(void)
+{
+	GError *gerr = NULL;
+
+	probe_thread = g_thread_try_new("probe", proto_probe_thread, NULL,
+									&gerr);
+	if (probe_thread)
+		return;
+
+	log_error("probe thread: %s", gerr->message);
+	g_error_free(gerr);
+
+	probe_retry_id = g_timeout_add_seconds(PROTO_RETRY, proto_probe_retry,
+									NULL);
+}
+
+static gboolean proto_probe_retry(gpointer user_data)
+{
+	probe_retry_id = 0;
+	proto_probe_start();
+
+	return FALSE;
 }
 
 int manager_start(const struct settings *settings)
@@ -313,29 +625,30 @@ int manager_start(const struct settings *settings)
 	if (settings->tty)
 		serial_load_config(settings->tty);
 
-	/* Starting msg layer */
-	err = msg_start(settings->uuid);
-	if (err < 0)
-		return err;
+	if (settings->rate_limit) {
+		rate_interval = G_USEC_PER_SEC / settings->rate_limit;
+		rate_burst = rate_interval * settings->rate_burst;
+	}
 
-	/*
-	 * Selecting meshblu IoT protocols & services: HTTP/REST,
-	 * Websockets, Socket IO, MQTT, COAP. 'proto_ops' drivers
-	 * implements an abstraction similar to WEB client operations.
-	 * TODO: later support dynamic protocol selection.
-	 */
+	/* Without workers a single cloud call is pending at a time */
+	if (settings->cloud_inflight && settings->workers == 0)
+		log_info("cloud-inflight ignored: no session workers");
+	else
+		cloud_inflight_max = settings->cloud_inflight;
 
-	for (i = 0; proto_ops[i]; i++) {
-		if (strcmp(settings->proto, proto_ops[i]->name) != 0)
-			continue;
+	/* Not fatal: knotd runs without the metrics endpoint */
+	err = stats_start();
+	if (err < 0)
+		log_error("stats: %s(%d)", strerror(-err), -err);
 
-		if (proto_ops[i]->probe(settings->host, settings->port) < 0)
-			return -EIO;
+	/* Starting msg layer */
+	err = msg_start(settings);
+	if (err < 0)
+		return err;
 
-		log_info("proto_ops(%p): %s", proto_ops[i],
-							proto_ops[i]->name);
-		proto_index = i;
-	}
+	err = worker_start(settings->workers);
+	if (err < 0)
+		return err;
 
 	/*
 	 * Probing all access technologies: nRF24L01, BTLE, TCP, Unix
@@ -379,23 +692,85 @@ int manager_start(const struct settings *settings)
 				      GUINT_TO_POINTER(server_watch_id));
 	}
 
+	/*
+	 * Selecting meshblu IoT protocols & services: HTTP/REST,
+	 * Websockets, Socket IO, MQTT, COAP. 'proto_ops' drivers
+	 * implements an abstraction similar to WEB client operations.
+	 * TODO: later support dynamic protocol selection.
+	 */
+
+	for (i = 0; proto_ops[i]; i++) {
+		if (strcmp(settings->proto, proto_ops[i]->name) == 0)
+			proto_index = i;
+	}
+
+	cloud_host = g_strdup(settings->host);
+	cloud_port = settings->port;
+
+	proto_settings = *settings;
+	proto_settings.host = cloud_host;
+	proto_settings.uuid = NULL;
+
+	/* Nodes are served already: resolving the cloud may take a while */
+	g_atomic_int_set(&proto_offline, 1);
+	msg_proto_offline(TRUE);
+	proto_probe_start();
+
 	return 0;
 }
 
 void manager_stop(void)
 {
-	GSList *list;
+	GSList *list, *sessions;
 	struct session *session;
 	guint server_watch_id;
 	int i;
 
+	/* Sessions are released below, from the main thread */
+	worker_stop();
+
+	if (probe_retry_id)
+		g_source_remove(probe_retry_id);
+	probe_retry_id = 0;
+
+	/* proto_probe_done() won't run anymore */
+	if (probe_thread)
+		proto_probed = g_thread_join(probe_thread) == NULL;
+	probe_thread = NULL;
+
 	msg_stop();
 
+	/*
+	 * Sessions must be released before removing the proto driver:
+	 * node_io_destroy() closes the cloud session and removes the
+	 * entry from 'session_list'.
+	 */
+	G_LOCK(session_list);
+	sessions = g_slist_copy(session_list);
+	G_UNLOCK(session_list);
+
+	for (list = sessions; list; list = g_slist_next(list)) {
+		session = list->data;
+
+		/* Freed by node_io_destroy */
+		worker_source_remove(session->context, session->node_id);
+
+		/* Watch already gone: released here, the loop progresses */
+		if (g_slist_find(session_list, session)) {
+			log_error("session %p: node watch not found", session);
+			node_io_destroy(session);
+		}
+	}
+
+	g_slist_free(sessions);
+
 	/* Remove only previously loaded modules */
 	for (i = 0; node_ops[i]; i++)
 		node_ops[i]->remove();
 
-	proto_ops[proto_index]->remove();
+	if (proto_probed)
+		proto_ops[proto_index]->remove();
+	proto_probed = FALSE;
 
 	for (list = server_watch; list; list = g_slist_next(list)) {
 		server_watch_id = GPOINTER_TO_UINT(list->data);
@@ -406,12 +781,118 @@ void manager_stop(void)
 
 	g_slist_free(server_watch);
 
+	worker_cleanup();
+	stats_stop();
+
+	g_free(cloud_host);
+	cloud_host = NULL;
+}
+
+static gboolean proto_reprobe(gpointer user_data)
+{
+	msg_proto_offline(TRUE);
+
+	if (proto_probed)
+		proto_ops[proto_index]->remove();
+	proto_probed = FALSE;
+
+	proto_probe_start();
+
+	return FALSE;
+}
+
+static void proto_reset_done(void)
+{
+	if (g_atomic_int_dec_and_test(&proto_resets))
+		worker_invoke(NULL, proto_reprobe, NULL, NULL);
+}
+
+/* Runs on 'context': its sessions can't be released meanwhile */
+static gboolean sessions_proto_reset(gpointer user_data)
+{
+	GMainContext *context = user_data;
+	GSList *list, *sessions = NULL;
+	struct session *session;
+
+	G_LOCK(session_list);
 	for (list = session_list; list; list = g_slist_next(list)) {
 		session = list->data;
+		if (session->context == context)
+			sessions = g_slist_prepend(sessions, session);
+	}
+	G_UNLOCK(session_list);
 
-		/* Freed by node_io_destroy */
-		g_source_remove(session->node_id);
+	for (list = sessions; list; list = g_slist_next(list)) {
+		session = list->data;
+		session_proto_close(session);
+		/* Reconnects on the next PDU */
+		session->proto_retry = 0;
+	}
+
+	g_slist_free(sessions);
+	proto_reset_done();
+
+	return FALSE;
+}
+
+/*
+ * Applies the settings read again from the config file. Only the cloud
+ * server needs the sessions: their cloud connections are closed by the
+ * worker serving them, then the proto driver is probed again.
+ */
+int manager_reload(const struct settings *settings)
+{
+	GSList *list, *contexts = NULL;
+	struct session *session;
+	gboolean moved;
+
+	moved = g_strcmp0(settings->host, cloud_host) != 0 ||
+					settings->port != cloud_port;
+
+	/* Nothing is applied while a probe or reset is running */
+	if (moved && (probe_thread || (g_atomic_int_get(&proto_offline) &&
+							probe_retry_id == 0)))
+		return -EBUSY;
+
+	msg_reload(settings);
+
+	if (!moved)
+		return 0;
+
+	g_free(cloud_host);
+	cloud_host = g_strdup(settings->host);
+	cloud_port = settings->port;
+
+	proto_settings = *settings;
+	proto_settings.host = cloud_host;
+	proto_settings.uuid = NULL;
+
+	/* Not probed yet: no session is connected to the previous server */
+	if (probe_retry_id) {
+		g_source_remove(probe_retry_id);
+		probe_retry_id = 0;
+		proto_probe_start();
+		return 0;
 	}
 
-	g_slist_free(session_list);
+	g_atomic_int_set(&proto_offline, 1);
+
+	G_LOCK(session_list);
+	for (list = session_list; list; list = g_slist_next(list)) {
+		session = list->data;
+		if (!g_slist_find(contexts, session->context))
+			contexts = g_slist_prepend(contexts, session->context);
+	}
+	G_UNLOCK(session_list);
+
+	/* One extra reference: released once every reset is queued */
+	g_atomic_int_set(&proto_resets, g_slist_length(contexts) + 1);
+	for (list = contexts; list; list = g_slist_next(list))
+		worker_invoke(list->data, sessions_proto_reset, list->data,
+									NULL);
+	g_slist_free(contexts);
+
+	proto_reset_done();
+
+	return 0;
 }
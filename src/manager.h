@@ -28,3 +28,4 @@
 
 int manager_start(const struct settings *settings);
 void manager_stop(void);
+int manager_reload(const struct settings *settings);
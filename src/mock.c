@@ -0,0 +1,339 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2017, CESAR. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the CESAR nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL CESAR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include <json-c/json.h>
+
+#include "log.h"
+#include "settings.h"
+#include "proto.h"
+
+#define MOCK_UUID_SIZE			36
+#define MOCK_TOKEN_SIZE			40
+
+/*
+ * In-memory cloud: devices are kept in a table indexed by uuid and every
+ * operation is answered locally after 'latency' ms. A percentage of the
+ * operations fails with -EIO. It measures the gateway cost without any
+ * network or Meshblu variance in the way.
+ */
+G_LOCK_DEFINE_STATIC(mock);
+static GHashTable *devices;	/* uuid -> device json_object */
+static GHashTable *peers;	/* proto sock -> socketpair peer */
+static unsigned int latency;	/* ms */
+static unsigned int error_rate;	/* percentage */
+static gint watch_id;
+
+static void mock_hex(char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = "0123456789abcdef"[g_random_int_range(0, 16)];
+	buf[len] = '\0';
+}
+
+/* Blocks the caller just like a synchronous cloud round trip */
+static int mock_delay(void)
+{
+	if (latency)
+		g_usleep(latency * 1000);
+
+	if (error_rate && (unsigned int) g_random_int_range(0, 100) <
+								error_rate)
+		return -EIO;
+
+	return 0;
+}
+
+static int mock_reply(json_object *jobj, json_raw_t *json)
+{
+	const char *jobjstr;
+
+	json->data = NULL;
+	json->size = 0;
+	json->jobj = NULL;
+
+	if (jobj == NULL)
+		return 0;
+
+	jobjstr = json_object_to_json_string(jobj);
+	json->data = strdup(jobjstr);
+	if (json->data == NULL)
+		return -ENOMEM;
+
+	json->size = strlen(jobjstr) + 1;
+
+	return 0;
+}
+
+/* Called with the lock held */
+static json_object *device_get(const char *uuid, const char *token,
+								int *err)
+{
+	json_object *jobj, *jtoken;
+
+	jobj = g_hash_table_lookup(devices, uuid);
+	if (jobj == NULL) {
+		*err = -ENOENT;
+		return NULL;
+	}
+
+	if (!json_object_object_get_ex(jobj, "token", &jtoken) ||
+		g_strcmp0(json_object_get_string(jtoken), token) != 0) {
+		*err = -EPERM;
+		return NULL;
+	}
+
+	*err = 0;
+
+	return jobj;
+}
+
+static void device_free(gpointer user_data)
+{
+	json_object_put(user_data);
+}
+
+static int mock_probe(const struct settings *settings)
+{
+	latency = settings->mock_latency;
+	error_rate = MIN(settings->mock_errors, 100);
+
+	devices = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+								device_free);
+	peers = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	log_info("mock: latency %u ms, errors %u%%", latency, error_rate);
+
+	return 0;
+}
+
+static void peer_close(gpointer key, gpointer value, gpointer user_data)
+{
+	close(GPOINTER_TO_INT(value));
+}
+
+static void mock_remove(void)
+{
+	g_hash_table_foreach(peers, peer_close, NULL);
+	g_hash_table_destroy(peers);
+	g_hash_table_destroy(devices);
+}
+
+/* The peer is never written: it only reports hang ups to the manager */
+static int mock_connect(void)
+{
+	int err, sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		err = -errno;
+		log_error("mock: socketpair(): %s(%d)", strerror(-err), -err);
+		return err;
+	}
+
+	G_LOCK(mock);
+	g_hash_table_insert(peers, GINT_TO_POINTER(sv[0]),
+						GINT_TO_POINTER(sv[1]));
+	G_UNLOCK(mock);
+
+	return sv[0];
+}
+
+static void mock_close(int sock)
+{
+	gpointer peer;
+
+	G_LOCK(mock);
+	peer = g_hash_table_lookup(peers, GINT_TO_POINTER(sock));
+	g_hash_table_remove(peers, GINT_TO_POINTER(sock));
+	G_UNLOCK(mock);
+
+	if (peer)
+		close(GPOINTER_TO_INT(peer));
+}
+
+static int mock_mknode(int sock, const char *jreq, json_raw_t *json)
+{
+	char uuid[MOCK_UUID_SIZE + 1], token[MOCK_TOKEN_SIZE + 1];
+	char hex[33];
+	json_object *jobj;
+	int err;
+
+	err = mock_delay();
+	if (err < 0)
+		return err;
+
+	jobj = json_tokener_parse(jreq);
+	if (jobj == NULL)
+		return -EINVAL;
+
+	mock_hex(hex, 32);
+	snprintf(uuid, sizeof(uuid), "%.8s-%.4s-%.4s-%.4s-%.12s", hex,
+					hex + 8, hex + 12, hex + 16, hex + 20);
+	mock_hex(token, MOCK_TOKEN_SIZE);
+
+	json_object_object_add(jobj, "uuid", json_object_new_string(uuid));
+	json_object_object_add(jobj, "token", json_object_new_string(token));
+
+	G_LOCK(mock);
+	g_hash_table_replace(devices, g_strdup(uuid), jobj);
+	err = mock_reply(jobj, json);
+	G_UNLOCK(mock);
+
+	return err;
+}
+
+static int mock_signin(int sock, const char *uuid, const char *token,
+							json_raw_t *json)
+{
+	json_object *jobj;
+	int err;
+
+	err = mock_delay();
+	if (err < 0)
+		return err;
+
+	G_LOCK(mock);
+	jobj = device_get(uuid, token, &err);
+	if (jobj)
+		err = mock_reply(jobj, json);
+	G_UNLOCK(mock);
+
+	return err;
+}
+
+static int mock_rmnode(int sock, const char *uuid, const char *token,
+							json_raw_t *jbuf)
+{
+	int err;
+
+	err = mock_delay();
+	if (err < 0)
+		return err;
+
+	G_LOCK(mock);
+	if (device_get(uuid, token, &err))
+		g_hash_table_remove(devices, uuid);
+	G_UNLOCK(mock);
+
+	if (err == 0)
+		err = mock_reply(NULL, jbuf);
+
+	return err;
+}
+
+/* Schema, config and set data: PUT semantics, keys are replaced */
+static int mock_update(int sock, const char *uuid, const char *token,
+					const char *jreq, json_raw_t *json)
+{
+	json_object *jobj, *jreqobj;
+	int err;
+
+	err = mock_delay();
+	if (err < 0)
+		return err;
+
+	jreqobj = json_tokener_parse(jreq);
+	if (jreqobj == NULL)
+		return -EINVAL;
+
+	G_LOCK(mock);
+	jobj = device_get(uuid, token, &err);
+	if (jobj) {
+		json_object_object_foreach(jreqobj, key, val) {
+			json_object_object_add(jobj, key,
+						json_object_get(val));
+		}
+		err = mock_reply(jobj, json);
+	}
+	G_UNLOCK(mock);
+
+	json_object_put(jreqobj);
+
+	return err;
+}
+
+/* Readings are accepted and dropped: there is no history */
+static int mock_data(int sock, const char *uuid, const char *token,
+					const char *jreq, json_raw_t *jbuf)
+{
+	int err;
+
+	err = mock_delay();
+	if (err < 0)
+		return err;
+
+	G_LOCK(mock);
+	device_get(uuid, token, &err);
+	G_UNLOCK(mock);
+
+	if (err == 0)
+		err = mock_reply(NULL, jbuf);
+
+	return err;
+}
+
+/* Nothing else changes the devices: watches never fire */
+static unsigned int mock_watch(int proto_sock, const char *uuid,
+				const char *token, void (*proto_watch_cb)
+				(json_raw_t, void *), void *user_data)
+{
+	return g_atomic_int_add(&watch_id, 1) + 1;
+}
+
+static void mock_unwatch(unsigned int id)
+{
+}
+
+struct proto_ops proto_mock = {
+	.name = "mock",
+	.probe = mock_probe,
+	.remove = mock_remove,
+
+	.connect = mock_connect,
+	.close = mock_close,
+	.mknode = mock_mknode,
+	.signin = mock_signin,
+	.rmnode = mock_rmnode,
+	.schema = mock_update,
+	.data = mock_data,
+	.fetch = mock_signin,
+	.setdata = mock_update,
+	.async = mock_watch,
+	.unwatch = mock_unwatch
+};
@@ -0,0 +1,692 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2017, CESAR. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the CESAR nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL CESAR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <mosquitto.h>
+
+#include <glib.h>
+
+#include <json-c/json.h>
+
+#include <knot_types.h>
+
+#include "log.h"
+#include "settings.h"
+#include "worker.h"
+#include "proto.h"
+#include "serializer.h"
+
+#define MQTT_KEEPALIVE		60	/* seconds */
+#define MQTT_QOS		1
+#define MQTT_PORT		1883
+#define REQUEST_TIMEOUT		10000	/* ms */
+#define DEFAULT_CLOUD_HOST	"localhost"
+
+/*
+ * Meshblu MQTT adapter: a request is published to the topic named after
+ * the operation and the reply comes on the client's own topic (its client
+ * id) as {"topic": <operation>, "data": <result>}. Any other message on
+ * that topic is pushed by the cloud: config, set_data and get_data.
+ *
+ * Each session owns one client, served by the worker of the session. Once
+ * signed in the client id is the device uuid and the session is persistent
+ * (no clean session, QoS 1): the broker keeps the subscription and queues
+ * the pushes while the gateway is away, no polling is needed. Publishes
+ * out of a device session (journal uploads) use a clean session with a
+ * random client id: the broker would disconnect the device client if its
+ * id was taken over. Payloads are the Meshblu JSON documents, only the
+ * framing is smaller than HTTP.
+ */
+
+/* Pending request: done on its reply or, if 'reply' is NULL, on PUBACK */
+struct mqtt_request {
+	const char *reply;
+	int mid;
+	gboolean done;
+	json_object *jdata;
+};
+
+/* Cloud push handed over to the worker of the session */
+struct mqtt_push {
+	int sock;
+	json_object *root;		/* Parsed message, owns 'jobj' */
+	json_object *jobj;
+};
+
+/*
+ * The manager only sees 'sock', one end of a socketpair: the other end
+ * is closed to report a cloud disconnection.
+ */
+struct mqtt_session {
+	int sock;
+	int peer;
+	struct mosquitto *mosq;
+	char *id;			/* Client id: topic of the replies */
+	char *uuid;			/* Device, NULL: registration only */
+	gboolean persistent;		/* Client id is the device uuid */
+	gboolean connected;
+	int connack;			/* CONNACK return code */
+	gboolean error;
+	GMainContext *context;		/* Worker owning 'mosq' */
+	unsigned int io_id;
+	unsigned int misc_id;
+	struct mqtt_request *req;
+	GString *txbuf;			/* Outgoing payload */
+	void (*watch_cb)(json_raw_t, void *);
+	void *user_data;
+};
+
+G_LOCK_DEFINE_STATIC(mqtt);
+static GHashTable *sessions;		/* proto sock -> struct mqtt_session */
+static char *host_address;
+static int host_port;
+
+static struct mqtt_session *session_get(int sock)
+{
+	struct mqtt_session *session;
+
+	G_LOCK(mqtt);
+	session = g_hash_table_lookup(sessions, GINT_TO_POINTER(sock));
+	G_UNLOCK(mqtt);
+
+	return session;
+}
+
+static void session_hup(struct mqtt_session *session)
+{
+	/* Wakes up mqtt_wait(): 'mosq' must be connected again */
+	session->error = TRUE;
+
+	if (session->peer < 0)
+		return;
+
+	/* Manager sees G_IO_HUP on session->sock and releases the session */
+	close(session->peer);
+	session->peer = -1;
+}
+
+static void client_free(struct mqtt_session *session)
+{
+	if (session->io_id)
+		worker_source_remove(session->context, session->io_id);
+	if (session->misc_id)
+		worker_source_remove(session->context, session->misc_id);
+	session->io_id = 0;
+	session->misc_id = 0;
+
+	if (session->mosq) {
+		if (session->connected && !session->error)
+			mosquitto_disconnect(session->mosq);
+		mosquitto_destroy(session->mosq);
+	}
+
+	session->mosq = NULL;
+	session->connected = FALSE;
+	session->error = FALSE;
+	g_free(session->id);
+	session->id = NULL;
+	g_free(session->uuid);
+	session->uuid = NULL;
+}
+
+static void session_free(gpointer user_data)
+{
+	struct mqtt_session *session = user_data;
+
+	client_free(session);
+
+	if (session->peer >= 0)
+		close(session->peer);
+
+	g_string_free(session->txbuf, TRUE);
+	g_free(session);
+}
+
+static void reply_copy(json_object *jobj, json_raw_t *json)
+{
+	const char *str = json_object_to_json_string(jobj);
+	size_t len = strlen(str) + 1;
+
+	json->data = realloc(json->data, json->size + len);
+	if (json->data == NULL) {
+		log_error("Not enough memory");
+		json->size = 0;
+		return;
+	}
+
+	memcpy(json->data + json->size, str, len);
+	json->size += len;
+}
+
+static gboolean push_deliver(gpointer user_data)
+{
+	struct mqtt_push *push = user_data;
+	struct mqtt_session *session;
+	json_raw_t json;
+
+	memset(&json, 0, sizeof(json_raw_t));
+	json.jobj = push->jobj;
+
+	/* Session may be closed meanwhile */
+	session = session_get(push->sock);
+	if (session && session->watch_cb)
+		session->watch_cb(json, session->user_data);
+
+	json_object_put(push->root);
+	g_free(push);
+
+	return FALSE;
+}
+
+static void on_connect(struct mosquitto *mosq, void *obj, int rc)
+{
+	struct mqtt_session *session = obj;
+
+	session->connack = rc;
+	session->connected = TRUE;
+}
+
+static void on_disconnect(struct mosquitto *mosq, void *obj, int rc)
+{
+	struct mqtt_session *session = obj;
+
+	log_info("MQTT %s disconnected: %s", session->id,
+						mosquitto_strerror(rc));
+	session_hup(session);
+}
+
+static void on_publish(struct mosquitto *mosq, void *obj, int mid)
+{
+	struct mqtt_session *session = obj;
+	struct mqtt_request *req = session->req;
+
+	if (req && req->reply == NULL && req->mid == mid)
+		req->done = TRUE;
+}
+
+static void on_message(struct mosquitto *mosq, void *obj,
+				const struct mosquitto_message *msg)
+{
+	struct mqtt_session *session = obj;
+	struct mqtt_request *req = session->req;
+	struct mqtt_push *push;
+	json_tokener *tok;
+	json_object *jres, *jtopic, *jdata = NULL;
+
+	tok = json_tokener_new();
+	jres = json_tokener_parse_ex(tok, msg->payload, msg->payloadlen);
+	json_tokener_free(tok);
+	if (jres == NULL) {
+		log_error("MQTT %s: invalid payload", msg->topic);
+		return;
+	}
+
+	if (!json_object_object_get_ex(jres, "topic", &jtopic))
+		goto done;
+
+	json_object_object_get_ex(jres, "data", &jdata);
+
+	if (req && req->reply &&
+		strcmp(req->reply, json_object_get_string(jtopic)) == 0) {
+		req->jdata = json_object_get(jdata);
+		req->done = TRUE;
+		goto done;
+	}
+
+	if (session->watch_cb == NULL || jdata == NULL)
+		goto done;
+
+	/* Not from mosquitto_loop(): msg.c may be waiting for a reply */
+	push = g_new0(struct mqtt_push, 1);
+	push->sock = session->sock;
+	push->root = jres;
+	push->jobj = jdata;
+	worker_timeout_add(session->context, 0, push_deliver, push);
+	return;
+
+done:
+	json_object_put(jres);
+}
+
+/* Serves 'mosq' until '*done' is set: called by the session worker only */
+static int mqtt_wait(struct mqtt_session *session, const gboolean *done)
+{
+	gint64 deadline;
+	int timeout, rc;
+
+	deadline = g_get_monotonic_time() + REQUEST_TIMEOUT * 1000;
+
+	while (!*done && !session->error) {
+		timeout = (deadline - g_get_monotonic_time()) / 1000;
+		if (timeout <= 0)
+			return -ETIMEDOUT;
+
+		rc = mosquitto_loop(session->mosq, timeout, 1);
+		if (rc == MOSQ_ERR_ERRNO && errno == EINTR)
+			continue;
+
+		if (rc != MOSQ_ERR_SUCCESS) {
+			log_error("mosquitto_loop(): %s",
+						mosquitto_strerror(rc));
+			session_hup(session);
+		}
+	}
+
+	return session->error ? -ECONNRESET : 0;
+}
+
+static gboolean mqtt_io_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct mqtt_session *session = user_data;
+	int rc;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		session->io_id = 0;
+		session_hup(session);
+		return FALSE;
+	}
+
+	rc = mosquitto_loop_read(session->mosq, 1);
+	if (rc == MOSQ_ERR_SUCCESS && mosquitto_want_write(session->mosq))
+		rc = mosquitto_loop_write(session->mosq, 1);
+
+	if (rc != MOSQ_ERR_SUCCESS) {
+		session->io_id = 0;
+		session_hup(session);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Keepalive: PINGREQ is queued by loop_misc() */
+static gboolean mqtt_misc_cb(gpointer user_data)
+{
+	struct mqtt_session *session = user_data;
+
+	if (session->error) {
+		session->misc_id = 0;
+		return FALSE;
+	}
+
+	mosquitto_loop_misc(session->mosq);
+	if (mosquitto_want_write(session->mosq))
+		mosquitto_loop_write(session->mosq, 1);
+
+	return TRUE;
+}
+
+/*
+ * Connects the client of the session: anonymous to register a device,
+ * then as the device itself, identified by 'uuid' and 'token'. Only the
+ * 'persistent' client takes the device uuid as client id.
+ */
+static int client_connect(struct mqtt_session *session, const char *uuid,
+					const char *token, gboolean persistent)
+{
+	GIOCondition cond = G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
+	GIOChannel *io;
+	char *id;
+	int rc, err;
+
+	if (session->mosq && !session->error &&
+			g_strcmp0(session->uuid, uuid) == 0 &&
+			(session->persistent || !persistent))
+		return 0;
+
+	client_free(session);
+
+	persistent = persistent && uuid;
+	if (persistent)
+		id = g_strdup(uuid);
+	else
+		id = g_strdup_printf("knotd-%08x", g_random_int());
+
+	session->mosq = mosquitto_new(id, !persistent, session);
+	if (session->mosq == NULL) {
+		g_free(id);
+		return -ENOMEM;
+	}
+
+	session->id = id;
+	session->uuid = g_strdup(uuid);
+	session->persistent = persistent;
+	session->context = worker_current();
+
+	mosquitto_connect_callback_set(session->mosq, on_connect);
+	mosquitto_disconnect_callback_set(session->mosq, on_disconnect);
+	mosquitto_publish_callback_set(session->mosq, on_publish);
+	mosquitto_message_callback_set(session->mosq, on_message);
+
+	if (uuid)
+		mosquitto_username_pw_set(session->mosq, uuid, token);
+
+	rc = mosquitto_connect(session->mosq, host_address, host_port,
+							MQTT_KEEPALIVE);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		log_error("mosquitto_connect(%s): %s", host_address,
+						mosquitto_strerror(rc));
+		err = -ECONNREFUSED;
+		goto fail;
+	}
+
+	err = mqtt_wait(session, &session->connected);
+	if (err < 0)
+		goto fail;
+
+	if (session->connack) {
+		log_error("MQTT CONNACK: %s",
+				mosquitto_connack_string(session->connack));
+		err = -ECONNREFUSED;
+		goto fail;
+	}
+
+	/* Persistent session: the broker may remember it already */
+	rc = mosquitto_subscribe(session->mosq, NULL, session->id, MQTT_QOS);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		err = -ECONNRESET;
+		goto fail;
+	}
+
+	io = g_io_channel_unix_new(mosquitto_socket(session->mosq));
+	session->io_id = worker_io_add_watch(session->context, io, cond,
+						mqtt_io_cb, session, NULL);
+	g_io_channel_unref(io);
+
+	session->misc_id = worker_timeout_add(session->context,
+					MQTT_KEEPALIVE * 1000 / 2,
+					mqtt_misc_cb, session);
+
+	return 0;
+
+fail:
+	client_free(session);
+
+	return err;
+}
+
+/*
+ * Publishes 'payload' to 'topic' and waits for the reply on the client
+ * topic or, if 'reply' is NULL, for the PUBACK. The reply data is copied
+ * to 'json' if it is not NULL.
+ */
+static int mqtt_call(struct mqtt_session *session, const char *topic,
+				const char *payload, const char *reply,
+				json_raw_t *json)
+{
+	struct mqtt_request req;
+	int rc, err;
+
+	memset(&req, 0, sizeof(req));
+	req.reply = reply;
+
+	log_dbg("MQTT TX %s: %s", topic, payload);
+
+	session->req = &req;
+
+	rc = mosquitto_publish(session->mosq, &req.mid, topic,
+				strlen(payload), payload, MQTT_QOS, false);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		log_error("mosquitto_publish(%s): %s", topic,
+						mosquitto_strerror(rc));
+		err = -ECONNRESET;
+		goto done;
+	}
+
+	err = mqtt_wait(session, &req.done);
+	if (err < 0)
+		goto done;
+
+	if (json && req.jdata)
+		reply_copy(req.jdata, json);
+done:
+	session->req = NULL;
+	if (req.jdata)
+		json_object_put(req.jdata);
+
+	return err;
+}
+
+static int mqtt_connect(void)
+{
+	struct mqtt_session *session;
+	int err, sv[2];
+
+	/* The client connects on mknode() or signin() */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		err = -errno;
+		log_error("socketpair(): %s(%d)", strerror(-err), -err);
+		return err;
+	}
+
+	session = g_new0(struct mqtt_session, 1);
+	session->sock = sv[0];
+	session->peer = sv[1];
+	session->txbuf = g_string_sized_new(256);
+
+	G_LOCK(mqtt);
+	g_hash_table_insert(sessions, GINT_TO_POINTER(session->sock), session);
+	G_UNLOCK(mqtt);
+
+	return session->sock;
+}
+
+static void mqtt_close(int sock)
+{
+	struct mqtt_session *session;
+
+	G_LOCK(mqtt);
+	session = g_hash_table_lookup(sessions, GINT_TO_POINTER(sock));
+	if (session)
+		g_hash_table_steal(sessions, GINT_TO_POINTER(sock));
+	G_UNLOCK(mqtt);
+
+	if (!session) {
+		log_error("Removing key: sock %d not found!", sock);
+		return;
+	}
+
+	session_free(session);
+}
+
+static int mqtt_mknode(int sock, const char *device_json, json_raw_t *json)
+{
+	struct mqtt_session *session;
+	int err;
+
+	session = session_get(sock);
+	if (session == NULL)
+		return -EBADF;
+
+	err = client_connect(session, NULL, NULL, FALSE);
+	if (err < 0)
+		return err;
+
+	return mqtt_call(session, "register", device_json, "register", json);
+}
+
+static int mqtt_fetch(int sock, const char *uuid, const char *token,
+							json_raw_t *json)
+{
+	struct mqtt_session *session;
+	int err;
+
+	session = session_get(sock);
+	if (session == NULL)
+		return -EBADF;
+
+	err = client_connect(session, uuid, token, TRUE);
+	if (err < 0)
+		return err;
+
+	return mqtt_call(session, "whoami", "{}", "whoami", json);
+}
+
+static int mqtt_signin(int sock, const char *uuid, const char *token,
+							json_raw_t *json)
+{
+	int err;
+
+	/* CONNACK authenticates the device, whoami returns its properties */
+	err = mqtt_fetch(sock, uuid, token, json);
+	if (err == -ECONNRESET)
+		err = -ECONNREFUSED;
+
+	return err;
+}
+
+static int mqtt_rmnode(int sock, const char *uuid, const char *token,
+							json_raw_t *json)
+{
+	struct mqtt_session *session;
+	int err;
+
+	session = session_get(sock);
+	if (session == NULL)
+		return -EBADF;
+
+	err = client_connect(session, uuid, token, FALSE);
+	if (err < 0)
+		return err;
+
+	g_string_truncate(session->txbuf, 0);
+	err = serializer_credentials(session->txbuf, "{}", uuid, token);
+	if (err < 0)
+		return err;
+
+	return mqtt_call(session, "unregister", session->txbuf->str,
+							"unregister", json);
+}
+
+/* Reuses the device client if signed in, PUBACK acknowledges the update */
+static int mqtt_publish(int sock, const char *topic, const char *uuid,
+				const char *token, const char *jreq)
+{
+	struct mqtt_session *session;
+	int err;
+
+	session = session_get(sock);
+	if (session == NULL)
+		return -EBADF;
+
+	err = client_connect(session, uuid, token, FALSE);
+	if (err < 0)
+		return err;
+
+	g_string_truncate(session->txbuf, 0);
+	err = serializer_credentials(session->txbuf, jreq, uuid, NULL);
+	if (err < 0)
+		return err;
+
+	return mqtt_call(session, topic, session->txbuf->str, NULL, NULL);
+}
+
+static int mqtt_update(int sock, const char *uuid, const char *token,
+					const char *jreq, json_raw_t *json)
+{
+	return mqtt_publish(sock, "update", uuid, token, jreq);
+}
+
+static int mqtt_data(int sock, const char *uuid, const char *token,
+					const char *jreq, json_raw_t *json)
+{
+	return mqtt_publish(sock, "data", uuid, token, jreq);
+}
+
+/* Pushed by the broker on the device topic: nothing to poll */
+static unsigned int mqtt_watch(int proto_sock, const char *uuid,
+				const char *token, void (*proto_watch_cb)
+				(json_raw_t, void *), void *user_data)
+{
+	struct mqtt_session *session;
+
+	session = session_get(proto_sock);
+	if (session == NULL)
+		return 0;
+
+	session->watch_cb = proto_watch_cb;
+	session->user_data = user_data;
+
+	return 0;
+}
+
+static int mqtt_probe(const struct settings *settings)
+{
+	int rc;
+
+	rc = mosquitto_lib_init();
+	if (rc != MOSQ_ERR_SUCCESS) {
+		log_error("mosquitto_lib_init(): %s", mosquitto_strerror(rc));
+		return -EIO;
+	}
+
+	host_address = g_strdup(settings->host ? settings->host :
+							DEFAULT_CLOUD_HOST);
+	host_port = settings->port ? settings->port : MQTT_PORT;
+
+	sessions = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+							NULL, session_free);
+
+	return 0;
+}
+
+static void mqtt_remove(void)
+{
+	g_hash_table_destroy(sessions);
+	sessions = NULL;
+
+	g_free(host_address);
+	host_address = NULL;
+
+	mosquitto_lib_cleanup();
+}
+
+struct proto_ops proto_mqtt = {
+	.name = "mqtt",
+	.probe = mqtt_probe,
+	.remove = mqtt_remove,
+	.connect = mqtt_connect,
+	.close = mqtt_close,
+	.mknode = mqtt_mknode,
+	.signin = mqtt_signin,
+	.rmnode = mqtt_rmnode,
+	.schema = mqtt_update,
+	.data = mqtt_data,
+	.fetch = mqtt_fetch,
+	.async = mqtt_watch,
+	.setdata = mqtt_update
+};
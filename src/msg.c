@@ -26,12 +26,18 @@
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 
-#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <glib.h>
 
 #include <json-c/json.h>
@@ -41,54 +47,237 @@
 
 #include <unistd.h>
 
+#include "settings.h"
 #include "proto.h"
 #include "log.h"
+#include "table.h"
+#include "serializer.h"
+#include "worker.h"
+#include "cache.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 #include "msg.h"
 
+#define DATA_BATCH_DEFAULT	16
+
+/* Fragments of a schema transfer must arrive within this window (ms) */
+#define SCHEMA_TIMEOUT		10000
+
+/* Acknowledgements of set_data and get_data are aggregated (ms) */
+#define ACK_WINDOW		200
+
+/* Messages pushed to the thing per system call */
+#define PUSH_BATCH		16
+
+/* Cached trusts are validated by the cloud within this window (ms) */
+#define CACHE_REVALIDATE	30000
+/* Cloud unreachable: validation retried, doubling up to (ms) */
+#define CACHE_REVALIDATE_MAX	600000
+
+/* Offline readings: upload retry interval (s) and records per round */
+#define JOURNAL_RETRY		5
+#define JOURNAL_BATCH		32
+
 struct config {
 	knot_msg_config kmcfg;		/* knot_message_config from cloud */
-	char *hash;			/* Checksum of kmcfg */
+	uint32_t fingerprint;		/* Hash of the binary kmcfg */
 	gboolean confirmed;
 
 };
 
+/*
+ * Sessions, trusts and watches are allocated from GSlice: fixed size
+ * chunks don't fragment the heap of long running gateways.
+ */
 struct trust {
-	char *uuid;			/* Device UUID */
-	char *token;			/* Device token */
-	GSList *schema;			/* knot_schema accepted by cloud */
-	GSList *schema_tmp;		/*
-					* knot_schema to be submitted to cloud
-					*/
-	GSList *config;			/* knot_config accepted from cloud */
-	GSList *config_tmp;		/* knot_config to be validate by GW */
+	char uuid[KNOT_PROTOCOL_UUID_LEN + 1];		/* Device UUID */
+	char token[KNOT_PROTOCOL_TOKEN_LEN + 1];	/* Device token */
+	/* Tables indexed by sensor_id, NULL if empty */
+	struct sensor_table *schema;	/* knot_schema accepted by cloud */
+	/* knot_schema to be submitted to cloud */
+	struct sensor_table *schema_tmp;
+	unsigned int schema_id;		/* Schema transfer timeout */
+	struct sensor_table *config;	/* knot_config accepted from cloud */
+	/* knot_config to be validate by GW */
+	struct sensor_table *config_tmp;
+	GString *jbuf;			/* Data serialization buffer */
+	GSList *batch;			/* data_entry waiting for upload */
+	unsigned int batch_len;
+	unsigned int batch_id;		/* Flush window timeout */
+	int sock;			/* Thing connection */
+	int proto_sock;
+	const struct proto_ops *proto_ops;
+	GMainContext *context;		/* Worker of the session */
+	unsigned int revalidate_id;	/* Authenticated from the cache */
+	unsigned int revalidate_delay;	/* Retry interval (ms) */
+	unsigned int hup_id;		/* Thing disconnection watch */
+	struct proto_watch *proto_watch;	/* NULL: cloud not watched */
+	/* Sensors acknowledged by the thing, bitmaps of sensor_id */
+	uint32_t ack_setdata[256 / 32];
+	uint32_t ack_getdata[256 / 32];
+	gboolean ack_pending;
+	unsigned int ack_id;		/* Acknowledgement flush window */
+};
+
+/* Sensor reading buffered until the flush window expires */
+struct data_entry {
+	uint8_t sensor_id;
+	gboolean getdata;		/* Remove sensor_id from 'get_data' */
+	char *json;
 };
 
 struct proto_watch {
 	unsigned int id;
+	unsigned int hup_id;		/* Cloud disconnection watch */
+	const struct proto_ops *proto_ops;
 	GIOChannel *node_io;
 };
 
-/* Maps sockets to sessions  */
+/*
+ * Maps sockets to sessions. Sessions may be served by different workers:
+ * the table is shared, but each trust is only used by its own worker.
+ */
+G_LOCK_DEFINE_STATIC(trust_list);
 static GHashTable *trust_list;
 
+/* Written by msg_reload() from the main loop, read by the workers */
+G_LOCK_DEFINE_STATIC(msg_settings);
 static char owner_uuid[KNOT_PROTOCOL_UUID_LEN + 1];
 
-static void config_free(gpointer mem)
+/* Data upload batching: window 0 sends each reading right away */
+static unsigned int data_window;
+static unsigned int data_batch = DATA_BATCH_DEFAULT;
+
+/* Journal drain runs on the main loop on its own cloud session */
+G_LOCK_DEFINE_STATIC(journal_drain);
+static const struct proto_ops *journal_ops;
+static unsigned int journal_id;
+static int journal_sock = -1;
+static gboolean journal_offline;	/* Main loop only */
+
+static void data_journal(struct trust *trust);
+
+/* Start of a proto_ops call, 'op' as reported by proto_stats() */
+static gint64 proto_begin(const char *op)
+{
+	TRACE1(proto_begin, op);
+
+	return g_get_monotonic_time();
+}
+
+/* Cloud latency and failures, per proto_ops operation */
+static void proto_stats(const char *op, gint64 start, int err)
 {
-	struct config *cfg = mem;
+	char labels[32];
+
+	TRACE3(proto_end, op, g_get_monotonic_time() - start, err);
+
+	snprintf(labels, sizeof(labels), "op=\"%s\"", op);
+
+	stats_observe("knotd_proto_duration_seconds", labels, start);
+	if (err < 0)
+		stats_add("knotd_proto_errors_total", labels, 1);
+}
 
-	g_free(cfg->hash);
-	g_free(cfg);
+static const char *msg_name(uint8_t type)
+{
+	switch (type) {
+	case KNOT_MSG_REGISTER_REQ:
+		return "register";
+	case KNOT_MSG_UNREGISTER_REQ:
+		return "unregister";
+	case KNOT_MSG_DATA:
+		return "data";
+	case KNOT_MSG_AUTH_REQ:
+		return "auth";
+	case KNOT_MSG_SCHEMA:
+		return "schema";
+	case KNOT_MSG_SCHEMA_END:
+		return "schema_end";
+	case KNOT_MSG_CONFIG_RESP:
+		return "config_resp";
+	case KNOT_MSG_DATA_RESP:
+		return "data_resp";
+	default:
+		return "unknown";
+	}
 }
 
 static void trust_free(struct trust *trust)
 {
-	g_free(trust->uuid);
-	g_free(trust->token);
-	g_slist_free_full(trust->schema, g_free);
-	g_slist_free_full(trust->schema_tmp, g_free);
-	g_slist_free_full(trust->config, config_free);
-	g_free(trust);
+	/*
+	 * No cloud round trip on teardown: buffered readings are uploaded
+	 * by the journal drain. Pending acknowledgements are dropped, the
+	 * cloud pushes set_data and get_data again.
+	 */
+	data_journal(trust);
+
+	if (trust->ack_id)
+		worker_source_remove(trust->context, trust->ack_id);
+
+	if (trust->revalidate_id)
+		worker_source_remove(trust->context, trust->revalidate_id);
+
+	if (trust->hup_id)
+		worker_source_remove(trust->context, trust->hup_id);
+
+	/* Cloud changes are not delivered to a removed trust */
+	if (trust->proto_watch)
+		worker_source_remove(trust->context,
+					trust->proto_watch->hup_id);
+
+	if (trust->schema_id)
+		worker_source_remove(trust->context, trust->schema_id);
+
+	if (trust->jbuf)
+		g_string_free(trust->jbuf, TRUE);
+
+	sensor_table_free(trust->schema);
+	sensor_table_free(trust->schema_tmp);
+	sensor_table_free(trust->config);
+	sensor_table_free(trust->config_tmp);
+	g_slice_free(struct trust, trust);
+}
+
+static struct trust *trust_get(int sock)
+{
+	struct trust *trust;
+
+	/* NULL after msg_stop(): canceled cloud requests may complete */
+	G_LOCK(trust_list);
+	trust = trust_list ? g_hash_table_lookup(trust_list,
+					GINT_TO_POINTER(sock)) : NULL;
+	G_UNLOCK(trust_list);
+
+	return trust;
+}
+
+/* Released out of the lock: trust_free() may reach the cloud */
+static void trust_remove(int sock)
+{
+	struct trust *trust;
+
+	G_LOCK(trust_list);
+	trust = g_hash_table_lookup(trust_list, GINT_TO_POINTER(sock));
+	if (trust)
+		g_hash_table_steal(trust_list, GINT_TO_POINTER(sock));
+	G_UNLOCK(trust_list);
+
+	if (trust)
+		trust_free(trust);
+}
+
+static void trust_set(int sock, struct trust *trust)
+{
+	trust_remove(sock);
+
+	trust->sock = sock;
+	trust->context = worker_current();
+
+	G_LOCK(trust_list);
+	g_hash_table_insert(trust_list, GINT_TO_POINTER(sock), trust);
+	G_UNLOCK(trust_list);
 }
 
 static gboolean node_hup_cb(GIOChannel *io, GIOCondition cond,
@@ -96,7 +285,7 @@ static gboolean node_hup_cb(GIOChannel *io, GIOCondition cond,
 {
 	int sock = g_io_channel_unix_get_fd(io);
 
-	g_hash_table_remove(trust_list, GINT_TO_POINTER(sock));
+	trust_remove(sock);
 
 	return FALSE;
 }
@@ -105,30 +294,51 @@ static gboolean proto_hup_cb(GIOChannel *io, GIOCondition cond,
 							gpointer user_data)
 {
 	struct proto_watch *proto_watch = user_data;
+	struct trust *trust;
 
-	if (proto_watch->id > 0)
-		g_source_remove(proto_watch->id);
-	g_io_channel_unref(proto_watch->node_io);
-	g_free(proto_watch);
+	trust = trust_get(g_io_channel_unix_get_fd(proto_watch->node_io));
+	if (trust && trust->proto_watch == proto_watch)
+		trust->proto_watch = NULL;
 
 	return FALSE;
 }
 
-static int sensor_id_cmp(gconstpointer a, gconstpointer b)
+/* Destroy notify of the cloud HUP watch: releases the cloud watch */
+static void proto_watch_free(gpointer user_data)
 {
-	const knot_msg_schema *schema = a;
-	unsigned int sensor_id = GPOINTER_TO_UINT(b);
+	struct proto_watch *proto_watch = user_data;
 
-	return sensor_id - schema->sensor_id;
+	if (proto_watch->id > 0 && proto_watch->proto_ops->unwatch)
+		proto_watch->proto_ops->unwatch(proto_watch->id);
+	else if (proto_watch->id > 0)
+		g_source_remove(proto_watch->id);
+	g_io_channel_unref(proto_watch->node_io);
+	g_slice_free(struct proto_watch, proto_watch);
 }
 
-static char *checksum_config(json_object *jobjkey)
+/*
+ * FNV-1a of the sensor id and values as sent to the thing: JSON key order
+ * or number formatting changes in the cloud are not config changes.
+ */
+static uint32_t config_fingerprint(const knot_msg_config *kmcfg)
 {
-	const char *c;
+	const uint8_t *octet = &kmcfg->sensor_id;
+	size_t len = sizeof(kmcfg->sensor_id) + sizeof(kmcfg->values);
+	uint32_t hash = 2166136261U;
+
+	while (len--) {
+		hash ^= *octet++;
+		hash *= 16777619U;
+	}
 
-	c = json_object_to_json_string(jobjkey);
+	return hash;
+}
 
-	return g_compute_checksum_for_string(G_CHECKSUM_SHA1, c, strlen(c));
+static gboolean config_equal(const struct config *a, const struct config *b)
+{
+	return a->fingerprint == b->fingerprint &&
+		memcmp(&a->kmcfg.values, &b->kmcfg.values,
+					sizeof(a->kmcfg.values)) == 0;
 }
 
 /*
@@ -138,15 +348,15 @@ static char *checksum_config(json_object *jobjkey)
  * No need to check if sensor_id,event_flags and time_sec are positive for
  * they are unsigned from protocol.
  */
-static int config_is_valid(GSList *config_list)
+static int config_is_valid(const struct sensor_table *config_table)
 {
 	knot_msg_config *config;
 	struct config *cfg;
-	GSList *list;
+	guint i;
 	int diff_int, diff_dec;
 
-	for (list = config_list; list; list = g_slist_next(list)) {
-		cfg = list->data;
+	for (i = 0; i < sensor_table_length(config_table); i++) {
+		cfg = sensor_table_index(config_table, i);
 		config = &cfg->kmcfg;
 
 		/* Check if event_flags are valid */
@@ -245,11 +455,26 @@ static void parse_json_value_types(json_object *jobj, knot_value_types *limit)
 	}
 }
 
-static int parse_device_info(const char *json_str,
-					char **puuid, char **ptoken)
+/*
+ * Returns a reference to the device object of 'json': the parsed document
+ * if the driver provides one, otherwise 'data' is parsed.
+ */
+static json_object *json_raw_parse(const json_raw_t *json)
+{
+	if (json->jobj)
+		return json_object_get(json->jobj);
+
+	if (!json->data)
+		return NULL;
+
+	return json_tokener_parse(json->data);
+}
+
+/* 'uuid' and 'token' must have room for the protocol lengths plus nul */
+static int parse_device_info(const char *json_str, char *uuid, char *token)
 {
 	json_object *jobj, *json_uuid, *json_token;
-	const char *uuid, *token;
+	const char *juuid, *jtoken;
 	int err = -EINVAL;
 
 	jobj = json_tokener_parse(json_str);
@@ -262,11 +487,20 @@ static int parse_device_info(const char *json_str,
 	if (!json_object_object_get_ex(jobj, "token", &json_token))
 		goto done;
 
-	uuid = json_object_get_string(json_uuid);
-	token = json_object_get_string(json_token);
+	juuid = json_object_get_string(json_uuid);
+	jtoken = json_object_get_string(json_token);
+
+	if (juuid == NULL || jtoken == NULL)
+		goto done;
+
+	if (strlen(juuid) != KNOT_PROTOCOL_UUID_LEN ||
+				strlen(jtoken) != KNOT_PROTOCOL_TOKEN_LEN) {
+		log_error("Invalid UUID or token!");
+		goto done;
+	}
 
-	*puuid = g_strdup(uuid);
-	*ptoken = g_strdup(token);
+	strcpy(uuid, juuid);
+	strcpy(token, jtoken);
 
 	err = 0; /* Success */
 done:
@@ -275,18 +509,36 @@ done:
 	return err;
 }
 
-static GSList *parse_device_schema(const char *json_str)
+/*
+ * Sensor tables and KNoT messages use 8-bit ids: larger cloud values are
+ * rejected instead of being truncated to another sensor.
+ */
+static int parse_sensor_id(json_object *jobjentry)
 {
-	json_object *jobj, *jobjarray, *jobjentry, *jobjkey;
-	GSList *list = NULL;
-	knot_msg_schema *entry;
+	json_object *jobjkey;
+	int sensor_id;
+
+	if (!json_object_object_get_ex(jobjentry, "sensor_id", &jobjkey))
+		return -EINVAL;
+
+	if (json_object_get_type(jobjkey) != json_type_int)
+		return -EINVAL;
+
+	sensor_id = json_object_get_int(jobjkey);
+	if (sensor_id < 0 || sensor_id > UINT8_MAX)
+		return -ERANGE;
+
+	return sensor_id;
+}
+
+static struct sensor_table *parse_device_schema(json_object *jobj)
+{
+	json_object *jobjarray, *jobjentry, *jobjkey;
+	struct sensor_table *table = NULL;
+	knot_msg_schema entry;
 	int sensor_id, value_type, unit, type_id, i;
 	const char *name;
 
-	jobj = json_tokener_parse(json_str);
-	if (!jobj)
-		return NULL;
-
 	/* Expected JSON object is in the following format:
 	 *
 	 * {"uuid": ...
@@ -308,15 +560,10 @@ static GSList *parse_device_schema(const char *json_str)
 		jobjentry = json_object_array_get_idx(jobjarray, i);
 
 		/* Getting 'sensor_id' */
-		if (!json_object_object_get_ex(jobjentry, "sensor_id",
-								&jobjkey))
-			goto done;
-
-		if (json_object_get_type(jobjkey) != json_type_int)
+		sensor_id = parse_sensor_id(jobjentry);
+		if (sensor_id < 0)
 			goto done;
 
-		sensor_id = json_object_get_int(jobjkey);
-
 		/* Getting 'value_type' */
 		if (!json_object_object_get_ex(jobjentry, "value_type",
 								&jobjkey))
@@ -357,20 +604,21 @@ static GSList *parse_device_schema(const char *json_str)
 		 * Validation not required: validation has been performed
 		 * previously when schema has been submitted to the cloud.
 		 */
-		entry = g_new0(knot_msg_schema, 1);
-		entry->sensor_id = sensor_id;
-		entry->values.value_type = value_type;
-		entry->values.unit = unit;
-		entry->values.type_id = type_id;
-		strncpy(entry->values.name, name,
-						sizeof(entry->values.name) - 1);
-
-		list = g_slist_append(list, entry);
+		memset(&entry, 0, sizeof(entry));
+		entry.sensor_id = sensor_id;
+		entry.values.value_type = value_type;
+		entry.values.unit = unit;
+		entry.values.type_id = type_id;
+		strncpy(entry.values.name, name,
+						sizeof(entry.values.name) - 1);
+
+		if (!table)
+			table = sensor_table_new(sizeof(entry), NULL);
+
+		sensor_table_insert(table, entry.sensor_id, &entry);
 	}
 done:
-	json_object_put(jobj);
-
-	return list;
+	return table;
 }
 
 /*
@@ -379,19 +627,15 @@ done:
  * The mandatory fields "sensor_id" and "event_flags" are missing.
  * Any field that is sent has the wrong type.
  */
-static GSList *parse_device_config(const char *json_str)
+static struct sensor_table *parse_device_config(json_object *jobj)
 {
-	json_object *jobj, *jobjarray, *jobjentry, *jobjkey;
-	GSList *list = NULL;
-	struct config *entry;
+	json_object *jobjarray, *jobjentry, *jobjkey;
+	struct sensor_table *table = NULL;
+	struct config entry;
 	int sensor_id, event_flags, time_sec, i;
 	knot_value_types lower_limit, upper_limit;
 	json_type jtype;
 
-	jobj = json_tokener_parse(json_str);
-	if (!jobj)
-		return NULL;
-
 	/* Getting 'config' from the device properties:
 	 *
 	 * {"uuid": ...
@@ -416,15 +660,10 @@ static GSList *parse_device_config(const char *json_str)
 			goto done;
 
 		/* Getting 'sensor_id' */
-		if (!json_object_object_get_ex(jobjentry, "sensor_id",
-								&jobjkey))
-			goto done;
-
-		if (json_object_get_type(jobjkey) != json_type_int)
+		sensor_id = parse_sensor_id(jobjentry);
+		if (sensor_id < 0)
 			goto done;
 
-		sensor_id = json_object_get_int(jobjkey);
-
 		/* Getting 'event_flags' */
 		if (!json_object_object_get_ex(jobjentry, "event_flags",
 								&jobjkey))
@@ -475,27 +714,27 @@ static GSList *parse_device_config(const char *json_str)
 						&upper_limit);
 		}
 
-		entry = g_new0(struct config, 1);
-		entry->kmcfg.sensor_id = sensor_id;
-		entry->kmcfg.values.event_flags = event_flags;
-		entry->kmcfg.values.time_sec = time_sec;
-		memcpy(&(entry->kmcfg.values.lower_limit), &lower_limit,
+		memset(&entry, 0, sizeof(entry));
+		entry.kmcfg.sensor_id = sensor_id;
+		entry.kmcfg.values.event_flags = event_flags;
+		entry.kmcfg.values.time_sec = time_sec;
+		memcpy(&(entry.kmcfg.values.lower_limit), &lower_limit,
 						sizeof(knot_value_types));
-		memcpy(&(entry->kmcfg.values.upper_limit), &upper_limit,
+		memcpy(&(entry.kmcfg.values.upper_limit), &upper_limit,
 						sizeof(knot_value_types));
-		entry->hash = checksum_config(jobjentry);
-		entry->confirmed = FALSE;
-		list = g_slist_append(list, entry);
-	}
+		entry.fingerprint = config_fingerprint(&entry.kmcfg);
+		entry.confirmed = FALSE;
 
-	json_object_put(jobj);
+		if (!table)
+			table = sensor_table_new(sizeof(entry), NULL);
 
-	return list;
+		sensor_table_insert(table, entry.kmcfg.sensor_id, &entry);
+	}
 
-done:
-	g_slist_free_full(list, config_free);
-	json_object_put(jobj);
+	return table;
 
+done:
+	sensor_table_free(table);
 	return NULL;
 }
 
@@ -506,19 +745,15 @@ done:
  * When/if the user updates the data, the field is erased and the data is sent
  * again, regardless if the value is the same or not.
  */
-static GSList *parse_device_setdata(const char *json_str)
+static GSList *parse_device_setdata(json_object *jobj)
 {
-	json_object *jobj, *jobjarray, *jobjentry, *jobjkey;
+	json_object *jobjarray, *jobjentry, *jobjkey;
 	GSList *list = NULL;
 	knot_msg_data *entry;
 	int sensor_id, i;
 	knot_data data;
 	json_type jtype;
 
-	jobj = json_tokener_parse(json_str);
-	if (!jobj)
-		return NULL;
-
 	/*
 	 * Getting 'set_data' from the device properties:
 	 * {"uuid":
@@ -542,15 +777,10 @@ static GSList *parse_device_setdata(const char *json_str)
 			goto done;
 
 		/* Getting 'sensor_id' */
-		if (!json_object_object_get_ex(jobjentry, "sensor_id",
-								&jobjkey))
-			goto done;
-
-		if (json_object_get_type(jobjkey) != json_type_int)
+		sensor_id = parse_sensor_id(jobjentry);
+		if (sensor_id < 0)
 			goto done;
 
-		sensor_id = json_object_get_int(jobjkey);
-
 		/* Getting 'value' */
 		memset(&data, 0, sizeof(knot_data));
 		if (json_object_object_get_ex(jobjentry, "value",
@@ -570,31 +800,23 @@ static GSList *parse_device_setdata(const char *json_str)
 		memcpy(&(entry->payload), &data, sizeof(knot_data));
 		list = g_slist_append(list, entry);
 	}
-	json_object_put(jobj);
-
 	return list;
 
 done:
 	g_slist_free_full(list, g_free);
-	json_object_put(jobj);
-
 	return NULL;
 }
 
 /*
  * Parses the json from the cloud with the get_data.
  */
-static GSList *parse_device_getdata(const char *json_str)
+static GSList *parse_device_getdata(json_object *jobj)
 {
-	json_object *jobj, *jobjarray, *jobjentry, *jobjkey;
+	json_object *jobjarray, *jobjentry;
 	GSList *list = NULL;
 	knot_msg_item *entry;
 	int sensor_id, i;
 
-	jobj = json_tokener_parse(json_str);
-	if (!jobj)
-		return NULL;
-
 	/*
 	 * Getting 'get_data' from the device properties
 	 * {"devices":[{"uuid":
@@ -618,27 +840,18 @@ static GSList *parse_device_getdata(const char *json_str)
 			goto done;
 
 		/* Getting 'sensor_id' */
-		if (!json_object_object_get_ex(jobjentry, "sensor_id",
-								&jobjkey))
+		sensor_id = parse_sensor_id(jobjentry);
+		if (sensor_id < 0)
 			goto done;
 
-		if (json_object_get_type(jobjkey) != json_type_int)
-			goto done;
-
-		sensor_id = json_object_get_int(jobjkey);
-
 		entry = g_new0(knot_msg_item, 1);
 		entry->sensor_id = sensor_id;
 		list = g_slist_append(list, entry);
 	}
-	json_object_put(jobj);
-
 	return list;
 
 done:
 	g_slist_free_full(list, g_free);
-	json_object_put(jobj);
-
 	return NULL;
 }
 
@@ -647,11 +860,12 @@ static int8_t msg_unregister(int sock, int proto_sock,
 					const knot_msg_unregister *kreq)
 {
 	const struct trust *trust;
-	json_raw_t jbuf = { NULL, 0 };
+	json_raw_t jbuf = { NULL, 0, NULL };
 	int8_t result;
 	int err;
+	gint64 start;
 
-	trust = g_hash_table_lookup(trust_list, GINT_TO_POINTER(sock));
+	trust = trust_get(sock);
 	if (!trust) {
 		log_info("Permission denied!");
 		return KNOT_CREDENTIAL_UNAUTHORIZED;
@@ -666,13 +880,17 @@ static int8_t msg_unregister(int sock, int proto_sock,
 
 	log_info("rmnode: %.36s", trust->uuid);
 
+	start = proto_begin("rmnode");
 	err = proto_ops->rmnode(proto_sock, trust->uuid, trust->token, &jbuf);
+	proto_stats("rmnode", start, err);
 	if (err < 0) {
 		result = KNOT_CLOUD_FAILURE;
 		log_error("rmnode() failed %s (%d)", strerror(-err), -err);
 		goto done;
 	}
 
+	cache_remove(trust->uuid);
+
 	result = KNOT_SUCCESS;
 
 done:
@@ -686,14 +904,14 @@ done:
  * Includes the proper header in the getdata messages and returns a list with
  * all the sensor from which the data is requested.
  */
-static GSList *msg_getdata(int sock, json_raw_t json, ssize_t *result)
+static GSList *msg_getdata(int sock, json_object *jobj, ssize_t *result)
 {
 	struct trust *trust;
 	GSList *list;
 	GSList *tmp;
 	knot_msg_item *kmitem;
 
-	trust = g_hash_table_lookup(trust_list, GINT_TO_POINTER(sock));
+	trust = trust_get(sock);
 	if (!trust) {
 		log_info("Permission denied!");
 		*result = KNOT_CREDENTIAL_UNAUTHORIZED;
@@ -701,7 +919,7 @@ static GSList *msg_getdata(int sock, json_raw_t json, ssize_t *result)
 	}
 	*result = KNOT_SUCCESS;
 
-	list = parse_device_getdata(json.data);
+	list = parse_device_getdata(jobj);
 
 	for (tmp = list; tmp; tmp = g_slist_next(tmp)) {
 		kmitem = tmp->data;
@@ -716,14 +934,14 @@ static GSList *msg_getdata(int sock, json_raw_t json, ssize_t *result)
  * Includes the proper header in the setdata messages and returns a list with
  * all the sensor data that will be sent to the thing.
  */
-static GSList *msg_setdata(int sock, json_raw_t json, ssize_t *result)
+static GSList *msg_setdata(int sock, json_object *jobj, ssize_t *result)
 {
 	struct trust *trust;
 	GSList *list;
 	GSList *tmp;
 	knot_msg_data *kmdata;
 
-	trust = g_hash_table_lookup(trust_list, GINT_TO_POINTER(sock));
+	trust = trust_get(sock);
 	if (!trust) {
 		log_info("Permission denied!");
 		*result = KNOT_CREDENTIAL_UNAUTHORIZED;
@@ -731,7 +949,7 @@ static GSList *msg_setdata(int sock, json_raw_t json, ssize_t *result)
 	}
 	*result = KNOT_SUCCESS;
 
-	list = parse_device_setdata(json.data);
+	list = parse_device_setdata(jobj);
 
 	for (tmp = list; tmp; tmp = g_slist_next(tmp)) {
 		kmdata = tmp->data;
@@ -750,41 +968,24 @@ static GSList *msg_setdata(int sock, json_raw_t json, ssize_t *result)
  * configs that were received by the cloud. If nothing was received from the
  * cloud, returns NULL.
  */
-static GSList *get_changed_config(GSList *current, GSList *received)
+static GSList *get_changed_config(const struct sensor_table *current,
+					struct sensor_table *received)
 {
-	GSList *cur;
-	GSList *rec = received;
 	struct config *rcfg;
 	struct config *ccfg;
 	knot_msg_config *kmsg;
 	GSList *list = NULL;
-	gboolean match;
-
-	/*If nothing was received from the cloud, returns NULL.*/
-	if (!received)
-		return NULL;
+	guint i;
 
 	/*
-	 * If there is nothing in the current config list, returns all that was
-	 *received from the cloud
+	 * If nothing was received from the cloud, returns NULL. If there is
+	 * nothing in the current config table, returns all that was
+	 * received from the cloud.
 	 */
-	if (!current) {
-		while (rec) {
-			rcfg = rec->data;
-			kmsg = g_new0(knot_msg_config, 1);
-			memcpy(kmsg, &rcfg->kmcfg, sizeof(knot_msg_config));
-			kmsg->hdr.type = KNOT_MSG_SET_CONFIG;
-			kmsg->hdr.payload_len = sizeof(kmsg->sensor_id) +
-							sizeof(kmsg->values);
-			list = g_slist_append(list, kmsg);
-			rec = g_slist_next(rec);
-		}
-		return list;
-	}
 	/*
 	 * Compares the received configs with the ones already stored.
-	 * If the hash matches one in the current list, the config did not
-	 * change.
+	 * If the fingerprint and values match the current ones of the
+	 * sensor, the config did not change.
 	 * If no match was found, then either the config for that sensor changed
 	 * or it is a new sensor.
 	 */
@@ -797,39 +998,24 @@ static GSList *get_changed_config(GSList *current, GSList *received)
 	 * Define which approach is better, the current or when at least one
 	 * config changes, the whole config message should be sent.
 	 */
-	while (rec) {
-		rcfg = rec->data;
-		match = FALSE;
-		for (cur = current; cur; cur = g_slist_next(cur)) {
-			ccfg = cur->data;
-			if (!strcmp(ccfg->hash, rcfg->hash)) {
-				match = TRUE;
-				rcfg->confirmed = ccfg->confirmed;
-				if (!rcfg->confirmed) {
-					kmsg = g_new0(knot_msg_config, 1);
-					memcpy(kmsg, &rcfg->kmcfg,
-						sizeof(knot_msg_config));
-					kmsg->hdr.type = KNOT_MSG_SET_CONFIG;
-					kmsg->hdr.payload_len =
-						sizeof(kmsg->sensor_id) +
-						sizeof(kmsg->values);
-					list = g_slist_append(list, kmsg);
-				}
-				break;
-			}
-		}
-		if (!match) {
-			kmsg = g_new0(knot_msg_config, 1);
-			memcpy(kmsg, &rcfg->kmcfg, sizeof(knot_msg_config));
-			kmsg->hdr.type = KNOT_MSG_SET_CONFIG;
-			kmsg->hdr.payload_len = sizeof(kmsg->sensor_id) +
-							sizeof(kmsg->values);
-			list = g_slist_append(list, kmsg);
+	for (i = 0; i < sensor_table_length(received); i++) {
+		rcfg = sensor_table_index(received, i);
+		ccfg = sensor_table_lookup(current, rcfg->kmcfg.sensor_id);
+		if (ccfg && config_equal(ccfg, rcfg)) {
+			rcfg->confirmed = ccfg->confirmed;
+			if (rcfg->confirmed)
+				continue;
 		}
-		rec = g_slist_next(rec);
+
+		kmsg = g_new0(knot_msg_config, 1);
+		memcpy(kmsg, &rcfg->kmcfg, sizeof(knot_msg_config));
+		kmsg->hdr.type = KNOT_MSG_SET_CONFIG;
+		kmsg->hdr.payload_len = sizeof(kmsg->sensor_id) +
+						sizeof(kmsg->values);
+		list = g_slist_prepend(list, kmsg);
 	}
 
-	return list;
+	return g_slist_reverse(list);
 }
 
 /*
@@ -837,24 +1023,24 @@ static GSList *get_changed_config(GSList *current, GSList *received)
  * checks if any changed, and put them in the list that  will be sent to the
  * thing. Returns the list with the messages to be sent or  NULL if any error.
  */
-static GSList *msg_config(int sock, json_raw_t json, ssize_t *result)
+static GSList *msg_config(int sock, json_object *jobj, ssize_t *result)
 {
 	struct trust *trust;
 	GSList *list;
 
-	trust = g_hash_table_lookup(trust_list, GINT_TO_POINTER(sock));
+	trust = trust_get(sock);
 	if (!trust) {
 		log_info("Permission denied!");
 		*result = KNOT_CREDENTIAL_UNAUTHORIZED;
 		return NULL;
 	}
 
-	trust->config_tmp = parse_device_config(json.data);
+	trust->config_tmp = parse_device_config(jobj);
 
 	/* config_is_valid() returns 0 if SUCCESS */
 	if (config_is_valid(trust->config_tmp)) {
 		log_error("Invalid config message");
-		g_slist_free_full(trust->config_tmp, config_free);
+		sensor_table_free(trust->config_tmp);
 		trust->config_tmp = NULL;
 		/*
 		 * TODO: DEFINE KNOT_CONFIG ERRORS IN PROTOCOL
@@ -865,7 +1051,7 @@ static GSList *msg_config(int sock, json_raw_t json, ssize_t *result)
 	}
 
 	list = get_changed_config(trust->config, trust->config_tmp);
-	g_slist_free_full(trust->config, config_free);
+	sensor_table_free(trust->config);
 	trust->config = trust->config_tmp;
 	trust->config_tmp = NULL;
 
@@ -876,24 +1062,161 @@ static GSList *msg_config(int sock, json_raw_t json, ssize_t *result)
 
 /*
  * Sends the messages to the THING. Expects a response from the gateway
- * acknowledging that the message was successfully received.
+ * acknowledging that the message was successfully received. Node sockets
+ * keep the PDU boundaries: up to PUSH_BATCH PDUs per system call.
  */
-static int fw_push(int sock, knot_msg *kmsg)
+static int fw_push(int sock, GSList *list)
 {
-	ssize_t nbytes;
-	int err;
+	struct mmsghdr msgs[PUSH_BATCH];
+	struct iovec iov[PUSH_BATCH];
+	const knot_msg *kmsg;
+	unsigned int i, n;
+	int ret, err;
+
+	TRACE2(fw_push, sock, g_slist_length(list));
+
+	while (list) {
+		memset(msgs, 0, sizeof(msgs));
+		for (n = 0; list && n < PUSH_BATCH; n++) {
+			kmsg = list->data;
+			iov[n].iov_base = (void *) kmsg->buffer;
+			iov[n].iov_len = sizeof(kmsg->hdr) +
+						kmsg->hdr.payload_len;
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			list = g_slist_next(list);
+		}
 
-	nbytes = write(sock, kmsg->buffer, kmsg->hdr.payload_len +
-							sizeof(kmsg->hdr));
-	if (nbytes < 0) {
-		err = errno;
-		log_error("node_ops: %s(%d)", strerror(err), err);
-		return -err;
+		/* Partial sends are resumed with the remaining PDUs */
+		for (i = 0; i < n; i += ret) {
+			ret = sendmmsg(sock, &msgs[i], n - i, 0);
+			if (ret <= 0) {
+				err = ret < 0 ? errno : EIO;
+				log_error_rl("node_ops: %s(%d)",
+							strerror(err), err);
+				return -err;
+			}
+		}
 	}
 
 	return 0;
 }
 
+/* Only the fields read by msg_auth() are cached */
+static void trust_cache(const struct trust *trust, json_object *jobj)
+{
+	json_object *jdoc, *jschema, *jconfig;
+	int err;
+
+	/* Partial documents, like websocket config events, are skipped */
+	if (!json_object_object_get_ex(jobj, "schema", &jschema))
+		return;
+
+	jdoc = json_object_new_object();
+	json_object_object_add(jdoc, "schema", json_object_get(jschema));
+	if (json_object_object_get_ex(jobj, "config", &jconfig))
+		json_object_object_add(jdoc, "config",
+						json_object_get(jconfig));
+
+	err = cache_store(trust->uuid, trust->token,
+					json_object_to_json_string(jdoc));
+	if (err < 0)
+		log_error("cache %.36s: %s(%d)", trust->uuid,
+						strerror(-err), -err);
+
+	json_object_put(jdoc);
+}
+
+static int trust_load(struct trust *trust)
+{
+	json_object *jobj;
+	char *doc;
+
+	doc = cache_lookup(trust->uuid, trust->token);
+	if (doc == NULL)
+		return -ENOENT;
+
+	jobj = json_tokener_parse(doc);
+	g_free(doc);
+
+	if (jobj == NULL)
+		return -EINVAL;
+
+	trust->schema = parse_device_schema(jobj);
+	trust->config_tmp = parse_device_config(jobj);
+	json_object_put(jobj);
+
+	return 0;
+}
+
+/*
+ * Cloud check of a trust authenticated from the cache, run by the worker
+ * of the session out of the PDU path. Retried with backoff while the
+ * cloud is unreachable.
+ */
+static gboolean trust_revalidate(gpointer user_data)
+{
+	int sock = GPOINTER_TO_INT(user_data);
+	struct trust *trust;
+	json_object *jobj;
+	json_raw_t json;
+	int err;
+	gint64 start;
+
+	trust = trust_get(sock);
+	if (trust == NULL)
+		return FALSE;
+
+	/* Session offline: refreshed by data_push() once reconnected */
+	if (trust->proto_sock < 0)
+		return TRUE;
+
+	trust->revalidate_id = 0;
+
+	memset(&json, 0, sizeof(json));
+	start = proto_begin("signin");
+	err = trust->proto_ops->signin(trust->proto_sock, trust->uuid,
+						trust->token, &json);
+	proto_stats("signin", start, err);
+
+	/* Cloud unreachable: keep trusting the cache meanwhile */
+	if (!json.data) {
+		trust->revalidate_delay = MIN(trust->revalidate_delay * 2,
+							CACHE_REVALIDATE_MAX);
+		log_error_rl("revalidate %.36s: %s(%d), retry in %us",
+				trust->uuid, strerror(-err), -err,
+				trust->revalidate_delay / 1000);
+		trust->revalidate_id = worker_timeout_add(trust->context,
+				trust->revalidate_delay, trust_revalidate,
+				GINT_TO_POINTER(sock));
+		return FALSE;
+	}
+
+	jobj = json_raw_parse(&json);
+	free(json.data);
+
+	if (err < 0) {
+		log_error("%.36s: credentials rejected by cloud", trust->uuid);
+		if (jobj)
+			json_object_put(jobj);
+
+		/*
+		 * Next requests of the thing are refused until a new auth.
+		 * Its watches are removed along with the trust.
+		 */
+		cache_remove(trust->uuid);
+		trust_remove(sock);
+		return FALSE;
+	}
+
+	if (jobj) {
+		trust_cache(trust, jobj);
+		json_object_put(jobj);
+	}
+
+	return FALSE;
+}
+
 /*
  * Callback that parses the JSON for config (and in the future, send data)
  * messages. It is called from the protocol that is used to communicate with
@@ -902,49 +1225,90 @@ static int fw_push(int sock, knot_msg *kmsg)
 static void proto_watch_cb(json_raw_t json, void *user_data)
 {
 	const struct proto_watch *watch = user_data;
+	const struct trust *trust;
+	json_object *jobj;
 	int sock;
 	ssize_t result;
 	GSList *list;
-	GSList *tmp;
+
+	/* Decoded once: config, set_data and get_data share the object */
+	jobj = json_raw_parse(&json);
+	if (!jobj)
+		return;
 
 	sock = g_io_channel_unix_get_fd(watch->node_io);
 
-	list = msg_config(sock, json, &result);
-	list = g_slist_concat(list, msg_setdata(sock, json, &result));
-	list = g_slist_concat(list, msg_getdata(sock, json, &result));
+	/* Keeps the cached config up to date */
+	trust = trust_get(sock);
+	if (trust)
+		trust_cache(trust, jobj);
 
-	tmp = list;
-	while (tmp) {
-		result = fw_push(sock, tmp->data);
-		if (result)
-			log_error("KNOT SEND ERROR");
-		tmp = g_slist_next(tmp);
-	}
+	list = msg_config(sock, jobj, &result);
+	list = g_slist_concat(list, msg_setdata(sock, jobj, &result));
+	list = g_slist_concat(list, msg_getdata(sock, jobj, &result));
+
+	json_object_put(jobj);
+
+	if (fw_push(sock, list) < 0)
+		log_error_rl("KNOT SEND ERROR");
 	g_slist_free_full(list, g_free);
 }
 
-static int8_t msg_register(int sock, int proto_sock,
-					const struct proto_ops *proto_ops,
-					const knot_msg_register *kreq,
-					knot_msg_credential *krsp)
+/*
+ * Removes the credential when the thing disconnects, and watches the cloud
+ * for config, set_data and get_data changes until the cloud session hangs
+ * up. Offline: cloud changes are watched from the next authentication.
+ */
+static void trust_watch(struct trust *trust, int sock, int proto_sock,
+					const struct proto_ops *proto_ops)
 {
+	struct proto_watch *proto_watch;
 	GIOChannel *io, *proto_io;
+
+	io = g_io_channel_unix_new(sock);
+	trust->hup_id = worker_io_add_watch(trust->context, io, G_IO_HUP |
+				G_IO_NVAL | G_IO_ERR, node_hup_cb, NULL, NULL);
+
+	if (proto_sock < 0) {
+		g_io_channel_unref(io);
+		return;
+	}
+
+	/* The node channel reference is moved to the watch */
+	proto_watch = g_slice_new0(struct proto_watch);
+	proto_watch->proto_ops = proto_ops;
+	proto_watch->id = proto_ops->async(proto_sock, trust->uuid,
+				trust->token, proto_watch_cb, proto_watch);
+	proto_watch->node_io = io;
+
+	proto_io = g_io_channel_unix_new(proto_sock);
+	proto_watch->hup_id = worker_io_add_watch(trust->context, proto_io,
+				G_IO_HUP | G_IO_NVAL | G_IO_ERR, proto_hup_cb,
+				proto_watch, proto_watch_free);
+	g_io_channel_unref(proto_io);
+
+	trust->proto_watch = proto_watch;
+}
+
+static int8_t msg_register(int sock, int proto_sock,
+					const struct proto_ops *proto_ops,
+					const knot_msg_register *kreq,
+					knot_msg_credential *krsp)
+{
 	struct trust *trust;
 	json_object *jobj;
 	const char *jobjstring;
-	char *uuid, *token;
 	json_raw_t json;
 	int err, len;
-	int8_t result;
 	char thing_name[KNOT_PROTOCOL_DEVICE_NAME_LEN];
-	struct proto_watch *proto_watch;
+	gint64 start;
 
 	/*
 	 * Due to radio packet loss the thing retransmits register requests if a
 	 * response does not arrives in 20 seconds, if this device was
 	 * previously added we just send the uuid/token again.
 	 */
-	trust = g_hash_table_lookup(trust_list, GINT_TO_POINTER(sock));
+	trust = trust_get(sock);
 	if (trust) {
 		strcpy(krsp->uuid, trust->uuid);
 		strcpy(krsp->token, trust->token);
@@ -978,13 +1342,19 @@ static int8_t msg_register(int sock, int proto_sock,
 				json_object_new_string("KNOTDevice"));
 	json_object_object_add(jobj, "name",
 				json_object_new_string(thing_name));
+	G_LOCK(msg_settings);
 	json_object_object_add(jobj, "owner",
 				json_object_new_string(owner_uuid));
+	G_UNLOCK(msg_settings);
 
-	jobjstring = json_object_to_json_string(jobj);
+	/* Cloud payloads without the json-c default spacing */
+	jobjstring = json_object_to_json_string_ext(jobj,
+						JSON_C_TO_STRING_PLAIN);
 
 	memset(&json, 0, sizeof(json));
+	start = proto_begin("mknode");
 	err = proto_ops->mknode(proto_sock, jobjstring, &json);
+	proto_stats("mknode", start, err);
 
 	json_object_put(jobj);
 
@@ -994,26 +1364,26 @@ static int8_t msg_register(int sock, int proto_sock,
 		return KNOT_CLOUD_FAILURE;
 	}
 
-	if (parse_device_info(json.data, &uuid, &token) < 0) {
+	trust = g_slice_new0(struct trust);
+
+	if (parse_device_info(json.data, trust->uuid, trust->token) < 0) {
 		log_error("Unexpected response!");
 		free(json.data);
+		trust_free(trust);
 		return KNOT_CLOUD_FAILURE;
 	}
 
-	log_info("UUID: %s, TOKEN: %s", uuid, token);
+	free(json.data);
 
-	/* Parse function never returns NULL for 'uuid' or 'token' fields */
-	if (strlen(uuid) != KNOT_PROTOCOL_UUID_LEN ||
-				strlen(token) != KNOT_PROTOCOL_TOKEN_LEN) {
-		log_error("Invalid UUID or token!");
-		result = KNOT_CLOUD_FAILURE;
-		goto done;
-	}
+	log_info("UUID: %s, TOKEN: %s", trust->uuid, trust->token);
 
-	strcpy(krsp->uuid, uuid);
-	strcpy(krsp->token, token);
+	strcpy(krsp->uuid, trust->uuid);
+	strcpy(krsp->token, trust->token);
 
-	err = proto_ops->signin(proto_sock, uuid, token, &json);
+	memset(&json, 0, sizeof(json));
+	start = proto_begin("signin");
+	err = proto_ops->signin(proto_sock, trust->uuid, trust->token, &json);
+	proto_stats("signin", start, err);
 
 	if (!json.data) {
 		trust_free(trust);
@@ -1031,124 +1401,153 @@ static int8_t msg_register(int sock, int proto_sock,
 	/* Payload length includes the result, UUID and TOKEN */
 	krsp->hdr.payload_len = sizeof(*krsp) - sizeof(knot_msg_header);
 
-	trust = g_new0(struct trust, 1);
-	trust->uuid = uuid;
-	trust->token = token;
-
-	g_hash_table_replace(trust_list, GINT_TO_POINTER(sock), trust);
-	/* Add a watch to remove the credential when the client disconnects */
-	io = g_io_channel_unix_new(sock);
-	g_io_add_watch(io, G_IO_HUP | G_IO_NVAL | G_IO_ERR, node_hup_cb, NULL);
-	g_io_channel_unref(io);
-
-	proto_watch = g_new0(struct proto_watch, 1);
-	proto_watch->id = proto_ops->async(proto_sock, trust->uuid,
-				trust->token, proto_watch_cb, proto_watch);
-	proto_watch->node_io = g_io_channel_ref(io);
-
-	/* Add a watch to remove source when cloud disconnects */
-	proto_io = g_io_channel_unix_new(proto_sock);
-	g_io_add_watch(proto_io, G_IO_HUP | G_IO_NVAL | G_IO_ERR, proto_hup_cb,
-			proto_watch);
-	g_io_channel_unref(proto_io);
+	trust_set(sock, trust);
+	trust_watch(trust, sock, proto_sock, proto_ops);
 
 	return KNOT_SUCCESS;
-
-done:
-	g_free(uuid);
-	g_free(token);
-
-	return result;
 }
 
 static int8_t msg_auth(int sock, int proto_sock,
 				const struct proto_ops *proto_ops,
 				const knot_msg_authentication *kmauth)
 {
-	GIOChannel *io;
-	GIOChannel *proto_io;
 	json_raw_t json;
+	json_object *jobj;
 	struct trust *trust;
-	struct proto_watch *proto_watch;
+	gboolean cached;
 	int err;
+	gint64 start;
 
-	if (g_hash_table_lookup(trust_list, GINT_TO_POINTER(sock))) {
+	if (trust_get(sock)) {
 		log_info("Authenticated already");
 		return KNOT_SUCCESS;
 	}
 
 	memset(&json, 0, sizeof(json));
-	trust = g_new0(struct trust, 1);
-	/*
-	 * g_strndup returns a newly-allocated buffer n + 1 bytes
-	 * long which will always be nul-terminated.
-	 */
-	trust->uuid = g_strndup(kmauth->uuid, sizeof(kmauth->uuid));
-	trust->token = g_strndup(kmauth->token, sizeof(kmauth->token));
+	trust = g_slice_new0(struct trust);
+	/* Inline arrays have room for the terminating nul */
+	memcpy(trust->uuid, kmauth->uuid, sizeof(kmauth->uuid));
+	memcpy(trust->token, kmauth->token, sizeof(kmauth->token));
+	trust->proto_sock = proto_sock;
+	trust->proto_ops = proto_ops;
+
+	/* Known device: trusted right away, the cloud checks it later */
+	cached = (trust_load(trust) == 0);
+	if (cached) {
+		log_info("%.36s: authenticated from cache", trust->uuid);
+		goto trusted;
+	}
+
+	start = proto_begin("signin");
 	err = proto_ops->signin(proto_sock, trust->uuid, trust->token, &json);
+	proto_stats("signin", start, err);
 
 	if (!json.data) {
 		trust_free(trust);
 		return KNOT_SCHEMA_EMPTY;
 	}
 
-	trust->schema = parse_device_schema(json.data);
-	trust->config_tmp = parse_device_config(json.data);
+	jobj = json_raw_parse(&json);
 
 	free(json.data);
 
 	if (err < 0) {
 		log_error("signin(): %s(%d)", strerror(-err), -err);
+		if (jobj)
+			json_object_put(jobj);
 		trust_free(trust);
 		return KNOT_CREDENTIAL_UNAUTHORIZED;
 	}
 
+	if (jobj) {
+		trust->schema = parse_device_schema(jobj);
+		trust->config_tmp = parse_device_config(jobj);
+		trust_cache(trust, jobj);
+		json_object_put(jobj);
+	}
+
+trusted:
 	if (config_is_valid(trust->config_tmp)) {
 		log_error("Invalid config message");
-		g_slist_free_full(trust->config_tmp, config_free);
+		sensor_table_free(trust->config_tmp);
 		trust->config_tmp = NULL;
 	} else {
 		trust->config = trust->config_tmp;
 		trust->config_tmp = NULL;
 	}
 
-	g_hash_table_insert(trust_list, GINT_TO_POINTER(sock), trust);
+	trust_set(sock, trust);
+	trust_watch(trust, sock, proto_sock, proto_ops);
 
-	/* Add a watch to remove the credential when the client disconnects */
-	io = g_io_channel_unix_new(sock);
-	g_io_add_watch(io, G_IO_HUP | G_IO_NVAL | G_IO_ERR, node_hup_cb, NULL);
-	g_io_channel_unref(io);
+	/* Spread: things reconnect all at once after a gateway restart */
+	trust->revalidate_delay = CACHE_REVALIDATE;
+	if (cached)
+		trust->revalidate_id = worker_timeout_add(trust->context,
+				g_random_int_range(0, CACHE_REVALIDATE),
+				trust_revalidate, GINT_TO_POINTER(sock));
 
+	return KNOT_SUCCESS;
+}
+
+/* The SCHEMA_END fragment was lost: the thing starts over */
+static gboolean schema_timeout(gpointer user_data)
+{
+	struct trust *trust;
 
-	proto_watch = g_new0(struct proto_watch, 1);
-	proto_watch->id = proto_ops->async(proto_sock,
-			trust->uuid, trust->token, proto_watch_cb, proto_watch);
-	proto_watch->node_io = g_io_channel_ref(io);
+	trust = trust_get(GPOINTER_TO_INT(user_data));
+	if (trust == NULL)
+		return FALSE;
 
-	/* Add a watch to remove source when cloud disconnects */
-	proto_io = g_io_channel_unix_new(proto_sock);
-	g_io_add_watch(proto_io, G_IO_HUP | G_IO_NVAL | G_IO_ERR, proto_hup_cb,
-			proto_watch);
-	g_io_channel_unref(proto_io);
+	log_info_rl("%.36s: incomplete schema discarded", trust->uuid);
 
-	return KNOT_SUCCESS;
+	trust->schema_id = 0;
+	sensor_table_free(trust->schema_tmp);
+	trust->schema_tmp = NULL;
+
+	return FALSE;
+}
+
+static gboolean schema_equal(const struct sensor_table *a,
+					const struct sensor_table *b)
+{
+	const knot_msg_schema *sa, *sb;
+	guint i;
+
+	if (sensor_table_length(a) != sensor_table_length(b))
+		return FALSE;
+
+	for (i = 0; i < sensor_table_length(a); i++) {
+		sa = sensor_table_index(a, i);
+		sb = sensor_table_lookup(b, sa->sensor_id);
+		if (sb == NULL)
+			return FALSE;
+
+		/* Octets after the name terminator are not significant */
+		if (sa->values.value_type != sb->values.value_type ||
+				sa->values.unit != sb->values.unit ||
+				sa->values.type_id != sb->values.type_id ||
+				strncmp(sa->values.name, sb->values.name,
+					sizeof(sa->values.name)) != 0)
+			return FALSE;
+	}
+
+	return TRUE;
 }
 
 static int8_t msg_schema(int sock, int proto_sock,
 				const struct proto_ops *proto_ops,
 				const knot_msg_schema *kmsch, gboolean eof)
 {
-	const knot_msg_schema *schema = kmsch;
-	knot_msg_schema *kschema;
+	const knot_msg_schema *schema;
 	struct json_object *jobj, *ajobj, *schemajobj;
 	struct trust *trust;
-	GSList *list;
 	json_raw_t json;
 	const char *jobjstr;
+	guint i;
 	int err;
-	gboolean found = FALSE;
+	gint64 start;
 
-	trust = g_hash_table_lookup(trust_list, GINT_TO_POINTER(sock));
+	trust = trust_get(sock);
 	if (!trust) {
 		log_info("Permission denied!");
 		return KNOT_CREDENTIAL_UNAUTHORIZED;
@@ -1167,27 +1566,38 @@ static int8_t msg_schema(int sock, int proto_sock,
 	 * Checks whether the schema was received before and if not, adds
 	 * to a temporary list until receiving complete schema.
 	 */
-	kschema = g_memdup(schema, sizeof(*schema));
-	for (list = trust->schema_tmp; list ; list = g_slist_next(list)) {
-		schema = list->data;
-		if (kschema->sensor_id == schema->sensor_id)
-			found = TRUE;
-	}
-	if (!found)
-		trust->schema_tmp = g_slist_append(trust->schema_tmp, kschema);
+	if (!trust->schema_tmp)
+		trust->schema_tmp = sensor_table_new(sizeof(*kmsch), NULL);
 
-	 /* TODO: missing timer to wait for end of schema transfer */
+	if (!sensor_table_lookup(trust->schema_tmp, kmsch->sensor_id))
+		sensor_table_insert(trust->schema_tmp, kmsch->sensor_id, kmsch);
+
+	/* Each fragment restarts the wait for the end of the transfer */
+	if (trust->schema_id)
+		worker_source_remove(trust->context, trust->schema_id);
+	trust->schema_id = 0;
+
+	if (!eof) {
+		trust->schema_id = worker_timeout_add(trust->context,
+					SCHEMA_TIMEOUT, schema_timeout,
+					GINT_TO_POINTER(sock));
+		return KNOT_SUCCESS;
+	}
 
-	if (!eof)
+	/* Things send the schema on every connection: usually unchanged */
+	if (schema_equal(trust->schema_tmp, trust->schema)) {
+		sensor_table_free(trust->schema_tmp);
+		trust->schema_tmp = NULL;
 		return KNOT_SUCCESS;
+	}
 
 	/* SCHEMA is an array of entries */
 	ajobj = json_object_new_array();
 	schemajobj = json_object_new_object();
 
 	/* Creating an array if the sensor supports multiple data types */
-	for (list = trust->schema_tmp; list; list = g_slist_next(list)) {
-		schema = list->data;
+	for (i = 0; i < sensor_table_length(trust->schema_tmp); i++) {
+		schema = sensor_table_index(trust->schema_tmp, i);
 		jobj = json_object_new_object();
 		json_object_object_add(jobj, "sensor_id",
 				json_object_new_int(schema->sensor_id));
@@ -1204,333 +1614,678 @@ static int8_t msg_schema(int sock, int proto_sock,
 	}
 
 	json_object_object_add(schemajobj, "schema", ajobj);
-	jobjstr = json_object_to_json_string(schemajobj);
+	jobjstr = json_object_to_json_string_ext(schemajobj,
+						JSON_C_TO_STRING_PLAIN);
 
 	memset(&json, 0, sizeof(json));
+	start = proto_begin("schema");
 	err = proto_ops->schema(proto_sock, trust->uuid, trust->token,
 							jobjstr, &json);
+	proto_stats("schema", start, err);
 	if (json.data)
 		free(json.data);
 
 	json_object_put(schemajobj);
 
 	if (err < 0) {
-		g_slist_free_full(trust->schema_tmp, g_free);
+		sensor_table_free(trust->schema_tmp);
 		trust->schema_tmp = NULL;
 		log_error("manager schema(): %s(%d)", strerror(-err), -err);
 		return KNOT_CLOUD_FAILURE;
 	}
 
 	/* If POST succeed: free old schema and use the new one */
-	g_slist_free_full(trust->schema, g_free);
+	sensor_table_free(trust->schema);
 	trust->schema = trust->schema_tmp;
 	trust->schema_tmp = NULL;
 
+	/* Cached document is outdated: the next signin refreshes it */
+	cache_remove(trust->uuid);
+
 	return KNOT_SUCCESS;
 }
 
 /*
- * Updates de 'devices' db, removing the sensor_id that just sent the data
+ * Copies the 'key' array of the device document to 'jreq' without the
+ * acknowledged sensors. Returns FALSE if no entry was removed: the cloud
+ * doesn't need to be updated.
  */
-static void update_device_getdata(const struct proto_ops *proto_ops,
-					int proto_sock, char *uuid, char *token,
-					uint8_t sensor_id)
+static gboolean ack_filter(json_object *jobj, json_object *jreq,
+				const char *key, const uint32_t *acked)
 {
-	json_object *jobj, *jobjarray, *jobjentry, *jobjkey;
-	json_object *ajobj, *setdatajobj;
-	json_raw_t json;
-	const char *jobjstr;
-	int i, err;
-
-	memset(&json, 0, sizeof(json));
-	err = proto_ops->fetch(proto_sock, uuid, token, &json);
-
-	if (err < 0) {
-		log_error("signin(): %s(%d)", strerror(-err), -err);
-		goto done;
-	}
-
-	jobj = json_tokener_parse(json.data);
-	if (!jobj)
-		goto done;
-
-	ajobj = json_object_new_array();
-	setdatajobj = json_object_new_object();
+	json_object *jobjarray, *jobjentry, *jobjkey, *ajobj;
+	gboolean removed = FALSE;
+	int i, sensor_id;
 
 	/*
-	 * Getting 'get_data' from the device properties
-	 * {"devices":[{"uuid":
+	 * {"uuid": ...
 	 *		"set_data" : [
 	 *			{"sensor_id": v,
 	 *			"value": w}]
-	 *		}]
 	 * }
 	 */
-
-	/* 'get_data' is an array */
-	if (!json_object_object_get_ex(jobj, "get_data", &jobjarray))
-		goto done;
+	if (!json_object_object_get_ex(jobj, key, &jobjarray))
+		return FALSE;
 
 	if (json_object_get_type(jobjarray) != json_type_array)
-		goto done;
+		return FALSE;
 
-	for (i = 0; i < json_object_array_length(jobjarray); i++) {
+	ajobj = json_object_new_array();
 
+	for (i = 0; i < json_object_array_length(jobjarray); i++) {
 		jobjentry = json_object_array_get_idx(jobjarray, i);
 		if (!jobjentry)
 			break;
 
-		/* Getting 'sensor_id' */
 		if (!json_object_object_get_ex(jobjentry, "sensor_id",
 								&jobjkey))
 			continue;
 
-		/*
-		 * Creates a list with all the sensor_id in the get_data list
-		 * except for the one that was just received
-		 */
-		if (json_object_get_int(jobjkey) != sensor_id) {
-			json_object_array_add(ajobj,
-						json_object_get(jobjentry));
-			continue;
-		}
 		/*
 		 * TODO: if the value changed before it was updated, the entry
 		 * should not be erased
 		 */
+		sensor_id = json_object_get_int(jobjkey);
+		if (sensor_id >= 0 && sensor_id < 256 &&
+			(acked[sensor_id / 32] & (1U << (sensor_id % 32)))) {
+			removed = TRUE;
+			continue;
+		}
+
+		json_object_array_add(ajobj, json_object_get(jobjentry));
 	}
 
-	json_object_object_add(setdatajobj, "get_data", json_object_get(ajobj));
-	jobjstr = json_object_to_json_string(setdatajobj);
+	if (removed)
+		json_object_object_add(jreq, key, ajobj);
+	else
+		json_object_put(ajobj);
 
-	err = proto_ops->setdata(proto_sock, uuid, token, jobjstr, &json);
+	return removed;
+}
 
-done:
-	if (jobj)
-		json_object_put(jobj);
-	if (setdatajobj)
-		json_object_put(setdatajobj);
-	if (ajobj)
-		json_object_put(ajobj);
-	free(json.data);
+/* Acknowledgements of a flush, sent by fetch_async() and setdata_async() */
+struct ack_update {
+	int sock;
+	char uuid[KNOT_PROTOCOL_UUID_LEN + 1];
+	uint32_t ack_setdata[256 / 32];
+	uint32_t ack_getdata[256 / 32];
+	gint64 start;
+};
+
+static void ack_setdata_cb(int err, json_raw_t *json, void *user_data)
+{
+	struct ack_update *update = user_data;
+
+	proto_stats("setdata", update->start, err);
+	if (err < 0)
+		log_error_rl("setdata_async(): %s(%d)", strerror(-err), -err);
+
+	g_free(update);
 }
 
-static int8_t msg_data(int sock, int proto_sock,
-					const struct proto_ops *proto_ops,
-					const knot_msg_data *kmdata)
+static void ack_fetch_cb(int err, json_raw_t *json, void *user_data)
 {
-	/*
-	 * Pointer to KNOT data containing header, sensor id
-	 * and a primitive KNOT type
-	 */
-	const knot_data *kdata = &(kmdata->payload);
-	struct json_object *jobj;
-	const struct trust *trust;
-	const knot_msg_schema *schema;
-	GSList *list;
-	json_raw_t json;
-	const char *jobjstr;
-	/* INT_MAX 2147483647 */
-	char str[12];
-	double doubleval;
-	uint8_t sensor_id;
-	int len, err;
+	struct ack_update *update = user_data;
+	struct trust *trust;
+	json_object *jreq;
+	const char *jreqstr;
+	gboolean changed;
 
-	trust = g_hash_table_lookup(trust_list, GINT_TO_POINTER(sock));
-	if (!trust) {
-		log_info("Permission denied!");
-		return KNOT_CREDENTIAL_UNAUTHORIZED;
-	}
+	if (err == 0 && json->jobj == NULL)
+		err = -EINVAL;
 
-	sensor_id = kmdata->sensor_id;
+	proto_stats("fetch", update->start, err);
 
-	list = g_slist_find_custom(trust->schema, GUINT_TO_POINTER(sensor_id),
-								sensor_id_cmp);
-	if (!list) {
-		log_info("sensor_id(0x%02x): data type mismatch!", sensor_id);
-		return KNOT_INVALID_DATA;
+	/* Not removed: the cloud pushes it again, the thing acks */
+	if (err < 0) {
+		log_error_rl("fetch_async(): %s(%d)", strerror(-err), -err);
+		goto done;
 	}
 
-	schema = list->data;
+	/* Thing gone or cloud connection closed meanwhile: same as above */
+	trust = trust_get(update->sock);
+	if (trust == NULL || strcmp(trust->uuid, update->uuid) != 0 ||
+						trust->proto_sock < 0)
+		goto done;
 
-	err = knot_schema_is_valid(schema->values.type_id,
-				schema->values.value_type, schema->values.unit);
-	if (err) {
-		log_info("sensor_id(0x%d), type_id(0x%04x): unit mismatch!",
-					sensor_id, schema->values.type_id);
-		return KNOT_INVALID_DATA;
+	jreq = json_object_new_object();
+	changed = ack_filter(json->jobj, jreq, "set_data",
+						update->ack_setdata);
+	changed |= ack_filter(json->jobj, jreq, "get_data",
+						update->ack_getdata);
+
+	if (changed) {
+		jreqstr = json_object_to_json_string_ext(jreq,
+						JSON_C_TO_STRING_PLAIN);
+		update->start = proto_begin("setdata");
+		err = trust->proto_ops->setdata_async(trust->proto_sock,
+					trust->uuid, trust->token, jreqstr,
+					ack_setdata_cb, update);
+		if (err == 0)
+			update = NULL;
 	}
 
-	log_info("sensor:%d, unit:%d, value_type:%d", sensor_id,
-				schema->values.unit, schema->values.value_type);
+	json_object_put(jreq);
 
-	jobj = json_object_new_object();
-	json_object_object_add(jobj, "sensor_id",
-						json_object_new_int(sensor_id));
+done:
+	g_free(update);
+}
 
-	switch (schema->values.value_type) {
-	case KNOT_VALUE_TYPE_INT:
-		json_object_object_add(jobj, "value",
-				json_object_new_int(kdata->values.val_i.value));
-		break;
-	case KNOT_VALUE_TYPE_FLOAT:
+/* The session worker doesn't wait for the two round trips */
+static int ack_flush_async(struct trust *trust)
+{
+	struct ack_update *update;
+	int err;
 
-		/* FIXME: precision */
-		len = sprintf(str, "%d", kdata->values.val_f.value_dec);
+	update = g_new0(struct ack_update, 1);
+	update->sock = trust->sock;
+	g_strlcpy(update->uuid, trust->uuid, sizeof(update->uuid));
+	memcpy(update->ack_setdata, trust->ack_setdata,
+					sizeof(update->ack_setdata));
+	memcpy(update->ack_getdata, trust->ack_getdata,
+					sizeof(update->ack_getdata));
 
-		doubleval = kdata->values.val_f.multiplier *
-			(kdata->values.val_f.value_int +
-			(kdata->values.val_f.value_dec / pow(10, len)));
+	update->start = proto_begin("fetch");
+	err = trust->proto_ops->fetch_async(trust->proto_sock, trust->uuid,
+					trust->token, ack_fetch_cb, update);
+	if (err < 0)
+		g_free(update);
 
-		json_object_object_add(jobj, "value",
-					json_object_new_double(doubleval));
-		break;
-	case KNOT_VALUE_TYPE_BOOL:
-		json_object_object_add(jobj, "value",
-				json_object_new_boolean(kdata->values.val_b));
-		break;
-	case KNOT_VALUE_TYPE_RAW:
-		break;
-	default:
-		json_object_put(jobj);
-		return KNOT_INVALID_DATA;
+	return err;
+}
+
+/*
+ * Removes the sensors acknowledged since the last flush from 'set_data'
+ * and 'get_data': one fetch and at most one update per device, instead
+ * of two round trips per acknowledged sensor.
+ */
+static void ack_flush(struct trust *trust)
+{
+	json_object *jobj, *jreq;
+	const char *jreqstr;
+	json_raw_t json;
+	gboolean update;
+	int err;
+	gint64 start;
+
+	if (trust->ack_id) {
+		worker_source_remove(trust->context, trust->ack_id);
+		trust->ack_id = 0;
 	}
 
-	jobjstr = json_object_to_json_string(jobj);
+	if (!trust->ack_pending)
+		return;
+
+	/* Offline: trust_online() retries once the session is back */
+	if (trust->proto_sock < 0)
+		return;
+
+	trust->ack_pending = FALSE;
 
-	log_info("JSON: %s", jobjstr);
+	if (trust->proto_ops->fetch_async && trust->proto_ops->setdata_async &&
+						ack_flush_async(trust) == 0)
+		goto done;
 
 	memset(&json, 0, sizeof(json));
-	err = proto_ops->data(proto_sock, trust->uuid, trust->token,
-							jobjstr, &json);
-	if (json.data)
-		free(json.data);
+	start = proto_begin("fetch");
+	err = trust->proto_ops->fetch(trust->proto_sock, trust->uuid,
+						trust->token, &json);
+	proto_stats("fetch", start, err);
+
+	jobj = err < 0 ? NULL : json_tokener_parse(json.data);
+	free(json.data);
+
+	if (!jobj) {
+		/* Not removed: the cloud pushes it again, the thing acks */
+		log_error_rl("fetch(): %s(%d)", strerror(-err), -err);
+		goto done;
+	}
 
+	jreq = json_object_new_object();
+	update = ack_filter(jobj, jreq, "set_data", trust->ack_setdata);
+	update |= ack_filter(jobj, jreq, "get_data", trust->ack_getdata);
 	json_object_put(jobj);
 
-	if (err < 0) {
-		log_error("manager data(): %s(%d)", strerror(-err), -err);
-		return KNOT_CLOUD_FAILURE;
+	if (update) {
+		jreqstr = json_object_to_json_string_ext(jreq,
+						JSON_C_TO_STRING_PLAIN);
+		memset(&json, 0, sizeof(json));
+		start = proto_begin("setdata");
+		err = trust->proto_ops->setdata(trust->proto_sock, trust->uuid,
+						trust->token, jreqstr, &json);
+		proto_stats("setdata", start, err);
+		free(json.data);
 	}
 
-	update_device_getdata(proto_ops, proto_sock, trust->uuid, trust->token,
-								sensor_id);
+	json_object_put(jreq);
 
-	return KNOT_SUCCESS;
+done:
+	memset(trust->ack_setdata, 0, sizeof(trust->ack_setdata));
+	memset(trust->ack_getdata, 0, sizeof(trust->ack_getdata));
 }
 
-static int8_t msg_config_resp(int sock, const knot_msg_item *rsp)
+static gboolean ack_flush_cb(gpointer user_data)
 {
-	struct trust *trust;
-	uint8_t sensor_id;
-	GSList *list;
-	struct config *entry;
+	struct trust *trust = user_data;
 
-	trust = g_hash_table_lookup(trust_list, GINT_TO_POINTER(sock));
-	if (!trust) {
-		log_info("Permission denied!");
-		return KNOT_CREDENTIAL_UNAUTHORIZED;
-	}
-	sensor_id = rsp->sensor_id;
-	for (list = trust->config; list; list = g_slist_next(list)) {
-		entry = list->data;
-		if (entry->kmcfg.sensor_id == sensor_id) {
-			entry->confirmed = TRUE;
-			break;
-		}
-	}
-	log_info("THING %s received config for sensor %d", trust->uuid,
-								sensor_id);
-	return KNOT_SUCCESS;
+	/* Returning FALSE removes the source */
+	trust->ack_id = 0;
+	ack_flush(trust);
+
+	return FALSE;
 }
 
-/*
- * Updates de 'devices' db, removing the sensor_id that was acknowledged by the
- * THING.
- */
-static void update_device_setdata(const struct proto_ops *proto_ops,
-					int proto_sock, char *uuid, char *token,
-					uint8_t sensor_id)
+/* Acknowledgements arriving within ACK_WINDOW share one cloud update */
+static void ack_queue(struct trust *trust, uint32_t *acked,
+							uint8_t sensor_id)
 {
-	json_object *jobj, *jobjarray, *jobjentry, *jobjkey;
-	json_object *ajobj, *setdatajobj;
-	json_raw_t json;
-	const char *jobjstr;
-	int i, err;
+	acked[sensor_id / 32] |= 1U << (sensor_id % 32);
+	trust->ack_pending = TRUE;
 
-	memset(&json, 0, sizeof(json));
-	err = proto_ops->fetch(proto_sock, uuid, token, &json);
+	if (trust->ack_id == 0)
+		trust->ack_id = worker_timeout_add(trust->context,
+					ACK_WINDOW, ack_flush_cb, trust);
+}
 
-	if (err < 0) {
-		log_error("signin(): %s(%d)", strerror(-err), -err);
-		goto done;
-	}
+/* Cloud connection of the PDU: acknowledgements held offline go out */
+static void trust_online(struct trust *trust, int proto_sock,
+					const struct proto_ops *proto_ops)
+{
+	trust->proto_sock = proto_sock;
+	trust->proto_ops = proto_ops;
 
-	jobj = json_tokener_parse(json.data);
-	if (!jobj)
-		goto done;
+	if (proto_sock >= 0 && trust->ack_pending && trust->ack_id == 0)
+		trust->ack_id = worker_timeout_add(trust->context,
+					ACK_WINDOW, ack_flush_cb, trust);
+}
 
-	ajobj = json_object_new_array();
-	setdatajobj = json_object_new_object();
-	/*
-	 * Getting 'set_data' from the device properties:
-	 * {"devices":[{"uuid":
-	 *		"set_data" : [
-	 *			{"sensor_id": v,
-	 *			"value": w}]
-	 * }
-	 */
+static void data_entry_free(gpointer mem)
+{
+	struct data_entry *entry = mem;
 
-	/* 'set_data' is an array */
-	if (!json_object_object_get_ex(jobj, "set_data", &jobjarray))
-		goto done;
+	g_free(entry->json);
+	g_free(entry);
+}
 
-	if (json_object_get_type(jobjarray) != json_type_array)
-		goto done;
+static int journal_send(const char *uuid, const char *token,
+					const char *json, void *user_data)
+{
+	json_raw_t jraw;
+	gint64 start;
+	int err;
 
+	memset(&jraw, 0, sizeof(jraw));
+	start = proto_begin("data");
+	err = journal_ops->data(journal_sock, uuid, token, json, &jraw);
+	proto_stats("data", start, err);
+	if (jraw.data)
+		free(jraw.data);
+
+	switch (err) {
+	case -EPERM:
+	case -ENOENT:
+	case -EINVAL:
+		/* Unknown device, revoked token or invalid reading */
+		return -ECANCELED;
+	}
 
-	for (i = 0; i < json_object_array_length(jobjarray); i++) {
+	return err;
+}
 
-		jobjentry = json_object_array_get_idx(jobjarray, i);
-		if (!jobjentry)
-			break;
+static gboolean journal_drain_cb(gpointer user_data)
+{
+	int err;
 
-		/* Getting 'sensor_id' */
-		if (!json_object_object_get_ex(jobjentry, "sensor_id",
-								&jobjkey))
-			continue;
+	if (journal_ops == NULL || journal_offline)
+		return TRUE;
 
-		if (json_object_get_int(jobjkey) != sensor_id) {
-			json_object_array_add(ajobj,
-						json_object_get(jobjentry));
-			continue;
+	if (journal_sock < 0) {
+		journal_sock = journal_ops->connect();
+		if (journal_sock < 0)
+			return TRUE;	/* Cloud still unreachable */
+	}
+
+	err = journal_drain(journal_send, JOURNAL_BATCH, NULL);
+	if (err < 0) {
+		log_error("journal drain: %s(%d)", strerror(-err), -err);
+		journal_ops->close(journal_sock);
+		journal_sock = -1;
+		return TRUE;
+	}
+
+	/* Uploads the next batch as soon as the main loop is idle */
+	if (!journal_empty()) {
+		G_LOCK(journal_drain);
+		journal_id = g_idle_add(journal_drain_cb, NULL);
+		G_UNLOCK(journal_drain);
+		return FALSE;
+	}
+
+	log_info("journal: offline readings uploaded");
+
+	journal_ops->close(journal_sock);
+	journal_sock = -1;
+
+	G_LOCK(journal_drain);
+	journal_id = 0;
+	G_UNLOCK(journal_drain);
+
+	return FALSE;
+}
+
+/* Called from the session workers: the drain belongs to the main loop */
+static void journal_schedule(const struct proto_ops *proto_ops)
+{
+	G_LOCK(journal_drain);
+
+	journal_ops = proto_ops;
+	if (journal_id == 0)
+		journal_id = g_timeout_add_seconds(JOURNAL_RETRY,
+						journal_drain_cb, NULL);
+
+	G_UNLOCK(journal_drain);
+}
+
+/* Reading uploaded by data_async(): journaled if the upload fails */
+struct data_upload {
+	char uuid[KNOT_PROTOCOL_UUID_LEN + 1];
+	char token[KNOT_PROTOCOL_TOKEN_LEN + 1];
+	const struct proto_ops *proto_ops;
+	char *json;
+	gint64 start;
+};
+
+static void data_upload_cb(int err, json_raw_t *json, void *user_data)
+{
+	struct data_upload *upload = user_data;
+	int jerr;
+
+	proto_stats("data", upload->start, err);
+
+	if (err == 0) {
+		if (!journal_empty())
+			journal_schedule(upload->proto_ops);
+		goto done;
+	}
+
+	log_error_rl("manager data_async(): %s(%d)", strerror(-err), -err);
+
+	jerr = journal_append(upload->uuid, upload->token, upload->json);
+	if (jerr < 0)
+		log_error("journal %.36s: %s(%d), reading lost", upload->uuid,
+						strerror(-jerr), -jerr);
+	else
+		journal_schedule(upload->proto_ops);
+
+done:
+	g_free(upload->json);
+	g_free(upload);
+}
+
+static int data_send_async(struct trust *trust, const char *jobjstr)
+{
+	struct data_upload *upload;
+	int err;
+
+	upload = g_new0(struct data_upload, 1);
+	g_strlcpy(upload->uuid, trust->uuid, sizeof(upload->uuid));
+	g_strlcpy(upload->token, trust->token, sizeof(upload->token));
+	upload->proto_ops = trust->proto_ops;
+	upload->json = g_strdup(jobjstr);
+
+	upload->start = proto_begin("data");
+	err = trust->proto_ops->data_async(trust->proto_sock, trust->uuid,
+				trust->token, jobjstr, data_upload_cb, upload);
+	if (err < 0) {
+		g_free(upload->json);
+		g_free(upload);
+	}
+
+	return err;
+}
+
+/*
+ * Returns 0 if uploaded or submitted, -EINPROGRESS if stored in the
+ * journal to be uploaded later, or -errno if the reading is lost.
+ */
+static int data_send(struct trust *trust, const char *jobjstr)
+{
+	json_raw_t json;
+	int err, jerr;
+	gint64 start;
+
+	log_dbg("JSON: %s", jobjstr);
+
+	/* Flush window expired after the cloud connection was closed */
+	if (trust->proto_sock < 0) {
+		err = -ENOTCONN;
+		goto offline;
+	}
+
+	/*
+	 * Only if journaled on failure: the thing doesn't wait for the
+	 * upload, it can't be told the reading was lost.
+	 */
+	if (trust->proto_ops->data_async && journal_enabled() &&
+					data_send_async(trust, jobjstr) == 0)
+		return 0;
+
+	memset(&json, 0, sizeof(json));
+	start = proto_begin("data");
+	err = trust->proto_ops->data(trust->proto_sock, trust->uuid,
+					trust->token, jobjstr, &json);
+	proto_stats("data", start, err);
+	if (json.data)
+		free(json.data);
+
+	if (err == 0) {
+		/* Cloud is back: forwards the readings stored meanwhile */
+		if (!journal_empty())
+			journal_schedule(trust->proto_ops);
+		return 0;
+	}
+
+	log_error_rl("manager data(): %s(%d)", strerror(-err), -err);
+
+offline:
+	/* Cloud unreachable: store and forward */
+	jerr = journal_append(trust->uuid, trust->token, jobjstr);
+	if (jerr == -ENOSYS)
+		return err;
+
+	if (jerr < 0) {
+		log_error("journal: %s(%d)", strerror(-jerr), -jerr);
+		return jerr;
+	}
+
+	journal_schedule(trust->proto_ops);
+
+	return -EINPROGRESS;
+}
+
+/*
+ * Serializes the buffered readings as a single data message. A lone reading
+ * keeps the {"sensor_id": x, "value": y} format, otherwise the readings are
+ * sent in arrival order as {"data": [{"sensor_id": x, "value": y}, ...]}.
+ * Meshblu stores it as one record: consumers of the device data must read
+ * the array (see dataFlushWindow in main.c). Returns the entries taken from
+ * the trust, in arrival order.
+ */
+static GSList *batch_serialize(struct trust *trust)
+{
+	struct data_entry *entry;
+	GSList *batch, *list;
+	GString *jbuf = trust->jbuf;
+
+	if (trust->batch_id) {
+		worker_source_remove(trust->context, trust->batch_id);
+		trust->batch_id = 0;
+	}
+
+	if (trust->batch == NULL)
+		return NULL;
+
+	batch = g_slist_reverse(trust->batch);
+	trust->batch = NULL;
+	trust->batch_len = 0;
+
+	g_string_truncate(jbuf, 0);
+
+	if (batch->next == NULL) {
+		entry = batch->data;
+		g_string_append(jbuf, entry->json);
+	} else {
+		g_string_append(jbuf, "{\"data\":[");
+		for (list = batch; list; list = g_slist_next(list)) {
+			entry = list->data;
+			if (list != batch)
+				g_string_append_c(jbuf, ',');
+			g_string_append(jbuf, entry->json);
 		}
-		/*
-		 * TODO: if the value changed before it was updated, the entry
-		 * should not be erased
-		 */
+		g_string_append(jbuf, "]}");
 	}
 
-	json_object_object_add(setdatajobj, "set_data", json_object_get(ajobj));
-	jobjstr = json_object_to_json_string(setdatajobj);
+	return batch;
+}
+
+static int data_flush(struct trust *trust)
+{
+	struct data_entry *entry;
+	GSList *batch, *list;
+	int err;
 
-	err = proto_ops->setdata(proto_sock, uuid, token, jobjstr, &json);
+	batch = batch_serialize(trust);
+	if (batch == NULL)
+		return 0;
+
+	err = data_send(trust, trust->jbuf->str);
+	if (err < 0)
+		goto done;
+
+	for (list = batch; list; list = g_slist_next(list)) {
+		entry = list->data;
+		if (entry->getdata)
+			ack_queue(trust, trust->ack_getdata, entry->sensor_id);
+	}
 
 done:
-	if (jobj)
-		json_object_put(jobj);
-	if (setdatajobj)
-		json_object_put(setdatajobj);
-	if (ajobj)
-		json_object_put(ajobj);
-	free(json.data);
+	g_slist_free_full(batch, data_entry_free);
+
+	return err;
+}
+
+/* Teardown: the buffered readings are uploaded by the journal drain */
+static void data_journal(struct trust *trust)
+{
+	GSList *batch;
+	int err;
+
+	batch = batch_serialize(trust);
+	if (batch == NULL)
+		return;
+
+	err = journal_append(trust->uuid, trust->token, trust->jbuf->str);
+	if (err < 0)
+		log_error("journal %.36s: %s(%d), %u readings lost",
+				trust->uuid, strerror(-err), -err,
+				g_slist_length(batch));
+	else
+		journal_schedule(trust->proto_ops);
+
+	g_slist_free_full(batch, data_entry_free);
+}
+
+static gboolean data_flush_cb(gpointer user_data)
+{
+	struct trust *trust = user_data;
+
+	/* Returning FALSE removes the source */
+	trust->batch_id = 0;
+	data_flush(trust);
+
+	return FALSE;
 }
 
 /*
- * Works like msg_data() (copy & paste), but removes the received info from
- * the 'devices' database.
+ * Serializes the reading of 'sensor_id' into the trust buffer. Returns
+ * -EINVAL if the schema value type is unknown.
  */
-static int8_t msg_setdata_resp(int sock, int proto_sock,
+static int data_serialize(struct trust *trust, uint8_t sensor_id,
+				uint8_t value_type, const knot_data *kdata)
+{
+	if (!trust->jbuf)
+		trust->jbuf = g_string_sized_new(64);
+
+	g_string_truncate(trust->jbuf, 0);
+
+	return serializer_data(trust->jbuf, sensor_id, value_type, kdata);
+}
+
+/*
+ * Buffers the reading of 'sensor_id' serialized in trust->jbuf. A value
+ * equal to the last one buffered for the same sensor is coalesced.
+ */
+static int data_push(struct trust *trust, int proto_sock,
+				const struct proto_ops *proto_ops,
+				uint8_t sensor_id, gboolean getdata)
+{
+	struct data_entry *entry;
+	GSList *list;
+	unsigned int window, batch;
+	int err;
+
+	trust_online(trust, proto_sock, proto_ops);
+
+	G_LOCK(msg_settings);
+	window = data_window;
+	batch = data_batch;
+	G_UNLOCK(msg_settings);
+
+	/*
+	 * Batching disabled: send straight from the trust buffer. Batched
+	 * readings are acknowledged before the upload: without the journal
+	 * a failed upload would lose them.
+	 */
+	if ((window == 0 || !journal_enabled()) && trust->batch == NULL) {
+		err = data_send(trust, trust->jbuf->str);
+		if (err == 0 && getdata)
+			ack_queue(trust, trust->ack_getdata, sensor_id);
+		return err;
+	}
+
+	/* Most recent reading first */
+	for (list = trust->batch; list; list = g_slist_next(list)) {
+		entry = list->data;
+		if (entry->sensor_id != sensor_id)
+			continue;
+
+		if (strcmp(entry->json, trust->jbuf->str) != 0)
+			break;
+
+		entry->getdata |= getdata;
+		return 0;
+	}
+
+	entry = g_new0(struct data_entry, 1);
+	entry->sensor_id = sensor_id;
+	entry->getdata = getdata;
+	entry->json = g_strndup(trust->jbuf->str, trust->jbuf->len);
+
+	trust->batch = g_slist_prepend(trust->batch, entry);
+	trust->batch_len++;
+
+	if (window == 0 || trust->batch_len >= batch ||
+							!journal_enabled())
+		return data_flush(trust);
+
+	if (trust->batch_id == 0)
+		trust->batch_id = worker_timeout_add(trust->context,
+					window, data_flush_cb, trust);
+
+	return 0;
+}
+
+static int8_t msg_data(int sock, int proto_sock,
 					const struct proto_ops *proto_ops,
 					const knot_msg_data *kmdata)
 {
@@ -1539,19 +2294,12 @@ static int8_t msg_setdata_resp(int sock, int proto_sock,
 	 * and a primitive KNOT type
 	 */
 	const knot_data *kdata = &(kmdata->payload);
-	struct json_object *jobj;
-	const struct trust *trust;
+	struct trust *trust;
 	const knot_msg_schema *schema;
-	GSList *list;
-	json_raw_t json;
-	const char *jobjstr;
-	/* INT_MAX 2147483647 */
-	char str[12];
-	double doubleval;
 	uint8_t sensor_id;
-	int len, err;
+	int err;
 
-	trust = g_hash_table_lookup(trust_list, GINT_TO_POINTER(sock));
+	trust = trust_get(sock);
 	if (!trust) {
 		log_info("Permission denied!");
 		return KNOT_CREDENTIAL_UNAUTHORIZED;
@@ -1559,15 +2307,12 @@ static int8_t msg_setdata_resp(int sock, int proto_sock,
 
 	sensor_id = kmdata->sensor_id;
 
-	list = g_slist_find_custom(trust->schema, GUINT_TO_POINTER(sensor_id),
-								sensor_id_cmp);
-	if (!list) {
+	schema = sensor_table_lookup(trust->schema, sensor_id);
+	if (!schema) {
 		log_info("sensor_id(0x%02x): data type mismatch!", sensor_id);
 		return KNOT_INVALID_DATA;
 	}
 
-	schema = list->data;
-
 	err = knot_schema_is_valid(schema->values.type_id,
 				schema->values.value_type, schema->values.unit);
 	if (err) {
@@ -1576,59 +2321,100 @@ static int8_t msg_setdata_resp(int sock, int proto_sock,
 		return KNOT_INVALID_DATA;
 	}
 
-	log_info("sensor:%d, unit:%d, value_type:%d", sensor_id,
+	log_dbg("sensor:%d, unit:%d, value_type:%d", sensor_id,
 				schema->values.unit, schema->values.value_type);
 
-	/* Fetches the 'devices' db */
-	update_device_setdata(proto_ops, proto_sock, trust->uuid, trust->token,
+	if (data_serialize(trust, sensor_id, schema->values.value_type,
+								kdata) < 0)
+		return KNOT_INVALID_DATA;
+
+	/*
+	 * Uploaded when the flush window expires or the batch is full.
+	 * Journaled readings are acknowledged: they are uploaded later. A
+	 * full journal is the backpressure: things keep and resend them.
+	 */
+	err = data_push(trust, proto_sock, proto_ops, sensor_id, TRUE);
+	if (err < 0 && err != -EINPROGRESS)
+		return KNOT_CLOUD_FAILURE;
+
+	return KNOT_SUCCESS;
+}
+
+static int8_t msg_config_resp(int sock, const knot_msg_item *rsp)
+{
+	struct trust *trust;
+	uint8_t sensor_id;
+	struct config *entry;
+
+	trust = trust_get(sock);
+	if (!trust) {
+		log_info("Permission denied!");
+		return KNOT_CREDENTIAL_UNAUTHORIZED;
+	}
+	sensor_id = rsp->sensor_id;
+	entry = sensor_table_lookup(trust->config, sensor_id);
+	if (entry)
+		entry->confirmed = TRUE;
+
+	log_info("THING %s received config for sensor %d", trust->uuid,
 								sensor_id);
+	return KNOT_SUCCESS;
+}
 
-	jobj = json_object_new_object();
-	json_object_object_add(jobj, "sensor_id",
-						json_object_new_int(sensor_id));
+/*
+ * Works like msg_data() (copy & paste), but removes the received info from
+ * the 'devices' database.
+ */
+static int8_t msg_setdata_resp(int sock, int proto_sock,
+					const struct proto_ops *proto_ops,
+					const knot_msg_data *kmdata)
+{
+	/*
+	 * Pointer to KNOT data containing header, sensor id
+	 * and a primitive KNOT type
+	 */
+	const knot_data *kdata = &(kmdata->payload);
+	struct trust *trust;
+	const knot_msg_schema *schema;
+	uint8_t sensor_id;
+	int err;
 
-	switch (schema->values.value_type) {
-	case KNOT_VALUE_TYPE_INT:
-		json_object_object_add(jobj, "value",
-				json_object_new_int(kdata->values.val_i.value));
-		break;
-	case KNOT_VALUE_TYPE_FLOAT:
+	trust = trust_get(sock);
+	if (!trust) {
+		log_info("Permission denied!");
+		return KNOT_CREDENTIAL_UNAUTHORIZED;
+	}
 
-		/* FIXME: precision */
-		len = sprintf(str, "%d", kdata->values.val_f.value_dec);
+	sensor_id = kmdata->sensor_id;
 
-		doubleval = kdata->values.val_f.multiplier *
-			(kdata->values.val_f.value_int +
-			(kdata->values.val_f.value_dec / pow(10, len)));
+	schema = sensor_table_lookup(trust->schema, sensor_id);
+	if (!schema) {
+		log_info("sensor_id(0x%02x): data type mismatch!", sensor_id);
+		return KNOT_INVALID_DATA;
+	}
 
-		json_object_object_add(jobj, "value",
-					json_object_new_double(doubleval));
-		break;
-	case KNOT_VALUE_TYPE_BOOL:
-		json_object_object_add(jobj, "value",
-				json_object_new_boolean(kdata->values.val_b));
-		break;
-	case KNOT_VALUE_TYPE_RAW:
-		break;
-	default:
-		json_object_put(jobj);
+	err = knot_schema_is_valid(schema->values.type_id,
+				schema->values.value_type, schema->values.unit);
+	if (err) {
+		log_info("sensor_id(0x%d), type_id(0x%04x): unit mismatch!",
+					sensor_id, schema->values.type_id);
 		return KNOT_INVALID_DATA;
 	}
 
-	jobjstr = json_object_to_json_string(jobj);
+	log_dbg("sensor:%d, unit:%d, value_type:%d", sensor_id,
+				schema->values.unit, schema->values.value_type);
 
-	memset(&json, 0, sizeof(json));
-	err = proto_ops->data(proto_sock, trust->uuid, trust->token,
-							jobjstr, &json);
-	if (json.data)
-		free(json.data);
+	/* Removed from 'set_data' on the next acknowledgement flush */
+	trust_online(trust, proto_sock, proto_ops);
+	ack_queue(trust, trust->ack_setdata, sensor_id);
 
-	json_object_put(jobj);
+	if (data_serialize(trust, sensor_id, schema->values.value_type,
+								kdata) < 0)
+		return KNOT_INVALID_DATA;
 
-	if (err < 0) {
-		log_error("manager data(): %s(%d)", strerror(-err), -err);
+	err = data_push(trust, proto_sock, proto_ops, sensor_id, FALSE);
+	if (err < 0)
 		return KNOT_CLOUD_FAILURE;
-	}
 
 	log_info("THING %s updated data for sensor %d", trust->uuid,
 								sensor_id);
@@ -1637,7 +2423,7 @@ static int8_t msg_setdata_resp(int sock, int proto_sock,
 }
 
 
-ssize_t msg_process(int sock, int proto_sock,
+static ssize_t msg_dispatch(int sock, int proto_sock,
 				const struct proto_ops *proto_ops,
 				const void *ipdu, size_t ilen,
 				void *opdu, size_t omtu)
@@ -1669,7 +2455,7 @@ ssize_t msg_process(int sock, int proto_sock,
 		goto done;
 	}
 
-	log_info("KNOT OP: 0x%02X LEN: %02x",
+	log_dbg("KNOT OP: 0x%02X LEN: %02x",
 				kreq->hdr.type, kreq->hdr.payload_len);
 
 	switch (kreq->hdr.type) {
@@ -1723,18 +2509,171 @@ done:
 	return (sizeof(knot_msg_header) + krsp->hdr.payload_len);
 }
 
-int msg_start(const char *uuid)
+ssize_t msg_process(int sock, int proto_sock,
+				const struct proto_ops *proto_ops,
+				const void *ipdu, size_t ilen,
+				void *opdu, size_t omtu)
+{
+	const knot_msg *kreq = ipdu;
+	char labels[32];
+	gint64 start;
+	ssize_t olen;
+
+	TRACE3(msg_begin, sock, ilen ? kreq->hdr.type : 0, ilen);
+
+	start = g_get_monotonic_time();
+	olen = msg_dispatch(sock, proto_sock, proto_ops, ipdu, ilen,
+							opdu, omtu);
+
+	TRACE3(msg_end, sock, ilen ? kreq->hdr.type : 0, olen);
+
+	/* Time spent in the gateway, cloud round trips included */
+	snprintf(labels, sizeof(labels), "op=\"%s\"",
+			ilen >= sizeof(knot_msg_header) ?
+			msg_name(kreq->hdr.type) : "unknown");
+	stats_observe("knotd_msg_duration_seconds", labels, start);
+	if (olen < 0)
+		stats_add("knotd_msg_errors_total", labels, 1);
+
+	return olen;
+}
+
+/*
+ * Replies to a PDU shed by the manager without processing it: nodes retry
+ * on KNOT_CLOUD_FAILURE. Responses from the node don't get a reply.
+ */
+ssize_t msg_reject(const void *ipdu, size_t ilen, void *opdu, size_t omtu)
+{
+	const knot_msg *kreq = ipdu;
+	knot_msg *krsp = opdu;
+	char labels[32];
+	uint8_t rtype;
+
+	if (omtu < sizeof(knot_msg) || ilen < sizeof(knot_msg_header))
+		return -EINVAL;
+
+	snprintf(labels, sizeof(labels), "op=\"%s\"",
+					msg_name(kreq->hdr.type));
+	stats_add("knotd_msg_rejected_total", labels, 1);
+
+	switch (kreq->hdr.type) {
+	case KNOT_MSG_REGISTER_REQ:
+		rtype = KNOT_MSG_REGISTER_RESP;
+		break;
+	case KNOT_MSG_UNREGISTER_REQ:
+		rtype = KNOT_MSG_UNREGISTER_RESP;
+		break;
+	case KNOT_MSG_DATA:
+		rtype = KNOT_MSG_DATA_RESP;
+		break;
+	case KNOT_MSG_AUTH_REQ:
+		rtype = KNOT_MSG_AUTH_RESP;
+		break;
+	case KNOT_MSG_SCHEMA:
+		rtype = KNOT_MSG_SCHEMA_RESP;
+		break;
+	case KNOT_MSG_SCHEMA_END:
+		rtype = KNOT_MSG_SCHEMA_END_RESP;
+		break;
+	default:
+		/* No octets to be transmitted */
+		return 0;
+	}
+
+	krsp->hdr.type = rtype;
+	krsp->hdr.payload_len = sizeof(krsp->action.result);
+	krsp->action.result = KNOT_CLOUD_FAILURE;
+
+	return sizeof(knot_msg_header) + krsp->hdr.payload_len;
+}
+
+int msg_start(const struct settings *settings)
 {
 	memset(owner_uuid, 0, sizeof(owner_uuid));
-	strncpy(owner_uuid, uuid, sizeof(owner_uuid));
+	strncpy(owner_uuid, settings->uuid, sizeof(owner_uuid));
+
+	data_window = settings->data_window;
+	if (settings->data_batch)
+		data_batch = settings->data_batch;
 
 	trust_list = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 					NULL, (GDestroyNotify) trust_free);
 
+	/* Optional: things are authenticated by the cloud only */
+	if (settings->cache && settings->cache_ttl)
+		cache_open(settings->cache, settings->cache_ttl);
+
+	/* Optional: readings are lost while the cloud is unreachable */
+	if (settings->journal && settings->journal_size &&
+		journal_open(settings->journal, settings->journal_size) == 0 &&
+		!journal_empty())
+		/* Readings of the last run: uploaded once a thing is seen */
+		journal_id = g_timeout_add_seconds(JOURNAL_RETRY,
+						journal_drain_cb, NULL);
+
 	return 0;
 }
 
+/* Settings read from the config file, applied to new requests */
+void msg_reload(const struct settings *settings)
+{
+	G_LOCK(msg_settings);
+
+	if (strncmp(owner_uuid, settings->uuid, sizeof(owner_uuid) - 1)) {
+		log_info("Owner changed to %s", settings->uuid);
+		memset(owner_uuid, 0, sizeof(owner_uuid));
+		strncpy(owner_uuid, settings->uuid, sizeof(owner_uuid) - 1);
+	}
+
+	data_window = settings->data_window;
+	data_batch = settings->data_batch ? settings->data_batch :
+							DATA_BATCH_DEFAULT;
+
+	G_UNLOCK(msg_settings);
+}
+
+/*
+ * Main loop: the proto driver is not probed while offline. The journal
+ * cloud session is reopened by the next drain.
+ */
+void msg_proto_offline(gboolean offline)
+{
+	journal_offline = offline;
+	if (!offline)
+		return;
+
+	if (journal_sock >= 0)
+		journal_ops->close(journal_sock);
+	journal_sock = -1;
+}
+
+void msg_proto_close(int sock, int proto_sock)
+{
+	struct trust *trust = trust_get(sock);
+
+	/*
+	 * Called by the worker of the trust: its timers can't run meanwhile.
+	 * The number may be reused by another cloud connection right away.
+	 */
+	if (trust && trust->proto_sock == proto_sock)
+		trust->proto_sock = -1;
+}
+
 void msg_stop(void)
 {
+	G_LOCK(trust_list);
 	g_hash_table_destroy(trust_list);
+	trust_list = NULL;
+	G_UNLOCK(trust_list);
+	cache_close();
+
+	if (journal_id)
+		g_source_remove(journal_id);
+	journal_id = 0;
+
+	if (journal_sock >= 0)
+		journal_ops->close(journal_sock);
+	journal_sock = -1;
+
+	journal_close();
 }
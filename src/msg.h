@@ -26,10 +26,18 @@
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-int msg_start(const char *uuid);
+struct settings;
+
+int msg_start(const struct settings *settings);
 void msg_stop(void);
+void msg_reload(const struct settings *settings);
+void msg_proto_offline(gboolean offline);
+
+/* Cloud connection of the node 'sock' closed: deferred calls go offline */
+void msg_proto_close(int sock, int proto_sock);
 
 ssize_t msg_process(int sock, int proto_sock,
 				const struct proto_ops *proto_ops,
 				const void *ipdu, size_t ilen,
 				void *opdu, size_t olen);
+ssize_t msg_reject(const void *ipdu, size_t ilen, void *opdu, size_t omtu);
@@ -30,6 +30,9 @@
  * This 'driver' intends to be an abstraction for Radio technologies or
  * proxy for other services using TCP or any socket based communication.
  */
+struct iovec;
+struct pdu;
+
 struct node_ops {
 	const char *name;
 	int (*probe) (void);
@@ -39,6 +42,23 @@ struct node_ops {
 	int (*accept) (int srv_sockfd); /* Returns a 'pollable' FD */
 	ssize_t (*recv) (int sockfd, void *buffer, size_t len);
 	ssize_t (*send) (int sockfd, const void *buffer, size_t len);
+
+	/*
+	 * Optional: transfer up to 'vlen' PDUs in one call. recv_batch()
+	 * doesn't block and sets 'iov_len' to the PDU length, which is
+	 * larger than the buffer if the PDU didn't fit. Returns the amount
+	 * of PDUs or -errno (-EAGAIN if none is pending).
+	 */
+	int (*recv_batch) (int sockfd, struct iovec *iov, unsigned int vlen);
+	int (*send_batch) (int sockfd, const struct iovec *iov,
+							unsigned int vlen);
+
+	/*
+	 * Optional: hands over up to 'vlen' PDUs filled in place by the
+	 * driver, the caller releases them with pdu_unref(). Same return
+	 * values as recv_batch(), it takes precedence over it.
+	 */
+	int (*recv_pdus) (int sockfd, struct pdu **pdus, unsigned int vlen);
 };
 
 /*
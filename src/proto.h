@@ -26,16 +26,33 @@
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+struct json_object;
+
+/*
+ * Raw cloud response. Drivers that decode the response while receiving it
+ * also provide the parsed device object in 'jobj': it is owned by the
+ * driver and only set on asynchronous callbacks and watches.
+ */
 typedef struct {
 	char *data;
 	size_t size;
+	struct json_object *jobj;
 } json_raw_t;
 
+/*
+ * Completion callback of asynchronous operations: 'err' is 0 or a
+ * negative errno value. 'json' is owned by the driver and it is only
+ * valid during the callback.
+ */
+typedef void (*proto_async_cb_t) (int err, json_raw_t *json, void *user_data);
+
+struct settings;
+
 /* Node operations */
 struct proto_ops {
 	const char *name;
 	unsigned int source_id;
-	int (*probe) (const char *host, unsigned int port);
+	int (*probe) (const struct settings *settings);
 	void (*remove) (void);
 
 	/* Abstraction for connect & close/sign-off */
@@ -64,8 +81,24 @@ struct proto_ops {
 	unsigned int (*async) (int proto_sock, const char *uuid,
 				const char *token, void (*proto_watch_cb)
 				(json_raw_t, void *), void *user_data);
+	/*
+	 * Optional: releases the watch returned by 'async'. If missing,
+	 * the returned id is a GLib source id.
+	 */
+	void (*unwatch) (unsigned int watch_id);
 
-
+	/*
+	 * Optional non-blocking variants, callable from the session workers.
+	 * 'cb' is called once, on the worker of the caller, also if the
+	 * request fails or is canceled by remove(). Return 0, or a negative
+	 * errno value if 'cb' won't be called.
+	 */
+	int (*data_async) (int sock, const char *uuid, const char *token,
+				const char *jreq, proto_async_cb_t cb,
+				void *user_data);
+	int (*fetch_async) (int sock, const char *uuid, const char *token,
+				proto_async_cb_t cb, void *user_data);
+	int (*setdata_async) (int sock, const char *uuid, const char *token,
+				const char *jreq, proto_async_cb_t cb,
+				void *user_data);
 };
-
-void proto_unregister_watch(unsigned int source_id);
@@ -26,6 +26,8 @@
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
@@ -37,18 +39,24 @@
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
  #include <inttypes.h>
 
 #include <glib.h>
 
 #include "log.h"
+#include "pdu.h"
+#include "frame.h"
 #include "node.h"
 #include "serial.h"
 
 #define __STDC_FORMAT_MACROS
 
+#define RXQ_MAX			64	/* PDUs waiting for the manager */
+
 static gint tty_watch;
+static int tty_fd = -1;
 
 struct serial_opts {
 	char tty[24];
@@ -57,39 +65,190 @@ struct serial_opts {
 
 static struct serial_opts serial_opts;
 
+/*
+ * PDUs don't go through the socketpair: they are queued on 'rxq' and
+ * the manager takes them with recv_pdus(), replies are written to the
+ * TTY by send(). The socketpair wakes up the session (one doorbell
+ * octet while 'rxq' is not empty), reports its release on 'sock' and
+ * carries the cloud pushes msg.c writes to 'node_sock'.
+ */
 struct pipe_pair {
 	int	sock;		/* End-point descriptor */
+	int	node_sock;	/* Returned by accept */
 	uint64_t pipeid;	/* Pipe identification */
+	guint	watch_id;	/* Pushes and session release */
+	GQueue	rxq;		/* struct pdu from the TTY */
+	gboolean doorbell;	/* Octet pending on 'node_sock' */
 };
 
-static GSList *pipes = NULL;
+/*
+ * Sessions may be served by worker threads: 'socks', the queues and the
+ * TTY writes are shared with the main loop.
+ */
+G_LOCK_DEFINE_STATIC(serial);
+
+/* Maps 40-bit pipe id to pipe_pair */
+static GHashTable *pipes = NULL;
+
+/* Maps accepted node_sock to pipe_pair */
+static GHashTable *socks = NULL;
+
+/* Pipes waiting for accept */
+static GQueue pending = G_QUEUE_INIT;
+
+/* Bytes read from the TTY, not aligned to frames */
+static struct frame_ring ring;
+
+static gboolean pipe_data_watch(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct pipe_pair *pipepair = user_data;
+	uint8_t frame[FRAME_MAX_SIZE];
+	ssize_t rbytes;
+	int err;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		/* Connection closed: next datagram triggers a new accept */
+		pipepair->watch_id = 0;
+		g_hash_table_remove(pipes, &pipepair->pipeid);
+		return FALSE;
+	}
+
+	/* Config and set_data pushed by msg.c, not a reply */
+	rbytes = read(pipepair->sock, &frame[FRAME_HDR_SIZE],
+					FRAME_MAX_SIZE - FRAME_HDR_SIZE);
+	if (rbytes <= 0)
+		return TRUE;
+
+	frame_header(frame, pipepair->pipeid, rbytes);
+
+	G_LOCK(serial);
+	if (write(tty_fd, frame, FRAME_HDR_SIZE + rbytes) < 0) {
+		err = errno;
+		log_error("serial: write(): %s(%d)", strerror(err), err);
+	}
+	G_UNLOCK(serial);
+
+	return TRUE;
+}
 
-static gint pipe_id_cmp(gconstpointer a, gconstpointer b)
+static void pipepair_free(gpointer user_data)
 {
-	const struct pipe_pair *pipepair1 = b;
-	const struct pipe_pair *pipepair2 = b;
+	struct pipe_pair *pipepair = user_data;
+	gpointer key = GINT_TO_POINTER(pipepair->node_sock);
+	struct pdu *pdu;
+
+	if (pipepair->watch_id)
+		g_source_remove(pipepair->watch_id);
+
+	/* Not accepted yet: the node side is not owned by the manager */
+	if (g_queue_remove(&pending, pipepair))
+		close(pipepair->node_sock);
+
+	/* node_sock may be reused already by another pipe */
+	G_LOCK(serial);
+	if (g_hash_table_lookup(socks, key) == pipepair)
+		g_hash_table_remove(socks, key);
+	G_UNLOCK(serial);
+
+	while ((pdu = g_queue_pop_head(&pipepair->rxq)))
+		pdu_unref(pdu);
+
+	close(pipepair->sock);
+	g_free(pipepair);
+}
+
+static struct pipe_pair *pipe_new(int srvfd, uint64_t pipeid)
+{
+	struct pipe_pair *pipepair;
+	GIOChannel *io;
+	uint64_t one = 1;
+	int sv[2];
+	int err;
+
+	/*
+	 * New 'thing' identified: new pipe added. Create a socketpair
+	 * to identify each connected 'thing' to its pipe.
+	 */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		err = errno;
+		log_error("serial: socketpair(): %s(%d)", strerror(err), err);
+		return NULL;
+	}
+
+	pipepair = g_new0(struct pipe_pair, 1);
+	pipepair->sock = sv[1];
+	pipepair->node_sock = sv[0];
+	pipepair->pipeid = pipeid;
+
+	g_queue_init(&pipepair->rxq);
+
+	io = g_io_channel_unix_new(pipepair->sock);
+	pipepair->watch_id = g_io_add_watch(io, G_IO_IN | G_IO_HUP |
+					G_IO_NVAL | G_IO_ERR,
+					pipe_data_watch, pipepair);
+	g_io_channel_unref(io);
+
+	g_hash_table_insert(pipes, &pipepair->pipeid, pipepair);
+
+	G_LOCK(serial);
+	g_hash_table_replace(socks, GINT_TO_POINTER(pipepair->node_sock),
+								pipepair);
+	G_UNLOCK(serial);
+	g_queue_push_tail(&pending, pipepair);
+
+	/* Trigger accept: each write is one accept (EFD_SEMAPHORE) */
+	if (write(srvfd, &one, sizeof(one)) < 0) {
+		err = errno;
+		log_error("serial: write(): %s(%d)", strerror(err), err);
+	}
+
+	return pipepair;
+}
+
+/* Main loop: the PDU is owned by the queue */
+static void pipe_push(struct pipe_pair *pipepair, struct pdu *pdu)
+{
+	const uint8_t doorbell = 0;
+	int err;
+
+	G_LOCK(serial);
+
+	if (pipepair->rxq.length >= RXQ_MAX) {
+		G_UNLOCK(serial);
+		log_error_rl("serial: pipe %" PRIu64 " overrun",
+							pipepair->pipeid);
+		pdu_unref(pdu);
+		return;
+	}
+
+	g_queue_push_tail(&pipepair->rxq, pdu);
+
+	if (!pipepair->doorbell) {
+		if (write(pipepair->sock, &doorbell, sizeof(doorbell)) < 0) {
+			err = errno;
+			log_error("serial: write(): %s(%d)",
+							strerror(err), err);
+		} else
+			pipepair->doorbell = TRUE;
+	}
 
-	return pipepair1->pipeid - pipepair2->pipeid;
+	G_UNLOCK(serial);
 }
 
 static gboolean tty_data_watch(GIOChannel *io, GIOCondition cond,
 							gpointer user_data)
 {
-	GSList *list;
-	struct pipe_pair pipepair;
+	struct pipe_pair *pipepair;
+	struct pdu *pdu;
 	int srvfd = GPOINTER_TO_INT(user_data);
-	int rbytes, err, ttyfd;
 	uint64_t pipeid;
-	uint8_t buffer[256];
+	int size;
 
 	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
 		return FALSE;
 
-	ttyfd = g_io_channel_unix_get_fd(io);
-
-	/* Read pipe address only */
-	rbytes = read(ttyfd, buffer, sizeof(buffer));
-	if (rbytes < 0)
+	if (frame_ring_fill(&ring, g_io_channel_unix_get_fd(io)) <= 0)
 		return TRUE;
 
 	/*
@@ -101,33 +260,22 @@ static gboolean tty_data_watch(GIOChannel *io, GIOCondition cond,
 	 * byte   5: datagram length
 	 * byte 6-x: payload
 	 */
-
-	pipeid = buffer[4];
-	pipeid |= buffer[3] << 8;
-	pipeid |= buffer[2] << 16;
-	pipeid |= buffer[1] << 24;
-	pipeid |= (uint64_t) buffer[0] << 32;
-
-	memset(&pipepair, 0, sizeof(pipepair));
-	pipepair.pipeid = pipeid;
-
-	list = g_slist_find_custom(pipes, &pipepair, pipe_id_cmp);
-	if (!list) {
-		/* New pipe: trigger accept */
-		if (write(srvfd, &pipeid, sizeof(pipeid)) < 0) {
-			err = errno;
-			log_error("serial: write(): %s(%d)", strerror(err), err);
+	while ((size = frame_ring_next(&ring, &pipeid)) >= 0) {
+		pipepair = g_hash_table_lookup(pipes, &pipeid);
+		if (!pipepair)
+			pipepair = pipe_new(srvfd, pipeid);
+
+		if (!pipepair || size == 0) {
+			frame_ring_consume(&ring, NULL, size);
+			continue;
 		}
-	} else {
-		/* Existent pipe: forward data */
-		struct pipe_pair *pipepair;
-		size_t size = rbytes - 6; /* Remove pipeid and length */
 
-		pipepair = list->data;
-		if (write(pipepair->sock, &buffer[6], size) < 0) {
-			err = errno;
-			log_error("serial: write(): %s(%d)", strerror(err), err);
-		}
+		/* The only copy: from the ring to the PDU msg.c reads */
+		pdu = pdu_new(size);
+		pdu->len = size;
+		frame_ring_consume(&ring, pdu->data, size);
+
+		pipe_push(pipepair, pdu);
 	}
 
 	return TRUE;
@@ -146,21 +294,19 @@ static int serial_probe(void)
 	return -err;
 }
 
-static void pipepair_free(gpointer user_data)
-{
-	struct pipe_pair *pipepair = user_data;
-
-	close(pipepair->sock);
-	g_free(pipepair);
-}
-
 static void serial_remove(void)
 {
 
 	if (tty_watch)
 		g_source_remove(tty_watch);
 
-	g_slist_free_full(pipes, pipepair_free);
+	if (pipes)
+		g_hash_table_destroy(pipes);
+	pipes = NULL;
+
+	if (socks)
+		g_hash_table_destroy(socks);
+	socks = NULL;
 }
 
 static int serial_listen(void)
@@ -188,12 +334,19 @@ static int serial_listen(void)
 
 	tcsetattr(ttyfd, TCSANOW, &term);
 
+	tty_fd = ttyfd;
+	ring.head = 0;
+	ring.len = 0;
+	pipes = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+							NULL, pipepair_free);
+	socks = g_hash_table_new(g_direct_hash, g_direct_equal);
+
 	io = g_io_channel_unix_new(ttyfd);
 	g_io_channel_set_close_on_unref(io, TRUE);
 
 	watch_cond = G_IO_HUP | G_IO_NVAL | G_IO_ERR | G_IO_IN;
 
-	srvfd = eventfd(0, 0);
+	srvfd = eventfd(0, EFD_SEMAPHORE);
 	tty_watch = g_io_add_watch_full(io,
 				G_PRIORITY_HIGH, watch_cond,
 				tty_data_watch, GINT_TO_POINTER(srvfd), NULL);
@@ -205,45 +358,128 @@ static int serial_listen(void)
 static int serial_accept(int srv_sockfd)
 {
 	struct pipe_pair *pipepair;
-	int sv[2];
-	uint64_t pipeid;
+	uint64_t value;
 	int err;
 
-	/*
-	 * New 'thing' identified: new pipe added. Create a socketpair
-	 * to identify each connected 'thing' to its pipe.
-	 */
-
-	if (read(srv_sockfd, &pipeid, sizeof(pipeid)) < 0) {
+	if (read(srv_sockfd, &value, sizeof(value)) < 0) {
 		err = errno;
 		log_error("serial: accept(): %s(%d)", strerror(err), err);
 		return -err;
 	}
 
-	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
-		err = errno;
-		log_error("serial: socketpair(): %s(%d)", strerror(err), err);
-		return -err;
+	/* Pipe may have been closed meanwhile */
+	pipepair = g_queue_pop_head(&pending);
+	if (!pipepair)
+		return -ENOENT;
+
+	log_info("New thing accept(%d) pipeid: %" PRIu64,
+				pipepair->node_sock, pipepair->pipeid);
+
+	return pipepair->node_sock;
+}
+
+/* Takes up to 'vlen' PDUs, the doorbell is consumed with the last one */
+static int serial_recv_pdus(int sockfd, struct pdu **pdus, unsigned int vlen)
+{
+	struct pipe_pair *pipepair;
+	uint8_t doorbell;
+	unsigned int i;
+
+	G_LOCK(serial);
+
+	pipepair = g_hash_table_lookup(socks, GINT_TO_POINTER(sockfd));
+	if (!pipepair) {
+		G_UNLOCK(serial);
+		return -EBADF;
 	}
 
-	log_info("New thing accept(%d) pipeid: %" PRIu64, sv[0], pipeid);
+	for (i = 0; i < vlen && pipepair->rxq.length; i++)
+		pdus[i] = g_queue_pop_head(&pipepair->rxq);
 
-	pipepair = g_new0(struct pipe_pair, 1);
-	pipepair->sock = sv[1];
-	pipepair->pipeid = pipeid;
-	pipes = g_slist_append(pipes, pipepair);
+	if (pipepair->rxq.length == 0 && pipepair->doorbell) {
+		if (recv(sockfd, &doorbell, sizeof(doorbell),
+						MSG_DONTWAIT) >= 0)
+			pipepair->doorbell = FALSE;
+	}
+
+	G_UNLOCK(serial);
 
-	return sv[0];
+	return i ? (int) i : -EAGAIN;
 }
 
 static ssize_t serial_recv(int sockfd, void *buffer, size_t len)
 {
-	return read(sockfd, buffer, len);
+	struct pdu *pdu;
+	ssize_t ret;
+
+	ret = serial_recv_pdus(sockfd, &pdu, 1);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	ret = pdu->len;
+	memcpy(buffer, pdu->data, MIN(len, pdu->len));
+	pdu_unref(pdu);
+
+	return ret;
+}
+
+/* PDUs are written to the TTY from the caller buffers */
+static int serial_send_batch(int sockfd, const struct iovec *iov,
+							unsigned int vlen)
+{
+	struct pipe_pair *pipepair;
+	uint8_t hdr[vlen][FRAME_HDR_SIZE];
+	struct iovec frames[2 * vlen];
+	unsigned int i, n;
+	int err;
+
+	G_LOCK(serial);
+
+	pipepair = g_hash_table_lookup(socks, GINT_TO_POINTER(sockfd));
+	if (!pipepair) {
+		G_UNLOCK(serial);
+		return -EBADF;
+	}
+
+	for (i = 0, n = 0; i < vlen; i++) {
+		if (iov[i].iov_len > FRAME_MAX_SIZE - FRAME_HDR_SIZE)
+			continue;
+
+		frame_header(hdr[i], pipepair->pipeid, iov[i].iov_len);
+		frames[n].iov_base = hdr[i];
+		frames[n++].iov_len = FRAME_HDR_SIZE;
+		frames[n++] = iov[i];
+	}
+
+	/* One syscall per batch: frames don't interleave on the TTY */
+	if (n && writev(tty_fd, frames, n) < 0) {
+		err = -errno;
+		G_UNLOCK(serial);
+		return err;
+	}
+
+	G_UNLOCK(serial);
+
+	return vlen;
 }
 
 static ssize_t serial_send(int sockfd, const void *buffer, size_t len)
 {
-	return write(sockfd, buffer, len);
+	struct iovec iov;
+	int ret;
+
+	iov.iov_base = (void *) buffer;
+	iov.iov_len = len;
+
+	ret = serial_send_batch(sockfd, &iov, 1);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	return len;
 }
 
 struct node_ops serial_ops = {
@@ -254,7 +490,9 @@ struct node_ops serial_ops = {
 	.listen = serial_listen,
 	.accept = serial_accept,
 	.recv = serial_recv,
-	.send = serial_send
+	.send = serial_send,
+	.send_batch = serial_send_batch,
+	.recv_pdus = serial_recv_pdus
 };
 
 int serial_load_config(const char *tty)
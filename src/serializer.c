@@ -0,0 +1,188 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2017, CESAR. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the CESAR nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL CESAR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <knot_types.h>
+
+#include "serializer.h"
+
+/* Up to 10^10: uint32_t values have at most 10 digits */
+static const uint64_t pow10_table[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+	1000000000, 10000000000ULL
+};
+
+/* Number of decimal digits of 'value' */
+static int digits(uint32_t value)
+{
+	int len = 1;
+
+	while (len < (int) G_N_ELEMENTS(pow10_table) &&
+						value >= pow10_table[len])
+		len++;
+
+	return len;
+}
+
+int serializer_data(GString *str, uint8_t sensor_id, uint8_t value_type,
+						const knot_data *kdata)
+{
+	const knot_value_type_float *val_f = &kdata->values.val_f;
+	double doubleval;
+	gsize len = str->len;
+	uint32_t dec;
+	int ndigits;
+
+	g_string_append_printf(str, "{\"sensor_id\":%u", sensor_id);
+
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		g_string_append_printf(str, ",\"value\":%d",
+						kdata->values.val_i.value);
+		break;
+	case KNOT_VALUE_TYPE_FLOAT:
+		/*
+		 * value_dec holds the decimal digits: value_int = 21 and
+		 * value_dec = 5 is 21.5. Printing with as many decimals as
+		 * value_dec digits avoids binary rounding noise.
+		 */
+		dec = val_f->value_dec;
+		ndigits = digits(dec);
+		doubleval = (double) val_f->multiplier * (val_f->value_int +
+				(double) dec / pow10_table[ndigits]);
+
+		g_string_append_printf(str, ",\"value\":%.*f", ndigits,
+								doubleval);
+		break;
+	case KNOT_VALUE_TYPE_BOOL:
+		g_string_append(str, kdata->values.val_b ?
+					",\"value\":true" : ",\"value\":false");
+		break;
+	case KNOT_VALUE_TYPE_RAW:
+		break;
+	default:
+		g_string_truncate(str, len);
+		return -EINVAL;
+	}
+
+	g_string_append_c(str, '}');
+
+	return 0;
+}
+
+void serializer_string(GString *str, const char *value)
+{
+	const char *c;
+
+	g_string_append_c(str, '"');
+
+	for (c = value; *c; c++) {
+		switch (*c) {
+		case '"':
+		case '\\':
+			g_string_append_c(str, '\\');
+			g_string_append_c(str, *c);
+			break;
+		default:
+			if ((unsigned char) *c < 0x20)
+				g_string_append_printf(str, "\\u%04x", *c);
+			else
+				g_string_append_c(str, *c);
+			break;
+		}
+	}
+
+	g_string_append_c(str, '"');
+}
+
+int serializer_credentials(GString *str, const char *jobj,
+					const char *uuid, const char *token)
+{
+	const char *start, *end;
+
+	start = jobj;
+	while (g_ascii_isspace(*start))
+		start++;
+
+	end = start + strlen(start);
+	while (end > start && g_ascii_isspace(end[-1]))
+		end--;
+
+	if (end - start < 2 || *start != '{' || end[-1] != '}')
+		return -EINVAL;
+
+	/* Members between the braces, if any */
+	start++;
+	end--;
+	while (start < end && g_ascii_isspace(*start))
+		start++;
+
+	g_string_append_c(str, '{');
+	if (start < end) {
+		g_string_append_len(str, start, end - start);
+		g_string_append_c(str, ',');
+	}
+
+	g_string_append(str, "\"uuid\":");
+	serializer_string(str, uuid);
+
+	if (token) {
+		g_string_append(str, ",\"token\":");
+		serializer_string(str, token);
+	}
+
+	g_string_append_c(str, '}');
+
+	return 0;
+}
+
+int serializer_event(GString *str, const char *event, const char *jobj,
+					const char *uuid, const char *token)
+{
+	gsize len = str->len;
+	int err;
+
+	g_string_append_c(str, '[');
+	serializer_string(str, event);
+	g_string_append_c(str, ',');
+
+	err = serializer_credentials(str, jobj, uuid, token);
+	if (err < 0) {
+		g_string_truncate(str, len);
+		return err;
+	}
+
+	g_string_append_c(str, ']');
+
+	return 0;
+}
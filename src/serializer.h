@@ -0,0 +1,51 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2017, CESAR. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the CESAR nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL CESAR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * JSON writers used on the data path: values are formatted straight from
+ * the KNOT PDU into a caller provided (usually reused) GString, without
+ * building json-c objects.
+ */
+
+/* Appends {"sensor_id":x,"value":y} formatted according to 'value_type' */
+int serializer_data(GString *str, uint8_t sensor_id, uint8_t value_type,
+						const knot_data *kdata);
+
+/* Appends 'value' as a JSON string: quoted and escaped */
+void serializer_string(GString *str, const char *value);
+
+/*
+ * Appends the JSON object 'jobj' adding "uuid" and "token" members, 'token'
+ * is optional. Fails if 'jobj' is not an object.
+ */
+int serializer_credentials(GString *str, const char *jobj,
+					const char *uuid, const char *token);
+
+/* Appends the socket.io event: ["event",{jobj + credentials}] */
+int serializer_event(GString *str, const char *event, const char *jobj,
+					const char *uuid, const char *token);
@@ -32,4 +32,17 @@ struct settings {
 	const char *proto;
 	char *uuid;
 	const char *tty;
+	unsigned int cloud_conns;	/* 0: one cloud connection per thing */
+	unsigned int data_window;	/* Data flush window (ms), 0: off */
+	unsigned int data_batch;	/* Data readings per upload */
+	unsigned int workers;		/* Session threads, 0: main loop */
+	const char *cache;		/* Trusted devices cache file */
+	unsigned int cache_ttl;		/* Cache entry lifetime (s), 0: off */
+	const char *journal;		/* Offline readings journal file */
+	size_t journal_size;		/* Journal size (octets), 0: off */
+	unsigned int mock_latency;	/* Mock cloud delay (ms) */
+	unsigned int mock_errors;	/* Mock cloud failures (%) */
+	unsigned int rate_limit;	/* PDUs per second per node, 0: off */
+	unsigned int rate_burst;	/* PDUs accepted above 'rate_limit' */
+	unsigned int cloud_inflight;	/* Concurrent cloud calls, 0: off */
 };
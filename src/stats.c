@@ -0,0 +1,291 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2017, CESAR. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the CESAR nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL CESAR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <glib.h>
+
+#include "log.h"
+#include "stats.h"
+
+/* Abstract unix socket namespace */
+#define STATS_SOCKET		"knot-stats"
+#define STATS_KEY_LEN		128
+
+/* Upper bounds of the latency buckets (us), +Inf is implicit */
+static const guint64 buckets[] = {
+	100, 500, 1000, 5000, 10000, 50000, 100000, 500000,
+	1000000, 5000000, 10000000
+};
+
+#define BUCKETS			G_N_ELEMENTS(buckets)
+
+struct series {
+	char *metric;
+	char *labels;
+	gboolean histogram;
+	guint64 value;			/* Counter or observations */
+	guint64 sum;			/* Observed time (us) */
+	guint64 bucket[BUCKETS];	/* Not cumulative */
+};
+
+G_LOCK_DEFINE_STATIC(stats);
+static GHashTable *series_table;	/* "metric{labels}" -> series */
+static unsigned int server_id;
+
+static void series_free(gpointer user_data)
+{
+	struct series *series = user_data;
+
+	g_free(series->metric);
+	g_free(series->labels);
+	g_free(series);
+}
+
+/* Called with the 'stats' lock held */
+static struct series *series_get(const char *metric, const char *labels,
+							gboolean histogram)
+{
+	struct series *series;
+	char key[STATS_KEY_LEN];
+
+	snprintf(key, sizeof(key), "%s{%s}", metric, labels ? labels : "");
+
+	series = g_hash_table_lookup(series_table, key);
+	if (series)
+		return series;
+
+	series = g_new0(struct series, 1);
+	series->metric = g_strdup(metric);
+	series->labels = labels ? g_strdup(labels) : NULL;
+	series->histogram = histogram;
+	g_hash_table_insert(series_table, g_strdup(key), series);
+
+	return series;
+}
+
+void stats_add(const char *metric, const char *labels, guint64 value)
+{
+	struct series *series;
+
+	if (series_table == NULL)
+		return;
+
+	G_LOCK(stats);
+	series = series_get(metric, labels, FALSE);
+	series->value += value;
+	G_UNLOCK(stats);
+}
+
+void stats_observe(const char *metric, const char *labels, gint64 start)
+{
+	struct series *series;
+	guint64 elapsed;
+	unsigned int i;
+
+	if (series_table == NULL)
+		return;
+
+	elapsed = g_get_monotonic_time() - start;
+
+	for (i = 0; i < BUCKETS && elapsed > buckets[i]; i++)
+		;
+
+	G_LOCK(stats);
+	series = series_get(metric, labels, TRUE);
+	series->value++;
+	series->sum += elapsed;
+	if (i < BUCKETS)
+		series->bucket[i]++;
+	G_UNLOCK(stats);
+}
+
+static void series_render(GString *out, const struct series *series)
+{
+	const char *labels = series->labels ? series->labels : "";
+	const char *sep = series->labels ? "," : "";
+	char set[STATS_KEY_LEN] = "";
+	guint64 count = 0;
+	unsigned int i;
+
+	/* Label set of the plain samples: omitted if empty */
+	if (series->labels)
+		snprintf(set, sizeof(set), "{%s}", series->labels);
+
+	if (!series->histogram) {
+		g_string_append_printf(out, "%s%s %" G_GUINT64_FORMAT "\n",
+					series->metric, set, series->value);
+		return;
+	}
+
+	for (i = 0; i < BUCKETS; i++) {
+		count += series->bucket[i];
+		g_string_append_printf(out, "%s_bucket{%s%sle=\"%g\"} %"
+				G_GUINT64_FORMAT "\n", series->metric,
+				labels, sep, buckets[i] / 1000000.0, count);
+	}
+
+	g_string_append_printf(out,
+			"%s_bucket{%s%sle=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+			series->metric, labels, sep, series->value);
+	g_string_append_printf(out, "%s_sum%s %.6f\n", series->metric,
+					set, series->sum / 1000000.0);
+	g_string_append_printf(out, "%s_count%s %" G_GUINT64_FORMAT "\n",
+					series->metric, set, series->value);
+}
+
+/*
+ * Keys are sorted: series of the same metric are adjacent, each metric
+ * gets a single TYPE line.
+ */
+static GString *stats_render(void)
+{
+	const struct series *series;
+	const char *last = NULL;
+	GList *keys, *l;
+	GString *out;
+
+	out = g_string_sized_new(4096);
+
+	G_LOCK(stats);
+
+	keys = g_list_sort(g_hash_table_get_keys(series_table),
+						(GCompareFunc) strcmp);
+	for (l = keys; l; l = g_list_next(l)) {
+		series = g_hash_table_lookup(series_table, l->data);
+
+		if (last == NULL || strcmp(last, series->metric)) {
+			g_string_append_printf(out, "# TYPE %s %s\n",
+				series->metric,
+				series->histogram ? "histogram" : "counter");
+			last = series->metric;
+		}
+
+		series_render(out, series);
+	}
+
+	G_UNLOCK(stats);
+
+	g_list_free(keys);
+
+	return out;
+}
+
+/* One dump per connection, then the client is disconnected */
+static gboolean stats_accept_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct timeval timeout = { 1, 0 };
+	GString *out;
+	ssize_t sent;
+	size_t off;
+	int sock;
+
+	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR))
+		return FALSE;
+
+	sock = accept4(g_io_channel_unix_get_fd(io), NULL, NULL,
+							SOCK_CLOEXEC);
+	if (sock < 0)
+		return TRUE;
+
+	/* Slow readers don't stall the main loop */
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	out = stats_render();
+
+	for (off = 0; off < out->len; off += sent) {
+		sent = send(sock, out->str + off, out->len - off,
+							MSG_NOSIGNAL);
+		if (sent <= 0)
+			break;
+	}
+
+	g_string_free(out, TRUE);
+	close(sock);
+
+	return TRUE;
+}
+
+int stats_start(void)
+{
+	struct sockaddr_un addr;
+	GIOChannel *io;
+	socklen_t len;
+	int sock, err;
+
+	series_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, series_free);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	/* Abstract namespace: first character must be null */
+	strncpy(addr.sun_path + 1, STATS_SOCKET, strlen(STATS_SOCKET));
+
+	/* Name is not padded: socat connects with its exact length */
+	len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(STATS_SOCKET);
+
+	if (bind(sock, (struct sockaddr *) &addr, len) < 0 ||
+						listen(sock, 4) < 0) {
+		err = -errno;
+		log_error("stats socket: %s(%d)", strerror(-err), -err);
+		close(sock);
+		return err;
+	}
+
+	io = g_io_channel_unix_new(sock);
+	g_io_channel_set_close_on_unref(io, TRUE);
+	server_id = g_io_add_watch(io, G_IO_IN | G_IO_ERR | G_IO_HUP |
+					G_IO_NVAL, stats_accept_cb, NULL);
+	g_io_channel_unref(io);
+
+	return 0;
+}
+
+void stats_stop(void)
+{
+	if (server_id)
+		g_source_remove(server_id);
+	server_id = 0;
+
+	if (series_table)
+		g_hash_table_destroy(series_table);
+	series_table = NULL;
+}
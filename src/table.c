@@ -0,0 +1,110 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2017, CESAR. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the CESAR nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL CESAR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "table.h"
+
+#define SENSOR_ID_MAX		256
+#define NO_ENTRY		-1
+
+struct sensor_table {
+	GArray *entries;
+	GDestroyNotify clear_func;
+	int16_t index[SENSOR_ID_MAX];	/* sensor_id -> entries position */
+};
+
+struct sensor_table *sensor_table_new(guint entry_size,
+						GDestroyNotify clear_func)
+{
+	struct sensor_table *table;
+
+	table = g_new(struct sensor_table, 1);
+	table->entries = g_array_new(FALSE, TRUE, entry_size);
+	table->clear_func = clear_func;
+	if (clear_func)
+		g_array_set_clear_func(table->entries, clear_func);
+
+	memset(table->index, 0xff, sizeof(table->index));
+
+	return table;
+}
+
+void sensor_table_free(struct sensor_table *table)
+{
+	if (!table)
+		return;
+
+	g_array_free(table->entries, TRUE);
+	g_free(table);
+}
+
+gpointer sensor_table_lookup(const struct sensor_table *table,
+							uint8_t sensor_id)
+{
+	/* NULL table behaves as an empty one */
+	if (!table || table->index[sensor_id] == NO_ENTRY)
+		return NULL;
+
+	return sensor_table_index(table, table->index[sensor_id]);
+}
+
+/* Copies 'entry', replacing the one of 'sensor_id' if any */
+gpointer sensor_table_insert(struct sensor_table *table, uint8_t sensor_id,
+							gconstpointer entry)
+{
+	gpointer dest;
+
+	dest = sensor_table_lookup(table, sensor_id);
+	if (dest) {
+		if (table->clear_func)
+			table->clear_func(dest);
+
+		memcpy(dest, entry, g_array_get_element_size(table->entries));
+		return dest;
+	}
+
+	table->index[sensor_id] = table->entries->len;
+	g_array_append_vals(table->entries, entry, 1);
+
+	return sensor_table_index(table, table->index[sensor_id]);
+}
+
+guint sensor_table_length(const struct sensor_table *table)
+{
+	return table ? table->entries->len : 0;
+}
+
+gpointer sensor_table_index(const struct sensor_table *table, guint i)
+{
+	return table->entries->data +
+			i * g_array_get_element_size(table->entries);
+}
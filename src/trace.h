@@ -0,0 +1,52 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2017, CESAR. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the CESAR nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL CESAR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * USDT probes of the hot path, provider "knotd". Built with
+ * --enable-tracing, a probe is a single nop until perf or bpftrace
+ * attaches to it:
+ *
+ * pdu_rx(sock, count)			PDUs received from a node
+ * msg_begin(sock, type, len)		msg_process() dispatch
+ * msg_end(sock, type, olen)		reply length or -errno
+ * proto_begin(op)			proto_ops call, eg: "signin"
+ * proto_end(op, usec, err)
+ * poll_fire(slot, started)		http poll wheel tick
+ * fw_push(sock, count)			PDUs pushed to a node
+ */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define TRACE1(name, a)		DTRACE_PROBE1(knotd, name, a)
+#define TRACE2(name, a, b)	DTRACE_PROBE2(knotd, name, a, b)
+#define TRACE3(name, a, b, c)	DTRACE_PROBE3(knotd, name, a, b, c)
+#else
+#define TRACE1(name, a)
+#define TRACE2(name, a, b)
+#define TRACE3(name, a, b, c)
+#endif
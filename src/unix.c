@@ -26,10 +26,13 @@
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 
@@ -98,6 +101,49 @@ static ssize_t unix_send(int sockfd, const void *buffer, size_t len)
 	return send(sockfd, buffer, len, 0);
 }
 
+static int unix_recv_batch(int sockfd, struct iovec *iov, unsigned int vlen)
+{
+	struct mmsghdr msgs[vlen];
+	unsigned int i;
+	int ret;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < vlen; i++) {
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	/* MSG_TRUNC: real length of PDUs that don't fit */
+	ret = recvmmsg(sockfd, msgs, vlen, MSG_DONTWAIT | MSG_TRUNC, NULL);
+	if (ret < 0)
+		return -errno;
+
+	for (i = 0; i < (unsigned int) ret; i++)
+		iov[i].iov_len = msgs[i].msg_len;
+
+	return ret;
+}
+
+static int unix_send_batch(int sockfd, const struct iovec *iov,
+							unsigned int vlen)
+{
+	struct mmsghdr msgs[vlen];
+	unsigned int i;
+	int ret;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < vlen; i++) {
+		msgs[i].msg_hdr.msg_iov = (struct iovec *) &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	ret = sendmmsg(sockfd, msgs, vlen, 0);
+	if (ret < 0)
+		return -errno;
+
+	return ret;
+}
+
 struct node_ops unix_ops = {
 	.name = "Unix",
 	.probe = unix_probe,
@@ -106,5 +152,7 @@ struct node_ops unix_ops = {
 	.listen = unix_listen,
 	.accept = unix_accept,
 	.recv = unix_recv,
-	.send = unix_send
+	.send = unix_send,
+	.recv_batch = unix_recv_batch,
+	.send_batch = unix_send_batch
 };
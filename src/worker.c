@@ -0,0 +1,190 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2017, CESAR. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the CESAR nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL CESAR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+
+#include <glib.h>
+
+#include "log.h"
+#include "worker.h"
+
+struct worker {
+	GThread *thread;
+	GMainContext *context;
+	GMainLoop *loop;
+};
+
+static struct worker *workers;
+static unsigned int nworkers;
+static gboolean running;
+
+static gpointer worker_run(gpointer user_data)
+{
+	struct worker *worker = user_data;
+
+	/* Sources created by the session handlers are attached to it */
+	g_main_context_push_thread_default(worker->context);
+	g_main_loop_run(worker->loop);
+	g_main_context_pop_thread_default(worker->context);
+
+	return NULL;
+}
+
+static void worker_spawn(void)
+{
+	char name[16];
+	unsigned int i;
+
+	for (i = 0; i < nworkers; i++) {
+		snprintf(name, sizeof(name), "worker%u", i);
+		workers[i].thread = g_thread_new(name, worker_run,
+								&workers[i]);
+	}
+
+	running = TRUE;
+
+	log_info("Session workers: %u", nworkers);
+}
+
+/*
+ * Threads are spawned on the first session: knotd may fork while
+ * detaching after the manager starts.
+ */
+int worker_start(unsigned int count)
+{
+	unsigned int i;
+
+	nworkers = count;
+	if (count == 0)
+		return 0;
+
+	workers = g_new0(struct worker, count);
+	for (i = 0; i < count; i++) {
+		workers[i].context = g_main_context_new();
+		workers[i].loop = g_main_loop_new(workers[i].context, FALSE);
+	}
+
+	return 0;
+}
+
+/* Sources attached to the workers stay valid until worker_cleanup() */
+void worker_stop(void)
+{
+	unsigned int i;
+
+	if (!running)
+		return;
+
+	for (i = 0; i < nworkers; i++)
+		g_main_loop_quit(workers[i].loop);
+
+	for (i = 0; i < nworkers; i++) {
+		g_thread_join(workers[i].thread);
+		workers[i].thread = NULL;
+	}
+
+	running = FALSE;
+}
+
+void worker_cleanup(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nworkers; i++) {
+		g_main_loop_unref(workers[i].loop);
+		g_main_context_unref(workers[i].context);
+	}
+
+	g_free(workers);
+	workers = NULL;
+	nworkers = 0;
+}
+
+GMainContext *worker_context(unsigned int key)
+{
+	if (nworkers == 0)
+		return NULL;
+
+	if (!running)
+		worker_spawn();
+
+	return workers[key % nworkers].context;
+}
+
+GMainContext *worker_current(void)
+{
+	/* Only workers push a thread default context */
+	return g_main_context_get_thread_default();
+}
+
+guint worker_io_add_watch(GMainContext *context, GIOChannel *io,
+				GIOCondition cond, GIOFunc func,
+				gpointer user_data, GDestroyNotify notify)
+{
+	GSource *source;
+	guint id;
+
+	source = g_io_create_watch(io, cond);
+	g_source_set_callback(source, (GSourceFunc) (void (*) (void)) func,
+							user_data, notify);
+	id = g_source_attach(source, context);
+	g_source_unref(source);
+
+	return id;
+}
+
+guint worker_timeout_add(GMainContext *context, guint interval,
+				GSourceFunc func, gpointer user_data)
+{
+	GSource *source;
+	guint id;
+
+	source = g_timeout_source_new(interval);
+	g_source_set_callback(source, func, user_data, NULL);
+	id = g_source_attach(source, context);
+	g_source_unref(source);
+
+	return id;
+}
+
+/* Source ids are per context: g_source_remove() only knows the main loop */
+void worker_source_remove(GMainContext *context, guint id)
+{
+	GSource *source;
+
+	source = g_main_context_find_source_by_id(context, id);
+	if (source)
+		g_source_destroy(source);
+}
+
+void worker_invoke(GMainContext *context, GSourceFunc func,
+				gpointer user_data, GDestroyNotify notify)
+{
+	g_main_context_invoke_full(context, G_PRIORITY_DEFAULT, func,
+							user_data, notify);
+}
@@ -0,0 +1,55 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2017, CESAR. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the CESAR nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL CESAR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Optional session engine: node sessions are sharded across worker
+ * threads, each one running its own GMainContext. Sessions, and the
+ * sources created while handling them, belong to a single worker. A NULL
+ * context means the main loop: the engine is disabled or not running.
+ */
+
+int worker_start(unsigned int workers);
+void worker_stop(void);
+void worker_cleanup(void);
+
+/* Worker serving the shard of 'key' */
+GMainContext *worker_context(unsigned int key);
+
+/* Worker running the calling thread, NULL from the main loop */
+GMainContext *worker_current(void);
+
+guint worker_io_add_watch(GMainContext *context, GIOChannel *io,
+				GIOCondition cond, GIOFunc func,
+				gpointer user_data, GDestroyNotify notify);
+guint worker_timeout_add(GMainContext *context, guint interval,
+				GSourceFunc func, gpointer user_data);
+void worker_source_remove(GMainContext *context, guint id);
+
+/* Runs 'func' on 'context' */
+void worker_invoke(GMainContext *context, GSourceFunc func,
+				gpointer user_data, GDestroyNotify notify);
@@ -28,7 +28,11 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
 
 #include <libwebsockets.h>
 
@@ -36,11 +40,17 @@
 
 #include <json-c/json.h>
 
+#include <knot_types.h>
+
 #include "log.h"
+#include "settings.h"
+#include "worker.h"
 #include "proto.h"
+#include "serializer.h"
 
 #define MAX_PAYLOAD		4096
 #define SERVICE_TIMEOUT		100
+#define REQUEST_TIMEOUT		10000	/* ms */
 #define IDENTIFY_REQUEST	"[\"identify\"]"
 #define READY_RESPONSE		"[\"ready\""
 #define NOT_READY_RESPONSE	"[\"notReady\""
@@ -51,40 +61,112 @@
 #define CLOUD_PATH		"/socket.io/?EIO=4&transport=websocket"
 #define DEFAULT_CLOUD_HOST	"localhost"
 #define DEVICE_INDEX		0
-#define OPERATION_PREFIX	420
 #define MESSAGE_PREFIX		42
+#define PING_INTERVAL		10	/* seconds */
+#define PING_SLOTS		(PING_INTERVAL + 1)
 
-struct lws_context *context;
-static GHashTable *wstable;
-static gboolean got_response = FALSE;
-static gboolean connection_error = FALSE;
-static gboolean connected = FALSE;
-static gboolean client_connection_error = FALSE;
-static gboolean ready = FALSE;
-struct lws_client_connect_info info;
+/*
+ * libwebsockets is not thread safe: operations called by the session
+ * workers and the main loop lws service are serialized by 'ws_lock'.
+ * Recursive: watch callbacks may call ws operations. Workers don't hold
+ * it while waiting for the cloud: the main loop services the sockets and
+ * wakes them up through 'ws_cond' after each service.
+ */
+static GRecMutex ws_lock;
+static GMutex wait_lock;
+static GCond ws_cond;
+static guint64 ws_serviced;		/* Protected by 'wait_lock' */
+static struct lws_context *context;
+static GHashTable *wstable;		/* session sock -> psd */
+static GHashTable *uuidtable;		/* device uuid -> psd */
+static GHashTable *conntable;		/* lws sock -> struct ws_conn */
+static GHashTable *pollfds;
+static unsigned int timeout_id;
+static GPtrArray *shared;		/* Connections shared by sessions */
+static unsigned int shared_next = 0;
+static GString *txbuf;			/* Outgoing event buffer */
+static unsigned int cloud_conns = 0;	/* 0: one connection per session */
 static char *host_address = "localhost";
 static int host_port = 3000;
-static GSList *wsis = NULL;
-static gint conn_index = 0;
+
+/*
+ * Ping timer wheel: one slot per second, connections are stored at the
+ * slot of their ping deadline. Each tick only visits the expiring slot.
+ */
+static GQueue ping_wheel[PING_SLOTS];
+static gint64 ping_last;		/* Last expired second */
 
 /* Struct used to fetch data from cloud and send to THING */
 struct to_fetch {
 	int proto_sock;
 	void *user_data;
 	void (*watch_cb)(json_raw_t, void *);
+	GMainContext *context;		/* Watching worker, NULL: main loop */
 };
 
-struct per_session_data_ws {
-	gint index;
+/* Config message handed over to the worker of the session */
+struct ws_config {
+	int sock;
+	json_object *root;		/* Parsed message, owns 'jobj' */
+	json_object *jobj;
+};
+
+/* Outgoing message waiting for LWS_CALLBACK_CLIENT_WRITEABLE */
+struct ws_frame {
+	size_t len;
 	/*
-	 * This buffer MUST have LWS_PRE bytes valid BEFORE the pointer. this
+	 * This buffer MUST have LWS_PRE bytes valid BEFORE the payload. this
 	 * is defined in the lws documentation,
 	 */
-	unsigned char buffer[LWS_PRE + MAX_PAYLOAD];
-	unsigned int len;
+	unsigned char buffer[];
+};
+
+/*
+ * Pending request: socket.io acknowledges an event sent as 42<id>[...]
+ * with 43<id>[...], this id is the key to find who is waiting for it.
+ */
+struct ws_request {
+	unsigned int id;
+	gboolean done;
+	int err;
 	char *json;
+};
+
+/* Websocket connection to the cloud, it may carry many sessions */
+struct ws_conn {
+	struct lws *wsi;		/* NULL once closed */
+	int sock;
+	unsigned int refs;
+	gboolean shared;
+	GQueue *txq;			/* struct ws_frame */
+	GHashTable *requests;		/* ack id -> struct ws_request */
+	unsigned int ack_id;
+	struct ws_request *signin;	/* Waiting "ready" or "notReady" */
+	gboolean connected;
+	gboolean error;
+	gint64 ping_at;			/* Next ping deadline (s) */
+	unsigned int ping_slot;
+	GList *ping_link;		/* Entry at ping_wheel[ping_slot] */
+};
+
+/*
+ * The manager only sees 'sock', one end of a socketpair: the other end
+ * is closed to report a cloud disconnection, since the websocket itself
+ * may be shared with other sessions.
+ */
+struct per_session_data_ws {
+	int sock;
+	int peer;
+	struct ws_conn *conn;
+	char *uuid;
 	struct to_fetch data;
-	struct timeval interval;
+};
+
+/* lws socket watched by the GLib main loop */
+struct ws_pollfd {
+	int fd;
+	int events;
+	guint watch_id;
 };
 
 /*
@@ -101,6 +183,17 @@ enum packet_type {
 	EIO_NOOP
 };
 
+/* Packet types defined by Socket.IO, carried by EIO_MSG */
+enum sio_packet_type {
+	SIO_CONNECT,
+	SIO_DISCONNECT,
+	SIO_EVENT,
+	SIO_ACK,
+	SIO_ERROR,
+	SIO_BINARY_EVENT,
+	SIO_BINARY_ACK
+};
+
 struct handshake_data {
 	const char *sid;
 	int pingInterval;
@@ -108,54 +201,427 @@ struct handshake_data {
 };
 
 static struct handshake_data *h_data;
-static struct per_session_data_ws *psd;
 
-static void send_ping(gpointer key, gpointer value, gpointer user_data)
+static gint64 now_sec(void)
 {
-	struct timeval *timenow = user_data;
-	GSList *entry;
-	struct lws *ws;
+	return g_get_monotonic_time() / G_USEC_PER_SEC;
+}
+
+static void ping_schedule(struct ws_conn *conn)
+{
+	unsigned int slot = conn->ping_at % PING_SLOTS;
+
+	if (conn->ping_link && conn->ping_slot == slot)
+		return;
+
+	if (conn->ping_link == NULL) {
+		conn->ping_link = g_list_alloc();
+		conn->ping_link->data = conn;
+	} else {
+		g_queue_unlink(&ping_wheel[conn->ping_slot],
+							conn->ping_link);
+	}
+
+	conn->ping_slot = slot;
+	g_queue_push_tail_link(&ping_wheel[conn->ping_slot],
+							conn->ping_link);
+}
+
+static void ping_cancel(struct ws_conn *conn)
+{
+	if (conn->ping_link == NULL)
+		return;
+
+	g_queue_unlink(&ping_wheel[conn->ping_slot], conn->ping_link);
+	g_list_free_1(conn->ping_link);
+	conn->ping_link = NULL;
+}
+
+static struct ws_conn *wsi_conn(struct lws *wsi)
+{
+	return g_hash_table_lookup(conntable,
+				GINT_TO_POINTER(lws_get_socket_fd(wsi)));
+}
+
+static gboolean conn_match_wsi(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	struct ws_conn *conn = value;
+
+	return conn->wsi == user_data;
+}
+
+static void request_free(gpointer user_data)
+{
+	struct ws_request *req = user_data;
+
+	g_free(req->json);
+	g_free(req);
+}
+
+static void conn_detach(struct ws_conn *conn)
+{
+	gpointer key;
+
+	conn->wsi = NULL;
+	ping_cancel(conn);
+
+	if (conn->shared) {
+		g_ptr_array_remove(shared, conn);
+		conn->shared = FALSE;
+	}
+
+	/* The socket number may be already reused by other connection */
+	key = GINT_TO_POINTER(conn->sock);
+	if (g_hash_table_lookup(conntable, key) == conn)
+		g_hash_table_remove(conntable, key);
+}
+
+static void conn_free(struct ws_conn *conn)
+{
+	struct lws *wsi;
+
+	wsi = conn->wsi;
+	if (wsi)
+		lws_set_timeout(wsi, PENDING_TIMEOUT_CLOSE_SEND,
+							LWS_TO_KILL_ASYNC);
+
+	conn_detach(conn);
+
+	g_queue_free_full(conn->txq, g_free);
+	g_hash_table_destroy(conn->requests);
+	g_free(conn);
+}
+
+static void conn_unref(struct ws_conn *conn)
+{
+	if (--conn->refs > 0 || conn->shared)
+		return;
+
+	conn_free(conn);
+}
+
+static struct per_session_data_ws *session_get(int sock)
+{
+	return g_hash_table_lookup(wstable, GINT_TO_POINTER(sock));
+}
+
+static void session_set_uuid(struct per_session_data_ws *psd,
+							const char *uuid)
+{
+	if (psd->uuid && g_hash_table_lookup(uuidtable, psd->uuid) == psd)
+		g_hash_table_remove(uuidtable, psd->uuid);
+
+	g_free(psd->uuid);
+	psd->uuid = g_strdup(uuid);
+	g_hash_table_replace(uuidtable, psd->uuid, psd);
+}
+
+static void session_free(struct per_session_data_ws *psd)
+{
+	if (psd->uuid && g_hash_table_lookup(uuidtable, psd->uuid) == psd)
+		g_hash_table_remove(uuidtable, psd->uuid);
+
+	if (psd->peer >= 0)
+		close(psd->peer);
+
+	conn_unref(psd->conn);
+	g_free(psd->uuid);
+	g_free(psd);
+}
+
+/* Main loop: acks and events may have completed worker requests */
+static void ws_wakeup(void)
+{
+	g_mutex_lock(&wait_lock);
+	ws_serviced++;
+	g_cond_broadcast(&ws_cond);
+	g_mutex_unlock(&wait_lock);
+}
+
+/*
+ * Worker side of ws_wait(): called with 'ws_lock' held once, it is
+ * released until the main loop services the sockets again.
+ */
+static int ws_wait_serviced(struct ws_conn *conn, const gboolean *done,
+							gint64 deadline)
+{
+	guint64 serviced;
+	gboolean expired = FALSE;
+
+	while (!*done && !conn->error) {
+		if (expired)
+			return -ETIMEDOUT;
 
-	psd = (struct per_session_data_ws *) value;
-	if (timenow->tv_sec - psd->interval.tv_sec > 10) {
-		gettimeofday(&psd->interval, NULL);
-		g_hash_table_replace(wstable, key, psd);
-		/* Send EIO_PING and expects EIO_PONG */
-		psd->len = snprintf((char *) psd->buffer + LWS_PRE,
-						MAX_PAYLOAD, "%d", EIO_PING);
+		/* Flags are set under 'ws_lock', before ws_wakeup() */
+		g_mutex_lock(&wait_lock);
+		serviced = ws_serviced;
+		g_rec_mutex_unlock(&ws_lock);
 
-		entry = g_slist_nth(wsis, psd->index);
-		ws = entry->data;
+		while (ws_serviced == serviced && !expired)
+			expired = !g_cond_wait_until(&ws_cond, &wait_lock,
+								deadline);
 
-		lws_callback_on_writable(ws);
-		lws_service(context, SERVICE_TIMEOUT);
+		g_mutex_unlock(&wait_lock);
+		g_rec_mutex_lock(&ws_lock);
 	}
+
+	return conn->error ? -ECONNRESET : 0;
+}
+
+static GIOCondition poll_to_cond(int events)
+{
+	GIOCondition cond = G_IO_ERR | G_IO_HUP | G_IO_NVAL;
+
+	if (events & POLLIN)
+		cond |= G_IO_IN;
+	if (events & POLLOUT)
+		cond |= G_IO_OUT;
+
+	return cond;
+}
+
+static gboolean pollfd_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct ws_pollfd *wpfd = user_data;
+	struct pollfd pfd;
+
+	pfd.fd = wpfd->fd;
+	pfd.events = wpfd->events;
+	pfd.revents = 0;
+
+	if (cond & G_IO_IN)
+		pfd.revents |= POLLIN;
+	if (cond & G_IO_OUT)
+		pfd.revents |= POLLOUT;
+	if (cond & G_IO_ERR)
+		pfd.revents |= POLLERR;
+	if (cond & G_IO_HUP)
+		pfd.revents |= POLLHUP;
+	if (cond & G_IO_NVAL)
+		pfd.revents |= POLLNVAL;
+
+	/* May remove or re-arm this watch through the *_POLL_FD callbacks */
+	g_rec_mutex_lock(&ws_lock);
+	lws_service_fd(context, &pfd);
+	g_rec_mutex_unlock(&ws_lock);
+
+	ws_wakeup();
+
+	return TRUE;
+}
+
+static void pollfd_watch(struct ws_pollfd *wpfd)
+{
+	GIOChannel *io;
+
+	io = g_io_channel_unix_new(wpfd->fd);
+	wpfd->watch_id = g_io_add_watch(io, poll_to_cond(wpfd->events),
+							pollfd_cb, wpfd);
+	g_io_channel_unref(io);
+}
+
+static void pollfd_free(gpointer user_data)
+{
+	struct ws_pollfd *wpfd = user_data;
+
+	g_source_remove(wpfd->watch_id);
+	g_free(wpfd);
+}
+
+static void pollfd_add(int fd, int events)
+{
+	struct ws_pollfd *wpfd;
+
+	wpfd = g_new0(struct ws_pollfd, 1);
+	wpfd->fd = fd;
+	wpfd->events = events;
+	pollfd_watch(wpfd);
+
+	g_hash_table_replace(pollfds, GINT_TO_POINTER(fd), wpfd);
+}
+
+static void pollfd_change(int fd, int events)
+{
+	struct ws_pollfd *wpfd;
+
+	wpfd = g_hash_table_lookup(pollfds, GINT_TO_POINTER(fd));
+	if (!wpfd || wpfd->events == events)
+		return;
+
+	g_source_remove(wpfd->watch_id);
+	wpfd->events = events;
+	pollfd_watch(wpfd);
+}
+
+/*
+ * Wait until 'done' is set by LWS_CALLBACK_CLIENT_RECEIVE or the
+ * connection fails. knotd operations on msg.c expect a blocking behavior:
+ * this is not a callback based completion, it only avoids spinning.
+ * Workers sleep until the main loop service delivers the ack. Without
+ * workers, only this socket is polled here: messages of other connections
+ * stay queued until the main loop dispatches their own watches.
+ */
+static int ws_wait(struct ws_conn *conn, const gboolean *done)
+{
+	struct ws_pollfd *wpfd;
+	struct pollfd pfd;
+	gint64 deadline;
+	int timeout;
+
+	deadline = g_get_monotonic_time() + REQUEST_TIMEOUT * 1000;
+
+	/* Session workers: the main loop keeps serving every connection */
+	if (worker_current())
+		return ws_wait_serviced(conn, done, deadline);
+
+	while (!*done && !conn->error) {
+		timeout = (deadline - g_get_monotonic_time()) / 1000;
+		if (timeout <= 0)
+			return -ETIMEDOUT;
+
+		timeout = MIN(timeout, SERVICE_TIMEOUT);
+
+		pfd.fd = conn->sock;
+		wpfd = g_hash_table_lookup(pollfds, GINT_TO_POINTER(pfd.fd));
+		if (wpfd == NULL) {
+			/* Not registered yet: let lws poll its own table */
+			lws_service(context, timeout);
+			continue;
+		}
+
+		pfd.events = wpfd->events;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		/* NULL pollfd allows lws to check its timeouts only */
+		lws_service_fd(context, pfd.revents ? &pfd : NULL);
+	}
+
+	return conn->error ? -ECONNRESET : 0;
+}
+
+static int ws_queue(struct ws_conn *conn, const char *format, ...)
+					G_GNUC_PRINTF(2, 3);
+
+static int ws_queue(struct ws_conn *conn, const char *format, ...)
+{
+	struct ws_frame *frame;
+	struct lws *wsi;
+	va_list args;
+	int len;
+
+	wsi = conn->wsi;
+	if (wsi == NULL || conn->error)
+		return -ECONNRESET;
+
+	frame = g_malloc(sizeof(*frame) + LWS_PRE + MAX_PAYLOAD);
+
+	va_start(args, format);
+	len = vsnprintf((char *) frame->buffer + LWS_PRE, MAX_PAYLOAD,
+								format, args);
+	va_end(args);
+
+	if (len < 0 || len >= MAX_PAYLOAD) {
+		log_error("Message too long (%d)", len);
+		g_free(frame);
+		return -EMSGSIZE;
+	}
+
+	frame->len = len;
+	g_queue_push_tail(conn->txq, frame);
+
+	/*
+	 * lws_callback_on_writable tells libwebsockets there is data to be sent
+	 * As soon as possible LWS_CALLBACK_CLIENT_WRITEABLE will be triggered
+	 * and the queued frames will be written.
+	 */
+	lws_callback_on_writable(wsi);
+
+	return 0;
+}
+
+static struct ws_request *request_new(struct ws_conn *conn)
+{
+	struct ws_request *req;
+
+	req = g_new0(struct ws_request, 1);
+	req->id = conn->ack_id++;
+	g_hash_table_insert(conn->requests, GUINT_TO_POINTER(req->id), req);
+
+	return req;
+}
+
+static void request_remove(struct ws_conn *conn, struct ws_request *req)
+{
+	if (conn->signin == req)
+		conn->signin = NULL;
+
+	g_hash_table_remove(conn->requests, GUINT_TO_POINTER(req->id));
+}
+
+/*
+ * Writes only push the deadline forward: connections found at a slot
+ * before their deadline are moved to the right slot then.
+ */
+static void ping_expire(gint64 now)
+{
+	struct ws_conn *conn;
+	GList *l, *next;
+	GQueue *slot;
+	gint64 sec;
+
+	/* Late ticks: every skipped slot, at most one whole turn */
+	sec = MAX(ping_last + 1, now - PING_SLOTS + 1);
+	for (; sec <= now; sec++) {
+		slot = &ping_wheel[sec % PING_SLOTS];
+		for (l = slot->head; l; l = next) {
+			next = l->next;
+			conn = l->data;
+
+			if (conn->ping_at <= now) {
+				conn->ping_at = now + PING_INTERVAL;
+				/* Send EIO_PING and expects EIO_PONG */
+				ws_queue(conn, "%d", EIO_PING);
+			}
+
+			ping_schedule(conn);
+		}
+	}
+
+	ping_last = now;
 }
 
 static gboolean timeout_ws(gpointer user_data)
 {
-	struct per_session_data_ws *old_psd = psd;
-	struct timeval timenow;
+	g_rec_mutex_lock(&ws_lock);
+	/* Socket events are served by the pollfds watches */
+	lws_service_fd(context, NULL);
+	ping_expire(now_sec());
+	g_rec_mutex_unlock(&ws_lock);
+
+	/* lws timeouts may have closed connections */
+	ws_wakeup();
 
-	gettimeofday(&timenow, NULL);
-	lws_service(context, SERVICE_TIMEOUT);
-	/* check if some socket needs to send ping */
-	g_hash_table_foreach(wstable, send_ping, &timenow);
-	psd = old_psd;
 	return TRUE;
 }
 
-static int handle_response(json_raw_t *json)
+static int handle_response(const char *resp, json_raw_t *json)
 {
 	size_t realsize;
 	json_object *jobj, *jres, *jprop, *jschema, *jschema_val;
 	int has_schema;
 	const char *jobjstringres;
 
-	jres = json_tokener_parse(psd->json);
+	jres = json_tokener_parse(resp);
 	if (jres == NULL)
 		return -EINVAL;
-
 	jobj = json_object_array_get_idx(jres, DEVICE_INDEX);
 	/* Try to find device information inside the returned json */
 	json_object_object_get_ex(jobj, "device", &jprop);
@@ -219,30 +685,58 @@ done:
 
 static void ws_close(int sock)
 {
-	GSList *entry;
-	struct lws *ws;
+	struct per_session_data_ws *psd;
 
 	/*
 	 * When a thing disconnects the close callback is called. Then we
-	 * find its alloted resources at the 'wstable' and 'wsis' list
-	 * and free them.
+	 * find its alloted resources at the 'wstable' and release its
+	 * reference to the cloud connection.
 	 */
-	psd = g_hash_table_lookup(wstable, GINT_TO_POINTER(sock));
+	psd = session_get(sock);
+	if (!psd) {
+		log_error("Removing key: sock %d not found!", sock);
+		return;
+	}
 
-	entry = g_slist_nth(wsis, psd->index);
-	ws = entry->data;
-	lws_callback_on_writable(ws);
-	lws_service(context, SERVICE_TIMEOUT);
+	g_hash_table_remove(wstable, GINT_TO_POINTER(sock));
+	session_free(psd);
+}
 
-	if (g_slist_remove(wsis, &psd->index) == NULL)
-		log_error("Removing wsi: no wsi found for sock %d", sock);
+/*
+ * Send 'jobjstring' as a socket.io event and wait for its acknowledgement.
+ * If 'json' is not NULL the acknowledgement payload is parsed into it.
+ */
+static int ws_call(int sock, const char *jobjstring, json_raw_t *json)
+{
+	struct per_session_data_ws *psd;
+	struct ws_request *req;
+	struct ws_conn *conn;
+	int err;
 
-	if (!g_hash_table_remove(wstable, GINT_TO_POINTER(sock))) {
-		log_error("Removing key: sock %d not found!", sock);
-		return;
+	psd = session_get(sock);
+	if (psd == NULL) {
+		log_error("Not found");
+		return -EBADF;
 	}
-	g_free(psd->json);
-	g_free(psd);
+
+	conn = psd->conn;
+	req = request_new(conn);
+
+	log_dbg("JSON TX: %s", jobjstring);
+	err = ws_queue(conn, "%d%u%s", MESSAGE_PREFIX, req->id, jobjstring);
+	if (err < 0)
+		goto done;
+
+	err = ws_wait(conn, &req->done);
+	if (err < 0)
+		goto done;
+
+	if (json)
+		err = handle_response(req->json, json);
+done:
+	request_remove(conn, req);
+
+	return err;
 }
 
 static int ws_mknode(int sock, const char *device_json, json_raw_t *json)
@@ -250,7 +744,6 @@ static int ws_mknode(int sock, const char *device_json, json_raw_t *json)
 	int err;
 	json_object *jobj, *jarray;
 	const char *jobjstring;
-	GSList *entry;
 
 	jobj = json_tokener_parse(device_json);
 	if (jobj == NULL)
@@ -261,49 +754,7 @@ static int ws_mknode(int sock, const char *device_json, json_raw_t *json)
 	json_object_array_add(jarray, jobj);
 	jobjstring = json_object_to_json_string(jarray);
 
-	psd = g_hash_table_lookup(wstable, GINT_TO_POINTER(sock));
-	entry = g_slist_nth(wsis, psd->index);
-
-	if (entry->data == NULL) {
-		err = -EBADF;
-		log_error("Not found");
-		goto done;
-	}
-	/*
-	 * Since the size of psd->buffer is LWS_PRE + MAX_PAYLOAD bytes and the
-	 * buffer is offset by LWS_PRE, this means there are only MAX_PAYLOAD
-	 * bytes left to write.
-	 */
-	psd->len = snprintf((char *) psd->buffer + LWS_PRE, MAX_PAYLOAD,
-					"%d%s", OPERATION_PREFIX, jobjstring);
-	/*
-	 * lws_callback_on_writable tells libwebsockets there is data to be sent
-	 * As soon as possible LWS_CALLBACK_CLIENT_WRITEABLE will be triggered
-	 * and psd->buffer will be written. Meanwhile, lws_service keeps the
-	 * context 'alive' until server responds or an error occurs. Since knotd
-	 * wasn't designed to be completely asynchronous, the operations on
-	 * msg.c expects a blocking behavior, so this while forces it. Every
-	 * message received will trigger a LWS_CALLBACK_CLIENT_RECEIVE. Once
-	 * the server responds, the got_response flag will be set to TRUE and
-	 * we leave the loop. Since all messages are serialized by the unix
-	 * socket between radio daemon (eg: nrfd, lorad) and knotd, there is no
-	 * problem in using a global 'per session data (psd)' and flags, they
-	 * won't be overwritten.
-	 */
-	lws_callback_on_writable(entry->data);
-	log_info("JSON TX: %s", jobjstring);
-	while (!got_response && !connection_error)
-		lws_service(context, SERVICE_TIMEOUT);
-
-	if (connection_error)
-		err = -ECONNRESET;
-
-	err = handle_response(json);
-	if (err < 0)
-		goto done;
-done:
-	connection_error = FALSE;
-	got_response = FALSE;
+	err = ws_call(sock, jobjstring, json);
 
 	json_object_put(jarray);
 
@@ -316,7 +767,6 @@ static int ws_device(int sock, const char *uuid,
 	int err;
 	const char *jobjstring;
 	json_object *jobj, *jarray;
-	GSList *entry;
 
 	jobj = json_object_new_object();
 	jarray = json_object_new_array();
@@ -328,6 +778,10 @@ static int ws_device(int sock, const char *uuid,
 	}
 
 	json_object_object_add(jobj, "uuid", json_object_new_string(uuid));
+	/* A shared connection is not identified as the device */
+	if (cloud_conns)
+		json_object_object_add(jobj, "token",
+					json_object_new_string(token));
 
 	json_object_array_add(jarray,
 	json_object_new_string("device"));
@@ -335,34 +789,9 @@ static int ws_device(int sock, const char *uuid,
 
 	jobjstring = json_object_to_json_string(jarray);
 
-	log_info("TX JSON %s", jobjstring);
-
-	psd = g_hash_table_lookup(wstable, GINT_TO_POINTER(sock));
-	entry = g_slist_nth(wsis, psd->index);
-
-	if (entry->data == NULL) {
-		log_error("Not found");
-		err = -EBADF;
-		goto done;
-	}
-
-	psd->len = snprintf((char *)&psd->buffer + LWS_PRE, MAX_PAYLOAD, "%d%s",
-						OPERATION_PREFIX, jobjstring);
-	lws_callback_on_writable(entry->data);
-
-	while (!got_response && !connection_error)
-		lws_service(context, SERVICE_TIMEOUT);
-
-	if (connection_error) {
+	err = ws_call(sock, jobjstring, json);
+	if (err == -ECONNRESET)
 		err = -ECONNREFUSED;
-		goto done;
-	}
-
-	err = handle_response(json);
-
-done:
-	got_response = FALSE;
-	connection_error = FALSE;
 
 	json_object_put(jarray);
 
@@ -375,7 +804,9 @@ static int ws_signin(int sock, const char *uuid, const char *token,
 	int err;
 	const char *jobjstring;
 	json_object *jobj, *jarray;
-	GSList *entry;
+	struct per_session_data_ws *psd;
+	struct ws_request *req;
+	struct ws_conn *conn;
 
 	jobj = json_object_new_object();
 	jarray = json_object_new_array();
@@ -389,43 +820,55 @@ static int ws_signin(int sock, const char *uuid, const char *token,
 	json_object_object_add(jobj, "uuid", json_object_new_string(uuid));
 	json_object_object_add(jobj, "token", json_object_new_string(token));
 
-	json_object_array_add(jarray,
-	json_object_new_string("identity"));
+	/*
+	 * Identity authenticates the whole websocket as the device, on a
+	 * shared connection the device is subscribed instead: its config
+	 * messages are routed to this session by uuid.
+	 */
+	json_object_array_add(jarray, json_object_new_string(cloud_conns ?
+						"subscribe" : "identity"));
 	json_object_array_add(jarray, jobj);
 
 	jobjstring = json_object_to_json_string(jarray);
 
-	log_info("TX JSON %s", jobjstring);
+	log_dbg("TX JSON %s", jobjstring);
 
-	psd = g_hash_table_lookup(wstable, GINT_TO_POINTER(sock));
-	entry = g_slist_nth(wsis, psd->index);
-
-	if (entry->data == NULL) {
+	psd = session_get(sock);
+	if (psd == NULL) {
 		log_error("Not found");
 		err = -EBADF;
 		goto done;
 	}
 
-	psd->len = snprintf((char *)&psd->buffer + LWS_PRE, MAX_PAYLOAD, "%d%s",
-					OPERATION_PREFIX, jobjstring);
-	lws_callback_on_writable(entry->data);
+	conn = psd->conn;
+
+	if (cloud_conns) {
+		err = ws_call(sock, jobjstring, NULL);
+	} else {
+		/* Server answers identity with a "ready" or "notReady" event */
+		req = request_new(conn);
+		conn->signin = req;
 
-	/* Keep serving context until server responds or an error occurs */
-	while (!ready && !connection_error)
-		lws_service(context, SERVICE_TIMEOUT);
+		err = ws_queue(conn, "%d%u%s", MESSAGE_PREFIX, req->id,
+								jobjstring);
+		if (err == 0)
+			err = ws_wait(conn, &req->done);
+		if (err == 0)
+			err = req->err;
 
+		request_remove(conn, req);
+	}
 
-	if (connection_error) {
+	if (err < 0) {
 		err = -ECONNREFUSED;
 		goto done;
 	}
 
+	session_set_uuid(psd, uuid);
+
 	err = ws_device(sock, uuid, token, json);
 
 done:
-	ready = FALSE;
-	connection_error = FALSE;
-
 	json_object_put(jarray);
 
 	return err;
@@ -437,7 +880,6 @@ static int ws_rmnode(int sock, const char *uuid, const char *token,
 	int err;
 	const char *jobjstring;
 	json_object *jobj, *jarray;
-	GSList *entry;
 
 	jobj = json_object_new_object();
 	jarray = json_object_new_array();
@@ -450,164 +892,201 @@ static int ws_rmnode(int sock, const char *uuid, const char *token,
 	json_object_object_add(jobj, "uuid", json_object_new_string(uuid));
 	json_object_object_add(jobj, "token", json_object_new_string(token));
 
-	jobjstring = json_object_to_json_string(jobj);
-
 	json_object_array_add(jarray, json_object_new_string("unregister"));
 	json_object_array_add(jarray, jobj);
 
 	jobjstring = json_object_to_json_string(jarray);
 
-	log_info("TX JSON %s", jobjstring);
+	err = ws_call(sock, jobjstring, json);
 
-	psd = g_hash_table_lookup(wstable, GINT_TO_POINTER(sock));
-	entry = g_slist_nth(wsis, psd->index);
+	json_object_put(jarray);
 
-	if (entry->data == NULL) {
-		log_error("Not found");
-		err = -EBADF;
-		goto done;
-	}
+	return err;
+}
 
-	psd->len = snprintf((char *) psd->buffer + LWS_PRE, MAX_PAYLOAD,
-					"%d%s", OPERATION_PREFIX, jobjstring);
-	lws_callback_on_writable(entry->data);
+static int ws_update(int sock, const char *uuid, const char *token,
+					const char *jreq, json_raw_t *json)
+{
+	int err;
+	struct per_session_data_ws *psd;
 
-	/*
-	 * Execution is blocked until server responds or and error occurs
-	 * lws_service makes sure libwebsockets keeps doing its job.
-	 */
-	while (!got_response && !connection_error)
-		lws_service(context, SERVICE_TIMEOUT);
+	psd = session_get(sock);
+	if (psd == NULL) {
+		log_error("Not found");
+		return -EBADF;
+	}
 
-	if (connection_error)
-		err = -ECONNRESET;
+	g_string_truncate(txbuf, 0);
+	err = serializer_event(txbuf, "update", jreq, uuid,
+						cloud_conns ? token : NULL);
+	if (err < 0)
+		return err;
 
-	err = handle_response(json);
+	log_dbg("JSON TX: %s", txbuf->str);
 
+	/* No acknowledgement: the frame is flushed by the main loop */
+	err = ws_queue(psd->conn, "%d%s", MESSAGE_PREFIX, txbuf->str);
 	if (err < 0)
-		goto done;
-done:
-	got_response = FALSE;
-	connection_error = FALSE;
-
-	json_object_put(jarray);
+		err = -ECONNREFUSED;
 
 	return err;
 }
 
-static int ws_update(int sock, const char *uuid, const char *token,
+static int ws_data(int sock, const char *uuid, const char *token,
 					const char *jreq, json_raw_t *json)
 {
 	int err;
-	struct json_object *jobj, *jarray;
-	const char *jobjstr;
-	GSList *entry;
-
-	jobj = json_tokener_parse(jreq);
-	if (jobj == NULL)
-		return -EINVAL;
 
-	jarray = json_object_new_array();
-
-	json_object_array_add(jarray, json_object_new_string("update"));
-	json_object_object_add(jobj, "uuid", json_object_new_string(uuid));
+	g_string_truncate(txbuf, 0);
+	err = serializer_event(txbuf, "data", jreq, uuid, token);
+	if (err < 0)
+		return err;
 
-	json_object_array_add(jarray, jobj);
-	jobjstr = json_object_to_json_string(jarray);
+	return ws_call(sock, txbuf->str, NULL);
+}
 
-	psd = g_hash_table_lookup(wstable, GINT_TO_POINTER(sock));
-	entry = g_slist_nth(wsis, psd->index);
-	if (entry->data == NULL) {
-		log_error("Not found");
-		err = -EBADF;
-		goto done;
-	}
-	psd->len = snprintf((char *)&psd->buffer + LWS_PRE, MAX_PAYLOAD, "%d%s",
-						MESSAGE_PREFIX, jobjstr);
-	lws_callback_on_writable(entry->data);
+static gboolean config_deliver(gpointer user_data)
+{
+	struct ws_config *config = user_data;
+	struct per_session_data_ws *psd;
+	json_raw_t json;
+	void (*watch_cb)(json_raw_t, void *) = NULL;
+	void *watch_data = NULL;
 
-	log_info("JSON TX: %s", jobjstr);
+	memset(&json, 0, sizeof(json_raw_t));
+	json.jobj = config->jobj;
 
-	lws_service(context, SERVICE_TIMEOUT);
+	g_rec_mutex_lock(&ws_lock);
 
-	if (connection_error) {
-		err = -ECONNREFUSED;
-		goto done;
+	/* Session may be closed meanwhile */
+	psd = session_get(config->sock);
+	if (psd) {
+		watch_cb = psd->data.watch_cb;
+		watch_data = psd->data.user_data;
 	}
 
-	err = 0;
+	g_rec_mutex_unlock(&ws_lock);
 
-done:
-	got_response = FALSE;
-	connection_error = FALSE;
-	json_object_put(jarray);
+	/*
+	 * Not locked: ws_wait() must release 'ws_lock' entirely. The
+	 * session is closed by this worker only.
+	 */
+	if (watch_cb)
+		watch_cb(json, watch_data);
 
-	return err;
+	json_object_put(config->root);
+	g_free(config);
+
+	return FALSE;
 }
 
-static int ws_data(int sock, const char *uuid, const char *token,
-					const char *jreq, json_raw_t *json)
+static void handle_config(const char *resp)
 {
-	int err;
-	struct json_object *jobj, *jmsg;
-	const char *jobjstr;
-	GSList *entry;
+	struct ws_config *config;
+	json_raw_t json;
+	json_object *jobj, *jres, *juuid;
+	struct per_session_data_ws *psd;
 
-	jobj = json_tokener_parse(jreq);
-	if (jobj == NULL)
-		return -EINVAL;
+	memset(&json, 0, sizeof(json_raw_t));
 
-	jmsg = json_object_new_array();
-	json_object_array_add(jmsg, json_object_new_string("data"));
-	json_object_object_add(jobj, "uuid", json_object_new_string(uuid));
-	json_object_object_add(jobj, "token", json_object_new_string(token));
-	json_object_array_add(jmsg, jobj);
-	jobjstr = json_object_to_json_string(jmsg);
+	jres = json_tokener_parse(resp);
+	if (jres == NULL)
+		return;
 
-	psd = g_hash_table_lookup(wstable, GINT_TO_POINTER(sock));
+	jobj = json_object_array_get_idx(jres, 1);
 
-	entry = g_slist_nth(wsis, psd->index);
-	if (entry->data == NULL) {
-		log_error("Not found");
-		err = -EBADF;
+	/* Config messages of every device may share the same connection */
+	if (!json_object_object_get_ex(jobj, "uuid", &juuid))
+		goto done;
+
+	psd = g_hash_table_lookup(uuidtable, json_object_get_string(juuid));
+	if (psd == NULL)
 		goto done;
+
+	/* Session served by a worker: json-c objects move with the message */
+	if (psd->data.context) {
+		config = g_new0(struct ws_config, 1);
+		config->sock = psd->sock;
+		config->root = jres;
+		config->jobj = jobj;
+		worker_invoke(psd->data.context, config_deliver, config, NULL);
+		return;
 	}
-	psd->len = snprintf((char *)&psd->buffer + LWS_PRE, MAX_PAYLOAD, "%d%s",
-						OPERATION_PREFIX, jobjstr);
-	lws_callback_on_writable(entry->data);
-	err = 0;
 
-	while (!got_response && !connection_error)
-		lws_service(context, SERVICE_TIMEOUT);
+	/* Already decoded: msg.c doesn't parse the config again */
+	json.jobj = jobj;
+
+	if (psd->data.watch_cb)
+		psd->data.watch_cb(json, psd->data.user_data);
 
 done:
-	got_response = FALSE;
-	connection_error = FALSE;
+	json_object_put(jres);
+}
 
-	json_object_put(jmsg);
+static void handle_ack(struct ws_conn *conn, unsigned int id,
+							const char *resp)
+{
+	struct ws_request *req;
 
-	return err;
+	req = g_hash_table_lookup(conn->requests, GUINT_TO_POINTER(id));
+	if (req == NULL) {
+		log_error("Unexpected ack %u", id);
+		return;
+	}
+
+	g_free(req->json);
+	req->json = g_strdup(resp);
+	req->done = TRUE;
+}
+
+static void handle_event(struct ws_conn *conn, const char *resp)
+{
+	if (!strcmp(resp, IDENTIFY_REQUEST))
+		conn->connected = TRUE;
+	else if (!strncmp(resp, READY_RESPONSE, READY_RESPONSE_LEN)) {
+		if (conn->signin)
+			conn->signin->done = TRUE;
+	} else if (!strncmp(resp, NOT_READY_RESPONSE,
+					NOT_READY_RESPONSE_LEN)) {
+		if (conn->signin) {
+			conn->signin->err = -ECONNREFUSED;
+			conn->signin->done = TRUE;
+		}
+	/*
+	 * Every time a device is updated a CONFIG_MSG is sent to all
+	 * devices that subscribed for the updated device's uuid
+	 * including the device itself, so here we parse the message,
+	 * which may contain an get_data, set_data or config and
+	 * call the watch_cb that will be responsible of forwarding
+	 * the message to the thing.
+	 */
+	} else if (!strncmp(resp, CONFIG_MSG, CONFIG_MSG_LEN))
+		handle_config(resp);
 }
 
 static void handle_cloud_response(const char *resp, struct lws *wsi)
 {
-	int packet_type, offset = 0, len = strlen(resp);
-	json_raw_t json;
-	size_t realsize;
-	json_object *jobj, *jres;
-	const char *jobjstringres;
-	struct per_session_data_ws *session_data;
+	int packet_type, sio_type = SIO_EVENT, offset = 0, len = strlen(resp);
+	unsigned int id = 0;
+	struct ws_conn *conn;
 
 	/* Find message type */
 	if (sscanf(resp, "%1d", &packet_type) < 0)
 		return;
 	/*
 	 * Skip packet type, if packet type is EIO_OPEN, resp is like 0{...}
-	 * otherwise resp is packet_type[...]
+	 * otherwise resp is packet_type[...]. Socket.IO messages are
+	 * 4<sio_type>[ack id][...]
 	 */
 	if (packet_type == EIO_OPEN)
 		resp += 1;
 	else {
+		if (packet_type == EIO_MSG && len > 1) {
+			sio_type = resp[1] - '0';
+			offset = 2;
+			while (offset < len && g_ascii_isdigit(resp[offset]))
+				id = id * 10 + resp[offset++] - '0';
+		}
 		while (offset < len && resp[offset] != '[')
 			offset++;
 		resp += offset;
@@ -621,69 +1100,92 @@ static void handle_cloud_response(const char *resp, struct lws *wsi)
 		/* TODO */
 		break;
 	case EIO_MSG:
-		log_info("JSON_RX %d = %s", packet_type, resp);
-		if (!strcmp(resp, IDENTIFY_REQUEST))
-			connected = TRUE;
-		else if (!strncmp(resp, READY_RESPONSE, READY_RESPONSE_LEN))
-			ready = TRUE;
-		else if (!strncmp(resp, NOT_READY_RESPONSE,
-						NOT_READY_RESPONSE_LEN)) {
-			connection_error = TRUE;
-			client_connection_error = TRUE;
-		/*
-		 * Every time a device is updated a CONFIG_MSG is sent to all
-		 * devices that subscribed for the updated device's uuid
-		 * including the device itself, so here we parse the message,
-		 * which may contain an get_data, set_data or config and
-		 * call the watch_cb that will be responsible of forwarding
-		 * the message to the thing.
-		 */
-		} else if (!strncmp(resp, CONFIG_MSG, CONFIG_MSG_LEN)) {
-			session_data = g_hash_table_lookup(wstable,
-				GINT_TO_POINTER(lws_get_socket_fd(wsi)));
+		log_dbg("JSON_RX %d = %s", packet_type, resp);
+		conn = wsi_conn(wsi);
+		if (!conn)
+			break;
+
+		if (sio_type == SIO_ACK)
+			handle_ack(conn, id, resp);
+		else
+			handle_event(conn, resp);
+		break;
+	default:
+		break;
+	}
+}
 
-			if (!session_data)
-				break;
+static int handle_writeable(struct lws *wsi)
+{
+	struct ws_conn *conn;
+	struct ws_frame *frame;
+	int l;
 
-			memset(&json, 0, sizeof(json_raw_t));
+	conn = wsi_conn(wsi);
+	if (!conn)
+		return 0;
 
-			jres = json_tokener_parse(resp);
-			if (jres == NULL)
-				break;
+	frame = g_queue_pop_head(conn->txq);
+	if (!frame)
+		return 0;
 
-			jobj = json_object_array_get_idx(jres, 1);
+	conn->ping_at = now_sec() + PING_INTERVAL;
 
-			jobjstringres = json_object_to_json_string(jobj);
+	l = lws_write(wsi, &frame->buffer[LWS_PRE], frame->len,
+							LWS_WRITE_TEXT);
+	g_free(frame);
+	/*
+	 * Since pings are sent continuously, ignore them to have
+	 * a cleaner log.
+	 */
+	if (l > 1)
+		log_dbg("Wrote (%d) bytes", l);
 
-			realsize = strlen(jobjstringres) + 1;
+	if (l < 0) {
+		conn->error = TRUE;
+		return -1;
+	}
 
-			json.data = (char *) realloc(json.data,
-							json.size + realsize);
-			if (json.data == NULL) {
-				log_error("Not enough memory");
-				break;
-			}
+	/* Enable RX when after message is successfully sent */
+	lws_rx_flow_control(wsi, 1);
 
-			memcpy(json.data + json.size, jobjstringres, realsize);
-			json.size += realsize;
-			json.data[json.size - 1] = 0;
-
-			if (session_data->data.watch_cb)
-				session_data->data.watch_cb(json,
-						session_data->data.user_data);
-
-			json_object_put(jres);
-			free(json.data);
-		} else {
-			if (psd->json)
-				g_free(psd->json);
-			psd->json = g_strdup(resp);
-			got_response = TRUE;
-		}
-		break;
-	default:
-		break;
-	}
+	if (!g_queue_is_empty(conn->txq))
+		lws_callback_on_writable(wsi);
+
+	return 0;
+}
+
+static void session_hup(gpointer key, gpointer value, gpointer user_data)
+{
+	struct per_session_data_ws *psd = value;
+
+	if (psd->conn != user_data || psd->peer < 0)
+		return;
+
+	/* Manager sees G_IO_HUP on psd->sock and releases the session */
+	close(psd->peer);
+	psd->peer = -1;
+}
+
+static void handle_closed(struct lws *wsi)
+{
+	struct ws_conn *conn;
+
+	/* The socket may be closed already: fd lookup is only a hint */
+	conn = wsi_conn(wsi);
+	if (!conn || conn->wsi != wsi)
+		conn = g_hash_table_find(conntable, conn_match_wsi, wsi);
+	if (!conn)
+		return;
+
+	/* Wake up ws_wait(): the wsi is no longer valid */
+	conn->error = TRUE;
+	conn_detach(conn);
+
+	g_hash_table_foreach(wstable, session_hup, conn);
+
+	if (conn->refs == 0)
+		conn_free(conn);
 }
 
 static int callback_lws_http(struct lws *wsi,
@@ -691,13 +1193,15 @@ static int callback_lws_http(struct lws *wsi,
 					void *user_data, void *in, size_t len)
 
 {
+	struct lws_pollargs *pa;
+
 	switch (reason) {
 	case LWS_CALLBACK_ESTABLISHED:
 		log_info("LWS_CALLBACK_ESTABLISHED");
 		break;
 	case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
 		log_info("LWS_CALLBACK_CLIENT_CONNECTION_ERROR");
-		client_connection_error = TRUE;
+		handle_closed(wsi);
 		break;
 	case LWS_CALLBACK_CLIENT_FILTER_PRE_ESTABLISH:
 		break;
@@ -706,8 +1210,7 @@ static int callback_lws_http(struct lws *wsi,
 		break;
 	case LWS_CALLBACK_CLOSED:
 		log_info("LWS_CALLBACK_CLOSED FOR WSI %p", wsi);
-		wsi = NULL;
-		/* FIXME: Needed? connection_error = TRUE; */
+		handle_closed(wsi);
 		break;
 	case LWS_CALLBACK_CLOSED_HTTP:
 		break;
@@ -719,30 +1222,18 @@ static int callback_lws_http(struct lws *wsi,
 	case LWS_CALLBACK_CLIENT_RECEIVE_PONG:
 		break;
 	case LWS_CALLBACK_CLIENT_WRITEABLE:
-		{
-		int l;
-
-		gettimeofday(&psd->interval, NULL);
-
-		psd = g_hash_table_lookup(wstable,
-				GINT_TO_POINTER(lws_get_socket_fd(wsi)));
-
-		l = lws_write(wsi, &psd->buffer[LWS_PRE], psd->len,
-								LWS_WRITE_TEXT);
-		/*
-		 * Since pings are sent continuously, ignore them to have
-		 * a cleaner log.
-		 */
-		if (l > 1)
-			log_info("Wrote (%d) bytes", l);
-
-		/* Enable RX when after message is successfully sent */
-		if (l < 0) {
-			connection_error = TRUE;
-			return -1;
-		}
-			lws_rx_flow_control(wsi, 1);
-		}
+		return handle_writeable(wsi);
+	case LWS_CALLBACK_ADD_POLL_FD:
+		pa = in;
+		pollfd_add(pa->fd, pa->events);
+		break;
+	case LWS_CALLBACK_DEL_POLL_FD:
+		pa = in;
+		g_hash_table_remove(pollfds, GINT_TO_POINTER(pa->fd));
+		break;
+	case LWS_CALLBACK_CHANGE_MODE_POLL_FD:
+		pa = in;
+		pollfd_change(pa->fd, pa->events);
 		break;
 	case LWS_CALLBACK_SERVER_WRITEABLE:
 	case LWS_CALLBACK_HTTP:
@@ -764,9 +1255,6 @@ static int callback_lws_http(struct lws *wsi,
 	case LWS_CALLBACK_WSI_CREATE: // always protocol[0]
 	case LWS_CALLBACK_WSI_DESTROY: // always protocol[0]
 	case LWS_CALLBACK_GET_THREAD_ID:
-	case LWS_CALLBACK_ADD_POLL_FD:
-	case LWS_CALLBACK_DEL_POLL_FD:
-	case LWS_CALLBACK_CHANGE_MODE_POLL_FD:
 	case LWS_CALLBACK_LOCK_POLL:
 	case LWS_CALLBACK_UNLOCK_POLL:
 	case LWS_CALLBACK_OPENSSL_CONTEXT_REQUIRES_PRIVATE_KEY:
@@ -812,14 +1300,13 @@ static struct lws_protocols protocols[] = {
 	}
 };
 
-static int ws_connect(void)
+static struct ws_conn *conn_new(int *err)
 {
 	struct lws_client_connect_info info;
+	struct ws_conn *conn;
 	struct lws *ws;
-	int err, sock;
 	static char ads_port[300];
 	gboolean use_ssl = FALSE; /* wss */
-	GSList *entry;
 
 	memset(&info, 0, sizeof(info));
 	snprintf(ads_port, sizeof(ads_port) - 1, "%s:%u", host_address,
@@ -827,7 +1314,18 @@ static int ws_connect(void)
 
 	log_info("Connecting to %s...", ads_port);
 
-	psd = g_try_new0(struct per_session_data_ws, 1);
+	conn = g_try_new0(struct ws_conn, 1);
+	if (conn == NULL) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	/* Owned by the caller, it prevents releasing it while connecting */
+	conn->refs = 1;
+	conn->sock = -1;
+	conn->txq = g_queue_new();
+	conn->requests = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+							NULL, request_free);
 
 	info.context = context;
 	info.ssl_connection = use_ssl;
@@ -839,70 +1337,120 @@ static int ws_connect(void)
 	info.ietf_version_or_minus_one = -1;
 	info.protocol = protocols[0].name;
 
-	connected = FALSE;
-	client_connection_error = FALSE;
-	connection_error = FALSE;
-	got_response = FALSE;
-
 	/*
-	 * Every new connection is stored in the 'wsis' list. The client only
-	 * sees a fd which is the key for its respective per session data (psd).
-	 * In this struct we store an index that is related to the position of
-	 * the websocket instance (wsi) in the 'wsis' list. The relationships
-	 * are: fd <-> psd->index <-> wsi (wsis at psd->index)
+	 * Callbacks only see the wsi: its socket is the key for the
+	 * respective ws_conn, which keeps the wsi until it is closed.
 	 */
 	ws = lws_client_connect_via_info(&info);
-	wsis = g_slist_append(wsis, ws);
-
-	psd->index = conn_index++;
 
 	/*
 	 * Once we start a connection request, check if the wsi was allocated
 	 * Successfully.
 	 */
-	entry = g_slist_nth_data(wsis, psd->index);
-	if (entry == NULL) {
-		err = errno;
+	if (ws == NULL) {
+		*err = -errno;
 		log_error("libwebsocket_client_connect(): %s(%d)",
-							strerror(err), err);
-		return -err;
+						strerror(-*err), -*err);
+		conn->refs = 0;
+		conn_free(conn);
+		return NULL;
+	}
+
+	conn->wsi = ws;
+
+	conn->sock = lws_get_socket_fd(ws);
+	if (conn->sock < 0) {
+		log_error("libwebsocket_client_connect(): no socket");
+		*err = -ENOTCONN;
+		conn_unref(conn);
+		return NULL;
 	}
 
+	conn->ping_at = now_sec() + PING_INTERVAL;
+	ping_schedule(conn);
+	g_hash_table_insert(conntable, GINT_TO_POINTER(conn->sock), conn);
+
 	/*
 	 * Connect via info is a non blocking method, it returns a websocket
-	 * instance but it may not be writable yet, so here we keep serving the
-	 * context until the connection is actually established. When the
-	 * LWS_CALLBACK_CLIENT_ESTABLISHED is triggered.
+	 * instance but it may not be writable yet, so here we serve the
+	 * socket until the server sends the identify event.
 	 */
-	while (!connected && !client_connection_error)
-		lws_service(context, SERVICE_TIMEOUT);
+	*err = ws_wait(conn, &conn->connected);
+	if (*err < 0) {
+		*err = -ECONNREFUSED;
+		conn_unref(conn);
+		return NULL;
+	}
+
+	return conn;
+}
+
+/* Connections are opened on demand, up to 'cloud_conns' */
+static struct ws_conn *conn_get_shared(int *err)
+{
+	struct ws_conn *conn;
+
+	if (shared->len < cloud_conns) {
+		conn = conn_new(err);
+		if (conn == NULL)
+			return NULL;
 
-	if (client_connection_error) {
-		g_free(psd);
-		return -ECONNREFUSED;
+		conn->shared = TRUE;
+		g_ptr_array_add(shared, conn);
+		return conn;
 	}
 
-	/* Map ws to a unique int */
-	sock = lws_get_socket_fd((struct lws *)entry);
-	gettimeofday(&psd->interval, NULL);
-	g_hash_table_insert(wstable, GINT_TO_POINTER(sock), psd);
+	conn = g_ptr_array_index(shared, shared_next++ % shared->len);
+	conn->refs++;
 
-	connected = FALSE;
-	client_connection_error = FALSE;
-	connection_error = FALSE;
-	got_response = FALSE;
+	return conn;
+}
 
-	return sock;
+static int ws_connect(void)
+{
+	struct per_session_data_ws *psd;
+	struct ws_conn *conn;
+	int err, sv[2];
+
+	if (cloud_conns)
+		conn = conn_get_shared(&err);
+	else
+		conn = conn_new(&err);
+
+	if (conn == NULL)
+		return err;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		err = -errno;
+		log_error("socketpair(): %s(%d)", strerror(-err), -err);
+		conn_unref(conn);
+		return err;
+	}
+
+	psd = g_new0(struct per_session_data_ws, 1);
+	psd->sock = sv[0];
+	psd->peer = sv[1];
+	psd->conn = conn;
+
+	g_hash_table_insert(wstable, GINT_TO_POINTER(psd->sock), psd);
+
+	return psd->sock;
 }
 
-static int ws_probe(const char *host, unsigned int port)
+static int ws_probe(const struct settings *settings)
 {
 	struct lws_context_creation_info i;
 
 	memset(&i, 0, sizeof(i));
 
-	host_address = g_strdup(host);
-	host_port = port;
+	host_address = g_strdup(settings->host);
+	host_port = settings->port;
+	cloud_conns = settings->cloud_conns;
+	ping_last = now_sec();
+
+	/* lws sockets are watched by the main loop via *_POLL_FD callbacks */
+	pollfds = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+							NULL, pollfd_free);
 
 	i.port = CONTEXT_PORT_NO_LISTEN;
 	i.gid = -1;
@@ -911,9 +1459,13 @@ static int ws_probe(const char *host, unsigned int port)
 	context = lws_create_context(&i);
 
 	wstable = g_hash_table_new(g_direct_hash, g_direct_equal);
+	uuidtable = g_hash_table_new(g_str_hash, g_str_equal);
+	conntable = g_hash_table_new(g_direct_hash, g_direct_equal);
+	shared = g_ptr_array_new();
+	txbuf = g_string_sized_new(MAX_PAYLOAD);
 
-	/* FIXME: Investigate alternatives for libwebsocket_service() */
-	g_timeout_add_seconds(1, timeout_ws, NULL);
+	/* Timeouts and pings only: socket events come from pollfds */
+	timeout_id = g_timeout_add_seconds(1, timeout_ws, NULL);
 
 	return 0;
 }
@@ -922,15 +1474,38 @@ static void session_data_free(gpointer key, gpointer value, gpointer user_data)
 {
 	struct per_session_data_ws *psd = value;
 
-	g_free(psd->json);
-	g_free(psd);
+	close(psd->sock);
+	session_free(psd);
 }
 
 static void ws_remove(void)
 {
+	struct ws_conn *conn;
+
+	/* Probed again on reload: the next context gets its own timer */
+	if (timeout_id) {
+		g_source_remove(timeout_id);
+		timeout_id = 0;
+	}
+
 	g_hash_table_foreach(wstable, session_data_free, NULL);
-	g_hash_table_destroy(wstable);
+	g_hash_table_remove_all(wstable);
+
+	/* Idle shared connections are not owned by any session */
+	while (shared->len) {
+		conn = g_ptr_array_index(shared, 0);
+		conn_detach(conn);
+		if (conn->refs == 0)
+			conn_free(conn);
+	}
+	g_ptr_array_free(shared, TRUE);
+
 	lws_context_destroy(context);
+	g_hash_table_destroy(wstable);
+	g_hash_table_destroy(uuidtable);
+	g_hash_table_destroy(conntable);
+	g_hash_table_destroy(pollfds);
+	g_string_free(txbuf, TRUE);
 	g_free(host_address);
 }
 
@@ -938,38 +1513,147 @@ static void ws_remove(void)
  * Watch or poll the cloud to changes in the device.  uuid/token are used
  * by the http protocol in order to constantly fetch specific device data
  * since websockets uses a 'subscription' mechanism there is no need to
- * store these values.
+ * store the token. The uuid routes config messages to the session.
  */
 static unsigned int proto_register_watch(int proto_sock, const char *uuid,
 				const char *token, void (*proto_watch_cb)
 				(json_raw_t, void *), void *user_data)
 {
 	struct to_fetch *data;
-	struct per_session_data_ws *value;
+	struct per_session_data_ws *psd;
 
-	value = g_hash_table_lookup(wstable, GINT_TO_POINTER(proto_sock));
+	psd = session_get(proto_sock);
+	if (psd == NULL)
+		return 0;
 
-	data = &value->data;
+	data = &psd->data;
 	data->watch_cb = proto_watch_cb;
 	data->user_data = user_data;
+	/* Sessions live as long as their worker: no reference needed */
+	data->context = worker_current();
 
-	g_hash_table_insert(wstable, GINT_TO_POINTER(proto_sock), value);
+	session_set_uuid(psd, uuid);
 
 	return 0;
 }
 
+/* Entry points used by msg.c: called from the session workers */
+static int ws_connect_locked(void)
+{
+	int sock;
+
+	g_rec_mutex_lock(&ws_lock);
+	sock = ws_connect();
+	g_rec_mutex_unlock(&ws_lock);
+
+	return sock;
+}
+
+static void ws_close_locked(int sock)
+{
+	g_rec_mutex_lock(&ws_lock);
+	ws_close(sock);
+	g_rec_mutex_unlock(&ws_lock);
+}
+
+static int ws_mknode_locked(int sock, const char *device_json,
+							json_raw_t *json)
+{
+	int err;
+
+	g_rec_mutex_lock(&ws_lock);
+	err = ws_mknode(sock, device_json, json);
+	g_rec_mutex_unlock(&ws_lock);
+
+	return err;
+}
+
+static int ws_signin_locked(int sock, const char *uuid, const char *token,
+							json_raw_t *json)
+{
+	int err;
+
+	g_rec_mutex_lock(&ws_lock);
+	err = ws_signin(sock, uuid, token, json);
+	g_rec_mutex_unlock(&ws_lock);
+
+	return err;
+}
+
+static int ws_rmnode_locked(int sock, const char *uuid, const char *token,
+							json_raw_t *json)
+{
+	int err;
+
+	g_rec_mutex_lock(&ws_lock);
+	err = ws_rmnode(sock, uuid, token, json);
+	g_rec_mutex_unlock(&ws_lock);
+
+	return err;
+}
+
+static int ws_update_locked(int sock, const char *uuid, const char *token,
+					const char *jreq, json_raw_t *json)
+{
+	int err;
+
+	g_rec_mutex_lock(&ws_lock);
+	err = ws_update(sock, uuid, token, jreq, json);
+	g_rec_mutex_unlock(&ws_lock);
+
+	return err;
+}
+
+static int ws_data_locked(int sock, const char *uuid, const char *token,
+					const char *jreq, json_raw_t *json)
+{
+	int err;
+
+	g_rec_mutex_lock(&ws_lock);
+	err = ws_data(sock, uuid, token, jreq, json);
+	g_rec_mutex_unlock(&ws_lock);
+
+	return err;
+}
+
+static int ws_device_locked(int sock, const char *uuid,
+				const char *token, json_raw_t *json)
+{
+	int err;
+
+	g_rec_mutex_lock(&ws_lock);
+	err = ws_device(sock, uuid, token, json);
+	g_rec_mutex_unlock(&ws_lock);
+
+	return err;
+}
+
+static unsigned int register_watch_locked(int proto_sock, const char *uuid,
+				const char *token, void (*proto_watch_cb)
+				(json_raw_t, void *), void *user_data)
+{
+	unsigned int id;
+
+	g_rec_mutex_lock(&ws_lock);
+	id = proto_register_watch(proto_sock, uuid, token, proto_watch_cb,
+								user_data);
+	g_rec_mutex_unlock(&ws_lock);
+
+	return id;
+}
+
 struct proto_ops proto_ws = {
 	.name = "ws",	/* websockets */
 	.probe = ws_probe,
 	.remove = ws_remove,
-	.connect = ws_connect,
-	.close = ws_close,
-	.mknode = ws_mknode,
-	.signin = ws_signin,
-	.rmnode = ws_rmnode,
-	.schema = ws_update,
-	.data = ws_data,
-	.fetch = ws_device,
-	.async = proto_register_watch,
-	.setdata = ws_update
+	.connect = ws_connect_locked,
+	.close = ws_close_locked,
+	.mknode = ws_mknode_locked,
+	.signin = ws_signin_locked,
+	.rmnode = ws_rmnode_locked,
+	.schema = ws_update_locked,
+	.data = ws_data_locked,
+	.fetch = ws_device_locked,
+	.async = register_watch_locked,
+	.setdata = ws_update_locked
 };
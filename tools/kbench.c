@@ -0,0 +1,937 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2017, CESAR. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the CESAR nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL CESAR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <termios.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <glib.h>
+#include <json-c/json.h>
+
+#include <knot_protocol.h>
+#include <knot_types.h>
+
+#define KBENCH_DEVICE_NAME		"kbench"
+#define KBENCH_SENSOR_ID		1
+#define KBENCH_TIMEOUT			30000000	/* us */
+
+/* Serial framing: see src/frame.h */
+#define FRAME_HDR_SIZE			6
+#define FRAME_MAX_SIZE			(FRAME_HDR_SIZE + 255)
+
+enum thing_state {
+	THING_REGISTER,
+	THING_SCHEMA,
+	THING_DATA,
+};
+
+enum bench_op {
+	BENCH_REGISTER,
+	BENCH_SCHEMA,
+	BENCH_DATA,
+	BENCH_MAX,
+};
+
+struct thing {
+	unsigned int id;
+	int sock;			/* Unix socket or -1: serial pipe */
+	enum thing_state state;
+	gint64 sent;			/* Pending request (us) or 0 */
+	guint timer;
+	guint watch;
+	int32_t value;
+};
+
+struct bench_stats {
+	const char *name;
+	GArray *samples;		/* Round trip times (us) */
+	unsigned int errors;
+};
+
+/* Connection to the mock cloud: one request served at a time */
+struct mock_conn {
+	int sock;
+	guint watch;
+	guint timer;
+	GString *in;
+	GString *out;
+};
+
+static char *opt_unix = "knot";
+static char *opt_tty = NULL;
+static int opt_things = 10;
+static double opt_rate = 1.0;
+static int opt_duration = 30;
+static int opt_mock_port = 0;
+static int opt_latency = 0;
+static gboolean opt_mock_only = FALSE;
+
+static GMainLoop *main_loop;
+static struct thing *things;
+static struct bench_stats stats[BENCH_MAX] = {
+	[BENCH_REGISTER] = { .name = "register" },
+	[BENCH_SCHEMA] = { .name = "schema" },
+	[BENCH_DATA] = { .name = "data" },
+};
+static gint64 bench_start;
+static int tty_fd = -1;
+static uint8_t tty_buf[FRAME_MAX_SIZE * 4];
+static size_t tty_len;
+static GHashTable *devices;
+
+static int unix_connect(const char *opt_unix)
+{
+	int err, sock;
+	struct sockaddr_un addr;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	/* Abstract namespace: first character must be null */
+	strncpy(addr.sun_path + 1, opt_unix, sizeof(addr.sun_path) - 2);
+
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		err = -errno;
+		close(sock);
+		return err;
+	}
+
+	return sock;
+}
+
+static int serial_connect(const char *opt_tty)
+{
+	struct termios term;
+	int ttyfd;
+
+	ttyfd = open(opt_tty, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (ttyfd < 0)
+		return -errno;
+
+	memset(&term, 0, sizeof(term));
+	cfmakeraw(&term);
+	cfsetspeed(&term, B115200);
+	term.c_cflag |= CLOCAL | CREAD;
+	tcflush(ttyfd, TCIFLUSH);
+	tcsetattr(ttyfd, TCSANOW, &term);
+
+	return ttyfd;
+}
+
+static void stats_record(enum bench_op op, gint64 start, int8_t result)
+{
+	gint64 delta = g_get_monotonic_time() - start;
+
+	if (result != KNOT_SUCCESS) {
+		stats[op].errors++;
+		return;
+	}
+
+	g_array_append_val(stats[op].samples, delta);
+}
+
+static gint sample_cmp(gconstpointer a, gconstpointer b)
+{
+	const gint64 *sa = a, *sb = b;
+
+	return (*sa > *sb) - (*sa < *sb);
+}
+
+static double percentile(GArray *samples, unsigned int p)
+{
+	if (samples->len == 0)
+		return 0;
+
+	/* Nearest rank, samples must be sorted */
+	return g_array_index(samples, gint64,
+				(samples->len - 1) * p / 100) / 1000.0;
+}
+
+static void stats_report(void)
+{
+	double elapsed;
+	int i;
+
+	elapsed = (g_get_monotonic_time() - bench_start) / 1000000.0;
+
+	printf("\n%-10s %10s %8s %10s %10s\n", "op", "count", "errors",
+						"p50(ms)", "p99(ms)");
+
+	for (i = 0; i < BENCH_MAX; i++) {
+		g_array_sort(stats[i].samples, sample_cmp);
+		printf("%-10s %10u %8u %10.2f %10.2f\n", stats[i].name,
+				stats[i].samples->len, stats[i].errors,
+				percentile(stats[i].samples, 50),
+				percentile(stats[i].samples, 99));
+	}
+
+	printf("\n%d things, %.1f s: %.1f data msg/s\n", opt_things, elapsed,
+			elapsed > 0 ? stats[BENCH_DATA].samples->len / elapsed
+			: 0);
+}
+
+static int thing_send(struct thing *thing, const void *pdu, size_t len)
+{
+	uint8_t frame[FRAME_MAX_SIZE];
+	uint64_t pipeid = thing->id;
+
+	if (thing->sock >= 0) {
+		if (write(thing->sock, pdu, len) < 0)
+			return -errno;
+		return 0;
+	}
+
+	/* Pipe id (big endian) + datagram length: see src/frame.h */
+	frame[0] = pipeid >> 32;
+	frame[1] = pipeid >> 24;
+	frame[2] = pipeid >> 16;
+	frame[3] = pipeid >> 8;
+	frame[4] = pipeid;
+	frame[5] = len;
+	memcpy(&frame[FRAME_HDR_SIZE], pdu, len);
+
+	if (write(tty_fd, frame, FRAME_HDR_SIZE + len) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int thing_request(struct thing *thing)
+{
+	knot_msg msg;
+	knot_value_type_int *kint;
+	int len;
+
+	memset(&msg, 0, sizeof(msg));
+
+	switch (thing->state) {
+	case THING_REGISTER:
+		len = snprintf(msg.reg.devName, sizeof(msg.reg.devName),
+					"%s-%u", KBENCH_DEVICE_NAME, thing->id);
+		msg.hdr.type = KNOT_MSG_REGISTER_REQ;
+		msg.hdr.payload_len = len;
+		break;
+	case THING_SCHEMA:
+		/* Single sensor: the first entry is also the last one */
+		msg.hdr.type = KNOT_MSG_SCHEMA_END;
+		msg.hdr.payload_len = sizeof(msg.schema.sensor_id) +
+						sizeof(msg.schema.values);
+		msg.schema.sensor_id = KBENCH_SENSOR_ID;
+		msg.schema.values.value_type = KNOT_VALUE_TYPE_INT;
+		msg.schema.values.unit = KNOT_UNIT_TEMPERATURE_C;
+		msg.schema.values.type_id = KNOT_TYPE_ID_TEMPERATURE;
+		strncpy(msg.schema.values.name, "Temperature",
+					sizeof(msg.schema.values.name) - 1);
+		break;
+	case THING_DATA:
+		msg.hdr.type = KNOT_MSG_DATA;
+		msg.hdr.payload_len = sizeof(msg.data.sensor_id) +
+						sizeof(knot_value_type_int);
+		msg.data.sensor_id = KBENCH_SENSOR_ID;
+		kint = &msg.data.payload.values.val_i;
+		kint->value = thing->value++ % 50;
+		kint->multiplier = 1;
+		break;
+	}
+
+	thing->sent = g_get_monotonic_time();
+
+	return thing_send(thing, &msg, sizeof(msg.hdr) + msg.hdr.payload_len);
+}
+
+static gboolean thing_timeout(gpointer user_data)
+{
+	struct thing *thing = user_data;
+	int err;
+
+	thing->timer = 0;
+
+	err = thing_request(thing);
+	if (err < 0) {
+		printf("thing %u: write(): %s(%d)\n", thing->id,
+						strerror(-err), -err);
+		thing->sent = 0;
+	}
+
+	return FALSE;
+}
+
+/* Keeps the configured rate: the round trip is part of the period */
+static void thing_schedule(struct thing *thing)
+{
+	gint64 period = 1000000 / opt_rate;
+	gint64 elapsed = g_get_monotonic_time() - thing->sent;
+
+	thing->sent = 0;
+
+	if (thing->timer)
+		g_source_remove(thing->timer);
+
+	if (elapsed >= period)
+		thing->timer = g_idle_add(thing_timeout, thing);
+	else
+		thing->timer = g_timeout_add((period - elapsed) / 1000,
+							thing_timeout, thing);
+}
+
+static void thing_response(struct thing *thing, const knot_msg *msg,
+								size_t len)
+{
+	knot_msg_item resp;
+	enum bench_op op;
+	int8_t result;
+
+	if (len < sizeof(msg->hdr))
+		return;
+
+	switch (msg->hdr.type) {
+	case KNOT_MSG_REGISTER_RESP:
+		op = BENCH_REGISTER;
+		break;
+	case KNOT_MSG_SCHEMA_RESP:
+	case KNOT_MSG_SCHEMA_END_RESP:
+		op = BENCH_SCHEMA;
+		break;
+	case KNOT_MSG_DATA_RESP:
+		op = BENCH_DATA;
+		break;
+	case KNOT_MSG_SET_CONFIG:
+		/* Acknowledge it, otherwise knotd keeps it pending */
+		memset(&resp, 0, sizeof(resp));
+		resp.hdr.type = KNOT_MSG_CONFIG_RESP;
+		resp.hdr.payload_len = sizeof(resp.sensor_id);
+		resp.sensor_id = msg->config.sensor_id;
+		thing_send(thing, &resp, sizeof(resp));
+		return;
+	default:
+		/* Cloud initiated: not part of the measured cycle */
+		return;
+	}
+
+	if (thing->sent == 0)
+		return;
+
+	result = msg->action.result;
+	stats_record(op, thing->sent, result);
+
+	/* Failed requests are retried on the next period */
+	if (result == KNOT_SUCCESS && thing->state != THING_DATA)
+		thing->state++;
+
+	thing_schedule(thing);
+}
+
+static gboolean thing_receive(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct thing *thing = user_data;
+	knot_msg msg;
+	ssize_t nbytes;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		printf("thing %u: disconnected\n", thing->id);
+		thing->watch = 0;
+		return FALSE;
+	}
+
+	nbytes = read(thing->sock, &msg, sizeof(msg));
+	if (nbytes <= 0)
+		return TRUE;
+
+	thing_response(thing, &msg, nbytes);
+
+	return TRUE;
+}
+
+static gboolean tty_receive(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	knot_msg msg;
+	uint64_t pipeid;
+	ssize_t nbytes;
+	size_t size;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		printf("tty: disconnected\n");
+		return FALSE;
+	}
+
+	nbytes = read(tty_fd, tty_buf + tty_len, sizeof(tty_buf) - tty_len);
+	if (nbytes <= 0)
+		return TRUE;
+
+	tty_len += nbytes;
+
+	while (tty_len >= FRAME_HDR_SIZE) {
+		size = tty_buf[5];
+		if (tty_len < FRAME_HDR_SIZE + size)
+			break;
+
+		pipeid = tty_buf[4];
+		pipeid |= tty_buf[3] << 8;
+		pipeid |= tty_buf[2] << 16;
+		pipeid |= (uint64_t) tty_buf[1] << 24;
+		pipeid |= (uint64_t) tty_buf[0] << 32;
+
+		memset(&msg, 0, sizeof(msg));
+		memcpy(&msg, &tty_buf[FRAME_HDR_SIZE], MIN(size, sizeof(msg)));
+
+		/* Pipe ids start at one: zero is never written */
+		if (pipeid >= 1 && pipeid <= (uint64_t) opt_things)
+			thing_response(&things[pipeid - 1], &msg, size);
+
+		tty_len -= FRAME_HDR_SIZE + size;
+		memmove(tty_buf, tty_buf + FRAME_HDR_SIZE + size, tty_len);
+	}
+
+	return TRUE;
+}
+
+static int things_start(void)
+{
+	GIOCondition cond = G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
+	GIOChannel *io;
+	struct thing *thing;
+	int i, err;
+
+	things = g_new0(struct thing, opt_things);
+
+	if (opt_tty) {
+		tty_fd = serial_connect(opt_tty);
+		if (tty_fd < 0)
+			return tty_fd;
+
+		io = g_io_channel_unix_new(tty_fd);
+		g_io_add_watch(io, cond, tty_receive, NULL);
+		g_io_channel_unref(io);
+	}
+
+	for (i = 0; i < opt_things; i++) {
+		thing = &things[i];
+		thing->id = i + 1;
+		thing->sock = -1;
+
+		if (opt_tty == NULL) {
+			thing->sock = unix_connect(opt_unix);
+			if (thing->sock < 0) {
+				err = thing->sock;
+				printf("connect(%s): %s(%d)\n", opt_unix,
+							strerror(-err), -err);
+				return err;
+			}
+
+			io = g_io_channel_unix_new(thing->sock);
+			thing->watch = g_io_add_watch(io, cond,
+						thing_receive, thing);
+			g_io_channel_unref(io);
+		}
+
+		thing->timer = g_idle_add(thing_timeout, thing);
+	}
+
+	return 0;
+}
+
+static void things_stop(void)
+{
+	struct thing *thing;
+	int i;
+
+	for (i = 0; things && i < opt_things; i++) {
+		thing = &things[i];
+		if (thing->timer)
+			g_source_remove(thing->timer);
+		if (thing->watch)
+			g_source_remove(thing->watch);
+		if (thing->sock >= 0)
+			close(thing->sock);
+	}
+
+	if (tty_fd >= 0)
+		close(tty_fd);
+
+	g_free(things);
+	things = NULL;
+}
+
+/* Unanswered requests: knotd dropped the PDU or the cloud hung */
+static gboolean bench_tick(gpointer user_data)
+{
+	gint64 now = g_get_monotonic_time();
+	struct thing *thing;
+	int i;
+
+	for (i = 0; i < opt_things; i++) {
+		thing = &things[i];
+		if (thing->sent == 0 || now - thing->sent < KBENCH_TIMEOUT)
+			continue;
+
+		stats[thing->state == THING_DATA ? BENCH_DATA :
+			thing->state == THING_SCHEMA ? BENCH_SCHEMA :
+			BENCH_REGISTER].errors++;
+		thing_schedule(thing);
+	}
+
+	printf("%.0f s: %u data responses\r",
+			(now - bench_start) / 1000000.0,
+			stats[BENCH_DATA].samples->len);
+	fflush(stdout);
+
+	return TRUE;
+}
+
+static gboolean bench_stop(gpointer user_data)
+{
+	g_main_loop_quit(main_loop);
+
+	return FALSE;
+}
+
+static char *random_hex(char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = "0123456789abcdef"[g_random_int_range(0, 16)];
+	buf[len] = '\0';
+
+	return buf;
+}
+
+static char *mock_uuid(void)
+{
+	char hex[33];
+
+	random_hex(hex, 32);
+
+	return g_strdup_printf("%.8s-%.4s-%.4s-%.4s-%.12s", hex, hex + 8,
+					hex + 12, hex + 16, hex + 20);
+}
+
+static const char *mock_header(const char *hdrs, const char *name)
+{
+	size_t len = strlen(name);
+	const char *line;
+
+	for (line = strstr(hdrs, "\r\n"); line; line = strstr(line, "\r\n")) {
+		line += 2;
+		if (g_ascii_strncasecmp(line, name, len) == 0 &&
+							line[len] == ':')
+			return line + len + 1;
+	}
+
+	return NULL;
+}
+
+/* Device documents as a Meshblu 1.x server would return them */
+static char *mock_devices(json_object *jobj)
+{
+	json_object *jdevices, *jarray;
+	char *str;
+
+	jdevices = json_object_new_object();
+	jarray = json_object_new_array();
+	json_object_array_add(jarray, json_object_get(jobj));
+	json_object_object_add(jdevices, "devices", jarray);
+
+	str = g_strdup(json_object_to_json_string(jdevices));
+	json_object_put(jdevices);
+
+	return str;
+}
+
+static char *mock_route(const char *method, const char *path,
+					const char *body, int *status)
+{
+	json_object *jobj, *jbody;
+	char token[KNOT_PROTOCOL_TOKEN_LEN + 1];
+	const char *uuid = NULL;
+	char *new_uuid;
+
+	if (g_str_has_prefix(path, "/devices/"))
+		uuid = path + strlen("/devices/");
+
+	if (strcmp(method, "POST") == 0 && strcmp(path, "/devices") == 0) {
+		jobj = json_tokener_parse(body);
+		if (jobj == NULL)
+			jobj = json_object_new_object();
+
+		new_uuid = mock_uuid();
+		json_object_object_add(jobj, "uuid",
+					json_object_new_string(new_uuid));
+		json_object_object_add(jobj, "token", json_object_new_string(
+			random_hex(token, KNOT_PROTOCOL_TOKEN_LEN)));
+		g_hash_table_replace(devices, new_uuid, jobj);
+
+		*status = 201;
+		return g_strdup(json_object_to_json_string(jobj));
+	}
+
+	if (g_str_has_prefix(path, "/data/")) {
+		*status = 201;
+		return g_strdup("{}");
+	}
+
+	jobj = uuid ? g_hash_table_lookup(devices, uuid) : NULL;
+	if (jobj == NULL) {
+		*status = 404;
+		return g_strdup("{}");
+	}
+
+	*status = 200;
+
+	if (strcmp(method, "PUT") == 0) {
+		jbody = json_tokener_parse(body);
+		if (jbody) {
+			json_object_object_foreach(jbody, key, val) {
+				json_object_object_add(jobj, key,
+						json_object_get(val));
+			}
+			json_object_put(jbody);
+		}
+	} else if (strcmp(method, "DELETE") == 0) {
+		json_object_get(jobj);
+		g_hash_table_remove(devices, uuid);
+		body = mock_devices(jobj);
+		json_object_put(jobj);
+		return (char *) body;
+	}
+
+	return mock_devices(jobj);
+}
+
+static void device_free(gpointer user_data)
+{
+	json_object_put(user_data);
+}
+
+static void mock_free(struct mock_conn *conn)
+{
+	if (conn->timer)
+		g_source_remove(conn->timer);
+	close(conn->sock);
+	g_string_free(conn->in, TRUE);
+	g_string_free(conn->out, TRUE);
+	g_free(conn);
+}
+
+static gboolean mock_process(struct mock_conn *conn);
+
+static gboolean mock_reply(gpointer user_data)
+{
+	struct mock_conn *conn = user_data;
+
+	conn->timer = 0;
+
+	if (write(conn->sock, conn->out->str, conn->out->len) < 0) {
+		printf("mock: write(): %s(%d)\n", strerror(errno), errno);
+		shutdown(conn->sock, SHUT_RDWR);
+	}
+
+	g_string_truncate(conn->out, 0);
+
+	/* Requests that arrived during the injected latency */
+	mock_process(conn);
+
+	return FALSE;
+}
+
+static gboolean mock_process(struct mock_conn *conn)
+{
+	char method[8], path[256];
+	const char *end, *clen;
+	size_t hdrlen, bodylen = 0;
+	char *hdrs, *body, *rsp;
+	int status;
+
+	if (conn->timer)
+		return TRUE;
+
+	end = strstr(conn->in->str, "\r\n\r\n");
+	if (end == NULL)
+		return TRUE;
+
+	hdrlen = end - conn->in->str + 4;
+	hdrs = g_strndup(conn->in->str, hdrlen);
+
+	clen = mock_header(hdrs, "Content-Length");
+	if (clen)
+		bodylen = strtoul(clen, NULL, 10);
+
+	if (conn->in->len < hdrlen + bodylen) {
+		g_free(hdrs);
+		return TRUE;
+	}
+
+	if (sscanf(hdrs, "%7s %255s", method, path) != 2) {
+		g_free(hdrs);
+		return FALSE;
+	}
+
+	body = g_strndup(conn->in->str + hdrlen, bodylen);
+	g_string_erase(conn->in, 0, hdrlen + bodylen);
+
+	rsp = mock_route(method, path, body, &status);
+	g_string_printf(conn->out, "HTTP/1.1 %d %s\r\n"
+			"Content-Type: application/json\r\n"
+			"Content-Length: %zu\r\n\r\n%s", status,
+			status == 404 ? "Not Found" : "OK", strlen(rsp), rsp);
+
+	g_free(rsp);
+	g_free(body);
+	g_free(hdrs);
+
+	if (opt_latency)
+		conn->timer = g_timeout_add(opt_latency, mock_reply, conn);
+	else
+		mock_reply(conn);
+
+	return TRUE;
+}
+
+static gboolean mock_read(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct mock_conn *conn = user_data;
+	char buf[1024];
+	ssize_t nbytes;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+		return FALSE;
+
+	nbytes = read(conn->sock, buf, sizeof(buf));
+	if (nbytes <= 0)
+		return FALSE;
+
+	g_string_append_len(conn->in, buf, nbytes);
+
+	return mock_process(conn);
+}
+
+static void mock_destroy(gpointer user_data)
+{
+	mock_free(user_data);
+}
+
+static gboolean mock_accept(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct mock_conn *conn;
+	GIOChannel *cio;
+	int sock;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+		return FALSE;
+
+	sock = accept4(g_io_channel_unix_get_fd(io), NULL, NULL,
+							SOCK_CLOEXEC);
+	if (sock < 0)
+		return TRUE;
+
+	conn = g_new0(struct mock_conn, 1);
+	conn->sock = sock;
+	conn->in = g_string_new(NULL);
+	conn->out = g_string_new(NULL);
+
+	cio = g_io_channel_unix_new(sock);
+	conn->watch = g_io_add_watch_full(cio, G_PRIORITY_DEFAULT,
+				G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+				mock_read, conn, mock_destroy);
+	g_io_channel_unref(cio);
+
+	return TRUE;
+}
+
+/*
+ * Minimal Meshblu REST backend: enough for knotd http driver to register,
+ * sign in, push schemas and data. Every reply is delayed by 'latency' ms.
+ */
+static int mock_start(int port)
+{
+	struct sockaddr_in addr;
+	GIOChannel *io;
+	int sock, err;
+	int on = 1;
+
+	sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -errno;
+
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+						listen(sock, 64) < 0) {
+		err = -errno;
+		close(sock);
+		return err;
+	}
+
+	devices = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+								device_free);
+
+	io = g_io_channel_unix_new(sock);
+	g_io_channel_set_close_on_unref(io, TRUE);
+	g_io_add_watch(io, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+							mock_accept, NULL);
+	g_io_channel_unref(io);
+
+	printf("Mock cloud listening on 127.0.0.1:%d (latency %d ms)\n",
+							port, opt_latency);
+
+	return 0;
+}
+
+static GOptionEntry options[] = {
+	{ "unix", 'U', 0, G_OPTION_ARG_STRING, &opt_unix,
+			"Specify unix socket to connect. Default: knot",
+			"knot" },
+	{ "tty", 'T', 0, G_OPTION_ARG_STRING, &opt_tty,
+			"Multiplex the things over a TTY instead",
+			"/dev/ttyUSB0" },
+	{ "things", 'n', 0, G_OPTION_ARG_INT, &opt_things,
+			"Number of concurrent things. Default: 10", "N" },
+	{ "rate", 'r', 0, G_OPTION_ARG_DOUBLE, &opt_rate,
+			"Data messages per thing per second. Default: 1",
+			"RATE" },
+	{ "duration", 'd', 0, G_OPTION_ARG_INT, &opt_duration,
+			"Benchmark duration in seconds. Default: 30", "SEC" },
+	{ "mock-port", 'p', 0, G_OPTION_ARG_INT, &opt_mock_port,
+			"Serve a mock Meshblu (http) on 127.0.0.1:PORT",
+			"PORT" },
+	{ "latency", 'l', 0, G_OPTION_ARG_INT, &opt_latency,
+			"Latency injected by the mock cloud (ms)", "MS" },
+	{ "mock-only", 'm', 0, G_OPTION_ARG_NONE, &opt_mock_only,
+			"Only serve the mock cloud, no things", NULL },
+	{ NULL },
+};
+
+static void sig_term(int sig)
+{
+	g_main_loop_quit(main_loop);
+}
+
+/*
+ * HOWTO:
+ * ./kbench --mock-port=3000 --latency=50 --mock-only &
+ * knotd --proto=http --host=127.0.0.1 --port=3000 &
+ * ./kbench --things=100 --rate=2 --duration=60
+ *
+ * No websocket mock: the in-memory cloud of knotd replaces it.
+ * knotd --proto=mock --mock-latency=50 &
+ * ./kbench --things=100 --rate=2 --duration=60
+ */
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	int i, err = 0;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &gerr)) {
+		printf("Invalid arguments: %s\n", gerr->message);
+		g_error_free(gerr);
+		g_option_context_free(context);
+		exit(EXIT_FAILURE);
+	}
+
+	g_option_context_free(context);
+
+	if (opt_rate <= 0 || opt_things < 0 || opt_latency < 0 ||
+			(opt_mock_only && opt_mock_port <= 0)) {
+		printf("Invalid arguments\n");
+		exit(EXIT_FAILURE);
+	}
+
+	signal(SIGTERM, sig_term);
+	signal(SIGINT, sig_term);
+	main_loop = g_main_loop_new(NULL, FALSE);
+
+	for (i = 0; i < BENCH_MAX; i++)
+		stats[i].samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+	if (opt_mock_port > 0) {
+		err = mock_start(opt_mock_port);
+		if (err < 0) {
+			printf("mock: %s(%d)\n", strerror(-err), -err);
+			goto done;
+		}
+	}
+
+	bench_start = g_get_monotonic_time();
+
+	if (!opt_mock_only) {
+		printf("KNOT Bench: %d things, %.1f msg/s each, %d s\n",
+					opt_things, opt_rate, opt_duration);
+
+		err = things_start();
+		if (err < 0)
+			goto done;
+
+		g_timeout_add_seconds(1, bench_tick, NULL);
+		g_timeout_add_seconds(opt_duration, bench_stop, NULL);
+	}
+
+	g_main_loop_run(main_loop);
+
+	if (!opt_mock_only)
+		stats_report();
+
+done:
+	things_stop();
+	if (devices)
+		g_hash_table_destroy(devices);
+
+	for (i = 0; i < BENCH_MAX; i++)
+		g_array_free(stats[i].samples, TRUE);
+
+	g_main_loop_unref(main_loop);
+
+	return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
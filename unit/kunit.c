@@ -0,0 +1,684 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2015, CESAR. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	* Redistributions of source code must retain the above copyright
+ *	  notice, this list of conditions and the following disclaimer.
+ *	* Redistributions in binary form must reproduce the above copyright
+ *	  notice, this list of conditions and the following disclaimer in the
+ *	  documentation and/or other materials provided with the distribution.
+ *	* Neither the name of the CESAR nor the
+ *	  names of its contributors may be used to endorse or promote products
+ *	  derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL CESAR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Unit tests of the knotd modules that don't need a node or a cloud.
+ * Files are created in a temporary directory removed on exit.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <knot_protocol.h>
+#include <knot_types.h>
+
+#include "src/log.h"
+#include "src/frame.h"
+#include "src/table.h"
+#include "src/serializer.h"
+#include "src/cache.h"
+#include "src/journal.h"
+
+#define UNIT_UUID		"e2be6c4e-41f6-4c73-9b1b-d5f2a1e0c001"
+#define UNIT_TOKEN		"4a3f4e1c0b7e5d29a8f6c3b2d1e0f9a8b7c6d5e4"
+
+/* Same layout as src/journal.c: sizes the journal in records */
+#define JOURNAL_HDR_SIZE	16
+
+struct unit_record {
+	uint32_t magic;
+	uint32_t len;
+	char uuid[KNOT_PROTOCOL_UUID_LEN + 1];
+	char token[KNOT_PROTOCOL_TOKEN_LEN + 1];
+};
+
+static char *tmpdir;
+
+static char *tmp_file(const char *name)
+{
+	char *path = g_build_filename(tmpdir, name, NULL);
+
+	g_remove(path);
+
+	return path;
+}
+
+/* Frame of 'len' payload octets, each one set to 'seed' + offset */
+static void frame_write(int fd, uint64_t pipeid, uint8_t seed, size_t len)
+{
+	uint8_t frame[FRAME_MAX_SIZE];
+	size_t i;
+
+	frame_header(frame, pipeid, len);
+	for (i = 0; i < len; i++)
+		frame[FRAME_HDR_SIZE + i] = seed + i;
+
+	g_assert_cmpint(write(fd, frame, FRAME_HDR_SIZE + len), ==,
+							FRAME_HDR_SIZE + len);
+}
+
+static void frame_check(struct frame_ring *ring, uint64_t pipeid,
+						uint8_t seed, size_t len)
+{
+	uint8_t payload[255];
+	uint64_t id = 0;
+	size_t i;
+
+	g_assert_cmpint(frame_ring_next(ring, &id), ==, len);
+	g_assert_cmpuint(id, ==, pipeid);
+
+	frame_ring_consume(ring, payload, len);
+	for (i = 0; i < len; i++)
+		g_assert_cmpuint(payload[i], ==, (uint8_t) (seed + i));
+}
+
+static void test_frame_partial(void)
+{
+	struct frame_ring ring;
+	uint8_t frame[FRAME_HDR_SIZE + 3];
+	uint64_t pipeid;
+	int fds[2];
+
+	memset(&ring, 0, sizeof(ring));
+	g_assert_cmpint(pipe(fds), ==, 0);
+
+	frame_header(frame, 0xa1b2c3d4e5, 3);
+	memcpy(&frame[FRAME_HDR_SIZE], "abc", 3);
+
+	/* Header split across reads */
+	g_assert_cmpint(write(fds[1], frame, 4), ==, 4);
+	g_assert_cmpint(frame_ring_fill(&ring, fds[0]), ==, 4);
+	g_assert_cmpint(frame_ring_next(&ring, &pipeid), ==, -EAGAIN);
+
+	/* Header complete, payload missing one octet */
+	g_assert_cmpint(write(fds[1], &frame[4], 4), ==, 4);
+	g_assert_cmpint(frame_ring_fill(&ring, fds[0]), ==, 4);
+	g_assert_cmpint(frame_ring_next(&ring, &pipeid), ==, -EAGAIN);
+
+	g_assert_cmpint(write(fds[1], &frame[8], 1), ==, 1);
+	g_assert_cmpint(frame_ring_fill(&ring, fds[0]), ==, 1);
+	frame_check(&ring, 0xa1b2c3d4e5, 'a', 3);
+
+	g_assert_cmpint(frame_ring_next(&ring, &pipeid), ==, -EAGAIN);
+	g_assert_cmpuint(ring.len, ==, 0);
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void test_frame_wraparound(void)
+{
+	struct frame_ring ring;
+	int fds[2];
+	unsigned int i;
+
+	memset(&ring, 0, sizeof(ring));
+	g_assert_cmpint(pipe(fds), ==, 0);
+
+	/* Frames crossing the end of the buffer, many per read */
+	for (i = 0; i < 32; i++) {
+		frame_write(fds[1], i, i, 200);
+		frame_write(fds[1], i + 1000, i * 3, 1);
+		frame_write(fds[1], i + 2000, 0, 0);
+
+		g_assert_cmpint(frame_ring_fill(&ring, fds[0]), ==,
+						3 * FRAME_HDR_SIZE + 201);
+
+		frame_check(&ring, i, i, 200);
+		frame_check(&ring, i + 1000, i * 3, 1);
+		frame_check(&ring, i + 2000, 0, 0);
+		g_assert_cmpuint(ring.len, ==, 0);
+	}
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void test_frame_full(void)
+{
+	struct frame_ring ring;
+	uint64_t pipeid;
+	int fds[2];
+	unsigned int i;
+
+	memset(&ring, 0, sizeof(ring));
+	g_assert_cmpint(pipe(fds), ==, 0);
+
+	/* More than the ring holds: the rest stays in the pipe */
+	for (i = 0; i < 5; i++)
+		frame_write(fds[1], i, i, 255);
+
+	g_assert_cmpint(frame_ring_fill(&ring, fds[0]), ==, FRAME_RING_SIZE);
+
+	for (i = 0; i < 3; i++)
+		frame_check(&ring, i, i, 255);
+
+	g_assert_cmpint(frame_ring_next(&ring, &pipeid), ==, -EAGAIN);
+
+	g_assert_cmpint(frame_ring_fill(&ring, fds[0]), ==,
+				5 * FRAME_MAX_SIZE - FRAME_RING_SIZE);
+	for (i = 3; i < 5; i++)
+		frame_check(&ring, i, i, 255);
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+struct table_entry {
+	uint8_t sensor_id;
+	int value;
+};
+
+static unsigned int cleared;
+
+static void table_entry_clear(gpointer data)
+{
+	cleared++;
+}
+
+static void test_table(void)
+{
+	struct sensor_table *table;
+	struct table_entry entry, *found;
+	unsigned int ids[] = { 0, 255, 7, 128 };
+	unsigned int i;
+
+	/* NULL table behaves as an empty one */
+	g_assert_null(sensor_table_lookup(NULL, 7));
+	g_assert_cmpuint(sensor_table_length(NULL), ==, 0);
+
+	cleared = 0;
+	table = sensor_table_new(sizeof(entry), table_entry_clear);
+
+	for (i = 0; i < G_N_ELEMENTS(ids); i++) {
+		entry.sensor_id = ids[i];
+		entry.value = ids[i] * 10;
+		sensor_table_insert(table, ids[i], &entry);
+	}
+
+	g_assert_cmpuint(sensor_table_length(table), ==, G_N_ELEMENTS(ids));
+	g_assert_null(sensor_table_lookup(table, 1));
+
+	/* Insertion order */
+	for (i = 0; i < G_N_ELEMENTS(ids); i++) {
+		found = sensor_table_index(table, i);
+		g_assert_cmpuint(found->sensor_id, ==, ids[i]);
+
+		found = sensor_table_lookup(table, ids[i]);
+		g_assert_nonnull(found);
+		g_assert_cmpint(found->value, ==, ids[i] * 10);
+	}
+
+	/* Replaced in place */
+	entry.sensor_id = 255;
+	entry.value = -1;
+	found = sensor_table_insert(table, 255, &entry);
+	g_assert_cmpint(found->value, ==, -1);
+	g_assert_true(found == sensor_table_index(table, 1));
+	g_assert_cmpuint(sensor_table_length(table), ==, G_N_ELEMENTS(ids));
+	g_assert_cmpuint(cleared, ==, 1);
+
+	sensor_table_free(table);
+	g_assert_cmpuint(cleared, ==, 1 + G_N_ELEMENTS(ids));
+}
+
+static void assert_data(uint8_t value_type, const knot_data *kdata,
+							const char *expected)
+{
+	GString *str = g_string_new("");
+
+	g_assert_cmpint(serializer_data(str, 3, value_type, kdata), ==, 0);
+	g_assert_cmpstr(str->str, ==, expected);
+
+	g_string_free(str, TRUE);
+}
+
+static void test_serializer_data(void)
+{
+	knot_data kdata;
+	GString *str;
+
+	memset(&kdata, 0, sizeof(kdata));
+	kdata.values.val_i.value = -42;
+	assert_data(KNOT_VALUE_TYPE_INT, &kdata,
+				"{\"sensor_id\":3,\"value\":-42}");
+
+	memset(&kdata, 0, sizeof(kdata));
+	kdata.values.val_f.multiplier = 1;
+	kdata.values.val_f.value_int = 21;
+	kdata.values.val_f.value_dec = 5;
+	assert_data(KNOT_VALUE_TYPE_FLOAT, &kdata,
+				"{\"sensor_id\":3,\"value\":21.5}");
+
+	kdata.values.val_f.multiplier = -1;
+	kdata.values.val_f.value_dec = 125;
+	assert_data(KNOT_VALUE_TYPE_FLOAT, &kdata,
+				"{\"sensor_id\":3,\"value\":-21.125}");
+
+	/* Ten digits: the widest value_dec */
+	kdata.values.val_f.multiplier = 1;
+	kdata.values.val_f.value_dec = 1000000000;
+	assert_data(KNOT_VALUE_TYPE_FLOAT, &kdata,
+				"{\"sensor_id\":3,\"value\":21.1000000000}");
+
+	/* Negative value_dec is read as unsigned */
+	kdata.values.val_f.value_dec = -1;
+	assert_data(KNOT_VALUE_TYPE_FLOAT, &kdata,
+				"{\"sensor_id\":3,\"value\":21.4294967295}");
+
+	memset(&kdata, 0, sizeof(kdata));
+	kdata.values.val_b = 1;
+	assert_data(KNOT_VALUE_TYPE_BOOL, &kdata,
+				"{\"sensor_id\":3,\"value\":true}");
+
+	kdata.values.val_b = 0;
+	assert_data(KNOT_VALUE_TYPE_BOOL, &kdata,
+				"{\"sensor_id\":3,\"value\":false}");
+
+	/* Unknown type: nothing appended */
+	str = g_string_new("[");
+	g_assert_cmpint(serializer_data(str, 3, 0xff, &kdata), ==, -EINVAL);
+	g_assert_cmpstr(str->str, ==, "[");
+	g_string_free(str, TRUE);
+}
+
+static void test_serializer_string(void)
+{
+	GString *str = g_string_new("");
+
+	serializer_string(str, "a\"b\\c\nd");
+	g_assert_cmpstr(str->str, ==, "\"a\\\"b\\\\c\\u000ad\"");
+
+	g_string_truncate(str, 0);
+	serializer_string(str, "");
+	g_assert_cmpstr(str->str, ==, "\"\"");
+
+	g_string_free(str, TRUE);
+}
+
+static void test_serializer_credentials(void)
+{
+	GString *str = g_string_new("");
+
+	g_assert_cmpint(serializer_credentials(str, " { } ", "u", NULL),
+								==, 0);
+	g_assert_cmpstr(str->str, ==, "{\"uuid\":\"u\"}");
+
+	g_string_truncate(str, 0);
+	g_assert_cmpint(serializer_credentials(str, "{\"a\":1}\n", "u", "t"),
+								==, 0);
+	g_assert_cmpstr(str->str, ==,
+			"{\"a\":1,\"uuid\":\"u\",\"token\":\"t\"}");
+
+	g_string_truncate(str, 0);
+	g_assert_cmpint(serializer_credentials(str, "[1]", "u", "t"),
+								==, -EINVAL);
+
+	/* Failed event: nothing appended */
+	g_string_assign(str, "42");
+	g_assert_cmpint(serializer_event(str, "data", "{", "u", "t"),
+								==, -EINVAL);
+	g_assert_cmpstr(str->str, ==, "42");
+
+	g_string_truncate(str, 0);
+	g_assert_cmpint(serializer_event(str, "data", "{\"a\":1}", "u", "t"),
+								==, 0);
+	g_assert_cmpstr(str->str, ==,
+			"[\"data\",{\"a\":1,\"uuid\":\"u\",\"token\":\"t\"}]");
+
+	g_string_free(str, TRUE);
+}
+
+static char *cache_uuid(unsigned int i)
+{
+	return g_strdup_printf("%08x-0000-4000-8000-%012x", i, i);
+}
+
+static void test_cache_store(void)
+{
+	char *path = tmp_file("devices");
+	char *doc;
+
+	g_assert_cmpint(cache_open(path, 600), ==, 0);
+
+	g_assert_null(cache_lookup(UNIT_UUID, UNIT_TOKEN));
+	g_assert_cmpint(cache_store(UNIT_UUID, UNIT_TOKEN, "{\"a\":1}"),
+								==, 0);
+
+	doc = cache_lookup(UNIT_UUID, UNIT_TOKEN);
+	g_assert_cmpstr(doc, ==, "{\"a\":1}");
+	g_free(doc);
+
+	/* Registered again: different token */
+	g_assert_null(cache_lookup(UNIT_UUID, "other"));
+
+	/* Persisted across restarts */
+	cache_close();
+	g_assert_cmpint(cache_open(path, 600), ==, 0);
+
+	doc = cache_lookup(UNIT_UUID, UNIT_TOKEN);
+	g_assert_cmpstr(doc, ==, "{\"a\":1}");
+	g_free(doc);
+
+	cache_remove(UNIT_UUID);
+	g_assert_null(cache_lookup(UNIT_UUID, UNIT_TOKEN));
+
+	cache_close();
+	g_free(path);
+}
+
+static void test_cache_probing(void)
+{
+	char *path = tmp_file("devices");
+	char *uuid, *doc;
+	unsigned int i;
+
+	g_assert_cmpint(cache_open(path, 600), ==, 0);
+
+	/* Enough entries to collide on the home slots */
+	for (i = 0; i < 200; i++) {
+		uuid = cache_uuid(i);
+		g_assert_cmpint(cache_store(uuid, UNIT_TOKEN, uuid), ==, 0);
+		g_free(uuid);
+	}
+
+	/* Removed slots must not break the probe sequences */
+	for (i = 0; i < 200; i += 2) {
+		uuid = cache_uuid(i);
+		cache_remove(uuid);
+		g_free(uuid);
+	}
+
+	for (i = 0; i < 200; i++) {
+		uuid = cache_uuid(i);
+		doc = cache_lookup(uuid, UNIT_TOKEN);
+		if (i % 2)
+			g_assert_cmpstr(doc, ==, uuid);
+		else
+			g_assert_null(doc);
+
+		g_free(doc);
+		g_free(uuid);
+	}
+
+	/* Stored again: removed slots are reused */
+	for (i = 0; i < 200; i += 2) {
+		uuid = cache_uuid(i);
+		g_assert_cmpint(cache_store(uuid, UNIT_TOKEN, "x"), ==, 0);
+		doc = cache_lookup(uuid, UNIT_TOKEN);
+		g_assert_cmpstr(doc, ==, "x");
+		g_free(doc);
+		g_free(uuid);
+	}
+
+	cache_close();
+	g_free(path);
+}
+
+static void test_cache_ttl(void)
+{
+	char *path = tmp_file("devices");
+	char *doc;
+
+	g_assert_cmpint(cache_open(path, 1), ==, 0);
+	g_assert_cmpint(cache_store(UNIT_UUID, UNIT_TOKEN, "{}"), ==, 0);
+
+	doc = cache_lookup(UNIT_UUID, UNIT_TOKEN);
+	g_assert_cmpstr(doc, ==, "{}");
+	g_free(doc);
+
+	/* Stamps have a resolution of one second */
+	g_usleep(2100 * 1000);
+	g_assert_null(cache_lookup(UNIT_UUID, UNIT_TOKEN));
+
+	cache_close();
+	g_free(path);
+}
+
+struct drain {
+	GPtrArray *received;
+	int fail;		/* Returned instead of uploading 'fail_json' */
+	const char *fail_json;
+};
+
+static int drain_cb(const char *uuid, const char *token, const char *json,
+							void *user_data)
+{
+	struct drain *drain = user_data;
+
+	g_assert_cmpstr(uuid, ==, UNIT_UUID);
+	g_assert_cmpstr(token, ==, UNIT_TOKEN);
+
+	if (drain->fail_json && !strcmp(json, drain->fail_json))
+		return drain->fail;
+
+	g_ptr_array_add(drain->received, g_strdup(json));
+
+	return 0;
+}
+
+static void drain_init(struct drain *drain)
+{
+	memset(drain, 0, sizeof(*drain));
+	drain->received = g_ptr_array_new_with_free_func(g_free);
+}
+
+static void drain_check(struct drain *drain, unsigned int first,
+							unsigned int count)
+{
+	char json[32];
+	unsigned int i;
+
+	g_assert_cmpuint(drain->received->len, ==, count);
+	for (i = 0; i < count; i++) {
+		snprintf(json, sizeof(json), "{\"n\":%u}", first + i);
+		g_assert_cmpstr(g_ptr_array_index(drain->received, i), ==,
+									json);
+	}
+
+	g_ptr_array_set_size(drain->received, 0);
+}
+
+static void journal_append_n(unsigned int first, unsigned int count)
+{
+	char json[32];
+	unsigned int i;
+
+	for (i = first; i < first + count; i++) {
+		snprintf(json, sizeof(json), "{\"n\":%u}", i);
+		g_assert_cmpint(journal_append(UNIT_UUID, UNIT_TOKEN, json),
+								==, 0);
+	}
+}
+
+static void test_journal_drain(void)
+{
+	char *path = tmp_file("journal");
+	struct drain drain;
+
+	drain_init(&drain);
+
+	g_assert_false(journal_enabled());
+	g_assert_cmpint(journal_append(UNIT_UUID, UNIT_TOKEN, "{}"), ==,
+								-ENOSYS);
+
+	g_assert_cmpint(journal_open(path, 1 << 20), ==, 0);
+	g_assert_true(journal_enabled());
+	g_assert_true(journal_empty());
+
+	journal_append_n(0, 5);
+	g_assert_false(journal_empty());
+
+	/* Bounded by 'count', oldest first */
+	g_assert_cmpint(journal_drain(drain_cb, 2, &drain), ==, 0);
+	drain_check(&drain, 0, 2);
+
+	/* Transient failure: stops and replays it next time */
+	drain.fail = -EIO;
+	drain.fail_json = "{\"n\":3}";
+	g_assert_cmpint(journal_drain(drain_cb, 10, &drain), ==, -EIO);
+	drain_check(&drain, 2, 1);
+
+	drain.fail_json = NULL;
+	g_assert_cmpint(journal_drain(drain_cb, 10, &drain), ==, 0);
+	drain_check(&drain, 3, 2);
+	g_assert_true(journal_empty());
+
+	/* Rejected by the cloud: dropped, the drain goes on */
+	journal_append_n(5, 3);
+	drain.fail = -ECANCELED;
+	drain.fail_json = "{\"n\":5}";
+	g_assert_cmpint(journal_drain(drain_cb, 10, &drain), ==, 0);
+	drain_check(&drain, 6, 2);
+	g_assert_true(journal_empty());
+
+	journal_close();
+	g_assert_false(journal_enabled());
+
+	g_ptr_array_free(drain.received, TRUE);
+	g_free(path);
+}
+
+static void test_journal_reopen(void)
+{
+	char *path = tmp_file("journal");
+	struct drain drain;
+	FILE *fp;
+
+	drain_init(&drain);
+
+	g_assert_cmpint(journal_open(path, 1 << 20), ==, 0);
+	journal_append_n(0, 4);
+	g_assert_cmpint(journal_drain(drain_cb, 1, &drain), ==, 0);
+	drain_check(&drain, 0, 1);
+	journal_close();
+
+	/* Torn record left by a power loss */
+	fp = fopen(path, "a");
+	g_assert_nonnull(fp);
+	fputs("torn", fp);
+	fclose(fp);
+
+	/* Only the records not drained, complete ones */
+	g_assert_cmpint(journal_open(path, 1 << 20), ==, 0);
+	g_assert_cmpint(journal_drain(drain_cb, 10, &drain), ==, 0);
+	drain_check(&drain, 1, 3);
+	g_assert_true(journal_empty());
+
+	/* Appends go after the last complete record */
+	journal_append_n(4, 1);
+	g_assert_cmpint(journal_drain(drain_cb, 10, &drain), ==, 0);
+	drain_check(&drain, 4, 1);
+
+	journal_close();
+
+	g_ptr_array_free(drain.received, TRUE);
+	g_free(path);
+}
+
+static void test_journal_full(void)
+{
+	char *path = tmp_file("journal");
+	struct drain drain;
+	size_t record;
+
+	drain_init(&drain);
+
+	/* Header + 8 records of 7 JSON octets: {"n":0} to {"n":9} */
+	record = sizeof(struct unit_record) + 7;
+	g_assert_cmpint(journal_open(path, JOURNAL_HDR_SIZE + 8 * record),
+								==, 0);
+
+	/* High watermark: 7/8 of the maximum size */
+	journal_append_n(0, 7);
+	g_assert_cmpint(journal_append(UNIT_UUID, UNIT_TOKEN, "{\"n\":7}"),
+							==, -ENOBUFS);
+
+	/* End of file reached, pending records don't fit before 'head' */
+	g_assert_cmpint(journal_drain(drain_cb, 3, &drain), ==, 0);
+	drain_check(&drain, 0, 3);
+	journal_append_n(7, 1);
+	g_assert_cmpint(journal_append(UNIT_UUID, UNIT_TOKEN, "{\"n\":8}"),
+							==, -ENOBUFS);
+
+	/* Compacted: pending records moved to the beginning of the file */
+	g_assert_cmpint(journal_drain(drain_cb, 2, &drain), ==, 0);
+	drain_check(&drain, 3, 2);
+	journal_append_n(8, 2);
+
+	g_assert_cmpint(journal_drain(drain_cb, 10, &drain), ==, 0);
+	drain_check(&drain, 5, 5);
+	g_assert_true(journal_empty());
+
+	journal_close();
+
+	g_ptr_array_free(drain.received, TRUE);
+	g_free(path);
+}
+
+int main(int argc, char *argv[])
+{
+	int err;
+
+	g_test_init(&argc, &argv, NULL);
+
+	tmpdir = g_dir_make_tmp("kunit-XXXXXX", NULL);
+	g_assert_nonnull(tmpdir);
+
+	g_test_add_func("/frame/partial", test_frame_partial);
+	g_test_add_func("/frame/wraparound", test_frame_wraparound);
+	g_test_add_func("/frame/full", test_frame_full);
+	g_test_add_func("/table/insert_lookup", test_table);
+	g_test_add_func("/serializer/data", test_serializer_data);
+	g_test_add_func("/serializer/string", test_serializer_string);
+	g_test_add_func("/serializer/credentials",
+					test_serializer_credentials);
+	g_test_add_func("/cache/store", test_cache_store);
+	g_test_add_func("/cache/probing", test_cache_probing);
+	g_test_add_func("/cache/ttl", test_cache_ttl);
+	g_test_add_func("/journal/drain", test_journal_drain);
+	g_test_add_func("/journal/reopen", test_journal_reopen);
+	g_test_add_func("/journal/full", test_journal_full);
+
+	err = g_test_run();
+
+	/* tmp_file() removes leftovers */
+	g_free(tmp_file("devices"));
+	g_free(tmp_file("journal"));
+	g_rmdir(tmpdir);
+	g_free(tmpdir);
+
+	return err;
+}